@@ -4,15 +4,35 @@
 #include  <Library/PrintLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/BaseMemoryLib.h>
+#include  <Library/BaseLib.h>
 #include  <Protocol/LoadedImage.h>
 #include  <Protocol/SimpleFileSystem.h>
 #include  <Protocol/DiskIo2.h>
 #include  <Protocol/BlockIo.h>
+#include  <Protocol/PciIo.h>
 #include  <Guid/FileInfo.h>
 #include  "frame_buffer_config.hpp"
 #include "../kernel/memory_map.hpp"
+#include "../kernel/boot_profile.hpp"
 #include  "elf.hpp"
 
+// カーネルへ渡す起動段階の記録。ローダのイメージ内に置くのでカーネルに上書きされない。
+struct BootProfile boot_profile;
+
+/** 直前の段階が終わった時刻として現在の TSC を記録する */
+void AddBootPhase(const CHAR8* name) {
+  if (boot_profile.num_entries >= BOOT_PROFILE_MAX_ENTRIES) {
+    return;
+  }
+  struct BootProfileEntry* e = &boot_profile.entries[boot_profile.num_entries++];
+  e->tsc = AsmReadTsc();
+  UINTN i = 0;
+  for (; i < BOOT_PROFILE_NAME_LEN - 1 && name[i]; ++i) {
+    e->name[i] = name[i];
+  }
+  e->name[i] = '\0';
+}
+
 EFI_STATUS GetMemoryMap(struct MemoryMap* map) {
     if (map->buffer == NULL) {
         return EFI_BUFFER_TOO_SMALL;
@@ -181,10 +201,11 @@ void CopyLoadSegments(Elf64_Ehdr* ehdr) {
   }
 }
 
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer, UINTN* size) {
   EFI_STATUS status;
 
-  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
+  // ファイル名（最長で "kernel.elf.lz4"）が入るだけの大きさを用意する
+  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 32;
   UINT8 file_info_buffer[file_info_size];
   status = file->GetInfo(
       file, &gEfiFileInfoGuid,
@@ -201,7 +222,220 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
     return status;
   }
 
-  return file->Read(file, &file_size, *buffer);
+  status = file->Read(file, &file_size, *buffer);
+  if (size) {
+    *size = file_size;
+  }
+  return status;
+}
+
+/** LZ4 のブロック 1 つを展開する。dst_begin は出力全体の先頭で，
+ * 前のブロックへの参照（ブロックが独立でないフレーム）もそこまで許す。 */
+EFI_STATUS DecompressLZ4Block(const UINT8* src, UINTN src_size,
+                              UINT8* dst_begin, UINT8** dst, UINT8* dst_end) {
+  const UINT8* ip = src;
+  const UINT8* const ip_end = src + src_size;
+  UINT8* op = *dst;
+
+  while (ip < ip_end) {
+    const UINT8 token = *ip++;
+
+    UINTN literal_len = token >> 4;
+    if (literal_len == 15) {
+      UINT8 b;
+      do {
+        if (ip >= ip_end) return EFI_VOLUME_CORRUPTED;
+        b = *ip++;
+        literal_len += b;
+      } while (b == 255);
+    }
+    if (literal_len > (UINTN)(ip_end - ip) || literal_len > (UINTN)(dst_end - op)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+    CopyMem(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (ip == ip_end) {
+      break; // 最後のシーケンスはリテラルだけ
+    }
+
+    if (ip_end - ip < 2) return EFI_VOLUME_CORRUPTED;
+    const UINTN offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (UINTN)(op - dst_begin)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINTN match_len = token & 15;
+    if (match_len == 15) {
+      UINT8 b;
+      do {
+        if (ip >= ip_end) return EFI_VOLUME_CORRUPTED;
+        b = *ip++;
+        match_len += b;
+      } while (b == 255);
+    }
+    match_len += 4;
+    if (match_len > (UINTN)(dst_end - op)) return EFI_VOLUME_CORRUPTED;
+
+    // 参照元と重なることがある（offset < match_len）ので 1 バイトずつ写す
+    const UINT8* match = op - offset;
+    for (UINTN i = 0; i < match_len; ++i) {
+      op[i] = match[i];
+    }
+    op += match_len;
+  }
+
+  *dst = op;
+  return EFI_SUCCESS;
+}
+
+/** LZ4 フレーム形式のデータを展開する。展開後の大きさがフレームに
+ * 書かれている必要がある（lz4 --content-size で作る）。 */
+EFI_STATUS DecompressLZ4Frame(const UINT8* src, UINTN src_size,
+                              VOID** buffer, UINTN* size) {
+  const UINT8* ip = src;
+  const UINT8* const ip_end = src + src_size;
+
+  if (src_size < 7 || *(const UINT32*)ip != 0x184D2204) {
+    return EFI_UNSUPPORTED;
+  }
+  ip += 4;
+  const UINT8 flags = *ip++;
+  ip++; // BD: ブロックの最大長。出力を一度に確保するので使わない
+  if ((flags >> 6) != 1) return EFI_UNSUPPORTED;       // バージョン
+  if ((flags & (1 << 3)) == 0) return EFI_UNSUPPORTED; // 展開後の大きさが無い
+  if (flags & 1) return EFI_UNSUPPORTED;               // 辞書は使わない
+  const BOOLEAN block_checksum = (flags >> 4) & 1;
+
+  if (ip_end - ip < 9) return EFI_VOLUME_CORRUPTED;
+  const UINT64 content_size = *(const UINT64*)ip;
+  ip += 8;
+  ip++; // ヘッダのチェックサム
+
+  EFI_STATUS status = gBS->AllocatePool(EfiLoaderData, content_size, buffer);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  UINT8* const dst_begin = (UINT8*)*buffer;
+  UINT8* const dst_end = dst_begin + content_size;
+  UINT8* op = dst_begin;
+
+  while (1) {
+    if (ip_end - ip < 4) goto corrupted;
+    const UINT32 block_size = *(const UINT32*)ip;
+    ip += 4;
+    if (block_size == 0) {
+      break; // 終端。後に続くかもしれない全体のチェックサムは確かめない
+    }
+    const UINTN data_size = block_size & 0x7fffffff;
+    if (data_size > (UINTN)(ip_end - ip)) goto corrupted;
+
+    if (block_size & 0x80000000) { // 圧縮されていないブロック
+      if (data_size > (UINTN)(dst_end - op)) goto corrupted;
+      CopyMem(op, ip, data_size);
+      op += data_size;
+    } else if (EFI_ERROR(DecompressLZ4Block(ip, data_size, dst_begin, &op, dst_end))) {
+      goto corrupted;
+    }
+    ip += data_size + (block_checksum ? 4 : 0);
+  }
+
+  if (op != dst_end) goto corrupted;
+  *size = content_size;
+  return EFI_SUCCESS;
+
+corrupted:
+  gBS->FreePool(*buffer);
+  *buffer = NULL;
+  return EFI_VOLUME_CORRUPTED;
+}
+
+/** 1 ミリ秒あたりの TSC のカウント数 */
+UINT64 TscPerMillisecond() {
+  const UINT64 begin = AsmReadTsc();
+  gBS->Stall(1000);
+  return AsmReadTsc() - begin;
+}
+
+/** ファイルの更新日時を大小比較できる秒数にする（タイムゾーンは考えない）。取れなければ 0。 */
+UINT64 ModificationSeconds(EFI_FILE_PROTOCOL* file) {
+  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 32;
+  UINT8 file_info_buffer[file_info_size];
+  if (EFI_ERROR(file->GetInfo(file, &gEfiFileInfoGuid, &file_info_size, file_info_buffer))) {
+    return 0;
+  }
+  EFI_TIME* t = &((EFI_FILE_INFO*)file_info_buffer)->ModificationTime;
+  return (((((UINT64)t->Year * 12 + t->Month) * 31 + t->Day) * 24 + t->Hour) * 60
+          + t->Minute) * 60 + t->Second;
+}
+
+/** name.lz4 と name のうち更新日時が新しい方を読む。同じなら name.lz4 を選ぶ。
+ * name.lz4 は展開して返す。どちらも無ければ EFI_NOT_FOUND を返す。
+ * 古い name.lz4 が残っていても，作り直した name の方が使われる。
+ * 読み込みと展開にかかった TSC を加え，それぞれの終わりを起動段階
+ * read_phase, decompress_phase として記録する。 */
+EFI_STATUS ReadImageFile(EFI_FILE_PROTOCOL* root_dir, CHAR16* name, CHAR16* lz4_name,
+                    VOID** buffer, UINTN* size,
+                    UINT64* read_tsc, UINT64* decompress_tsc,
+                    const CHAR8* read_phase, const CHAR8* decompress_phase) {
+  EFI_STATUS status;
+  EFI_FILE_PROTOCOL* file;
+  EFI_FILE_PROTOCOL* plain_file;
+  BOOLEAN compressed = TRUE;
+
+  UINT64 begin = AsmReadTsc();
+  status = root_dir->Open(root_dir, &file, lz4_name, EFI_FILE_MODE_READ, 0);
+  EFI_STATUS plain_status = root_dir->Open(root_dir, &plain_file, name, EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR(status)) {
+    if (EFI_ERROR(plain_status)) {
+      return plain_status;
+    }
+    compressed = FALSE;
+    file = plain_file;
+  } else if (!EFI_ERROR(plain_status)) {
+    if (ModificationSeconds(plain_file) > ModificationSeconds(file)) {
+      Print(L"%s is older than %s; ignored\n", lz4_name, name);
+      file->Close(file);
+      compressed = FALSE;
+      file = plain_file;
+    } else {
+      plain_file->Close(plain_file);
+    }
+  }
+
+  VOID* file_buffer;
+  UINTN file_size;
+  status = ReadFile(file, &file_buffer, &file_size);
+  file->Close(file);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  *read_tsc += AsmReadTsc() - begin;
+  AddBootPhase(read_phase);
+
+  if (!compressed) {
+    *buffer = file_buffer;
+    if (size) {
+      *size = file_size;
+    }
+    return EFI_SUCCESS;
+  }
+
+  begin = AsmReadTsc();
+  UINTN content_size;
+  status = DecompressLZ4Frame(file_buffer, file_size, buffer, &content_size);
+  gBS->FreePool(file_buffer);
+  *decompress_tsc += AsmReadTsc() - begin;
+  AddBootPhase(decompress_phase);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  Print(L"%s: %lu -> %lu bytes\n", lz4_name, file_size, content_size);
+  if (size) {
+    *size = content_size;
+  }
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS OpenBlockIoProtocolForLoadedImage(
@@ -251,15 +485,46 @@ EFI_STATUS ReadBlocks(
   return status;
 }
 
+/** カーネルが自前で読めるブロックデバイス（レガシー virtio-blk, 1af4:1001）があるか調べる */
+BOOLEAN HasKernelBlockDevice() {
+  EFI_STATUS status;
+  UINTN num_handles;
+  EFI_HANDLE* handles;
+
+  status = gBS->LocateHandleBuffer(
+      ByProtocol, &gEfiPciIoProtocolGuid, NULL, &num_handles, &handles);
+  if (EFI_ERROR(status)) {
+    return FALSE;
+  }
+
+  BOOLEAN found = FALSE;
+  for (UINTN i = 0; i < num_handles && !found; ++i) {
+    EFI_PCI_IO_PROTOCOL* pci_io;
+    status = gBS->HandleProtocol(handles[i], &gEfiPciIoProtocolGuid, (VOID**)&pci_io);
+    if (EFI_ERROR(status)) {
+      continue;
+    }
+    UINT32 id; // 下位 16 ビットがベンダ ID，上位 16 ビットがデバイス ID
+    status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32, 0, 1, &id);
+    if (!EFI_ERROR(status) && id == ((0x1001u << 16) | 0x1af4u)) {
+      found = TRUE;
+    }
+  }
+  gBS->FreePool(handles);
+  return found;
+}
+
 EFI_STATUS EFIAPI UefiMain(
   EFI_HANDLE image_handle,
   EFI_SYSTEM_TABLE* system_table) {
   EFI_STATUS status;
+  AddBootPhase("loader start");
   Print(L"Hello, Mikan World!\n");
 
   CHAR8 memmap_buf[4096 * 4];
   struct MemoryMap memmap = {sizeof(memmap_buf), memmap_buf, 0, 0, 0, 0};
   PrintAndHaltIfError(GetMemoryMap(&memmap), L"get memory map");
+  AddBootPhase("memory map");
 
   EFI_FILE_PROTOCOL* root_dir;
   PrintAndHaltIfError(
@@ -311,22 +576,19 @@ EFI_STATUS EFIAPI UefiMain(
       frame_buffer[i] = 255;
     }
   }
+  AddBootPhase("gop");
 
   //-------------------------------------
   //read kernel
   //-------------------------------------
-  EFI_FILE_PROTOCOL* kernel_file;
-  status = root_dir->Open(
-    root_dir, &kernel_file, L"\\kernel.elf",
-    EFI_FILE_MODE_READ, 0
-  );
-  PrintAndHaltIfError(status, L"open file '\\kernel.elf'");
-
+  // kernel.elf.lz4 が kernel.elf より古くなければそちらを読んで展開する。
+  // 遅いメディアでは読み込みの方が展開より何倍も時間がかかる。
+  UINT64 read_tsc = 0, decompress_tsc = 0;
   VOID* kernel_buffer;
-  PrintAndHaltIfError(
-    ReadFile(kernel_file, &kernel_buffer),
-    L"error"
-  );
+  status = ReadImageFile(root_dir, L"\\kernel.elf", L"\\kernel.elf.lz4",
+                    &kernel_buffer, NULL, &read_tsc, &decompress_tsc,
+                    "kernel read", "kernel decompress");
+  PrintAndHaltIfError(status, L"load kernel");
 
   Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
   UINT64 kernel_first_addr, kernel_last_addr;
@@ -341,6 +603,7 @@ EFI_STATUS EFIAPI UefiMain(
   PrintAndHaltIfError(status, L"allocate pages");
 
   CopyLoadSegments(kernel_ehdr);
+  AddBootPhase("copy load segments");
   Print(L"Kernel: 0x%0lx (%lu bytes)\n", kernel_first_addr, kernel_last_addr);
 
   PrintAndHaltIfError(
@@ -351,18 +614,17 @@ EFI_STATUS EFIAPI UefiMain(
   //-------------------------------------
   //read volume
   //-------------------------------------
-  VOID* volume_image;
-
-  EFI_FILE_PROTOCOL* volume_file;
-  status = root_dir->Open(
-    root_dir, &volume_file, L"\\fat_disk",
-    EFI_FILE_MODE_READ, 0);
-  if (status == EFI_SUCCESS) {
-      PrintAndHaltIfError(
-        ReadFile(volume_file, &volume_image),
-        L"failed to read volume file"
-      );
-  } else {
+  // 開発用に \fat_disk があればそれをイメージとして渡す。
+  // 無ければ，カーネルが virtio-blk から必要な分だけ読むので何も渡さない。
+  // カーネルが扱えないデバイス（IDE など）しか無ければ，従来どおり Block I/O で読んで渡す。
+  VOID* volume_image = NULL;
+
+  status = ReadImageFile(root_dir, L"\\fat_disk", L"\\fat_disk.lz4",
+                    &volume_image, NULL, &read_tsc, &decompress_tsc,
+                    "volume read", "volume decompress");
+  if (status != EFI_NOT_FOUND) {
+    PrintAndHaltIfError(status, L"load volume file");
+  } else if (!HasKernelBlockDevice()) {
     EFI_BLOCK_IO_PROTOCOL* block_io;
     PrintAndHaltIfError(
       OpenBlockIoProtocolForLoadedImage(image_handle, &block_io),
@@ -377,18 +639,29 @@ EFI_STATUS EFIAPI UefiMain(
 
     Print(L"Reading %lu bytes (Present %d, BlockSize %u, LastBlock %u)\n",
           volume_bytes, media->MediaPresent, media->BlockSize, media->LastBlock);
-    
+
+    UINT64 begin = AsmReadTsc();
     PrintAndHaltIfError(
       ReadBlocks(block_io, media->MediaId, volume_bytes, &volume_image),
       L"failed to read blocks"
     );
+    read_tsc += AsmReadTsc() - begin;
+    AddBootPhase("volume read");
+  }
+
+  {
+    const UINT64 tsc_per_ms = TscPerMillisecond();
+    boot_profile.tsc_per_ms = tsc_per_ms;
+    if (tsc_per_ms > 0) {
+      Print(L"Load time: read %lu ms, decompress %lu ms\n",
+        read_tsc / tsc_per_ms, decompress_tsc / tsc_per_ms);
+    }
   }
 
-  
-  
   //-------------------------------------
   // Exit BootServices
   //-------------------------------------
+  AddBootPhase("tsc calibration");
   status = gBS->ExitBootServices(image_handle, memmap.map_key);
   if (EFI_ERROR(status)) {
     status = GetMemoryMap(&memmap);
@@ -403,6 +676,8 @@ EFI_STATUS EFIAPI UefiMain(
     }
   }
 
+  AddBootPhase("exit boot services");
+
   //-------------------------------------
   // Call Kernel
   //-------------------------------------
@@ -439,9 +714,10 @@ EFI_STATUS EFIAPI UefiMain(
     typedef void EntryPointType(const struct FrameBufferConfig*,
                                 const struct MemoryMap*,
                                 const VOID*,
-                                VOID*);
+                                VOID*,
+                                const struct BootProfile*);
     EntryPointType* entry_point = (EntryPointType*)entry_addr;
-    entry_point(&config, &memmap, acpi_table, volume_image);
+    entry_point(&config, &memmap, acpi_table, volume_image, &boot_profile);
   }
   Print(L"All done\n");
   
@@ -0,0 +1,22 @@
+#include "clock.h"
+
+#include "../kernel/clock_page.hpp"
+#include "syscall.h"
+
+static inline uint64_t ReadTSC(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t MonotonicNanoseconds(void) {
+  const volatile struct ClockPage* page =
+    (const volatile struct ClockPage*)CLOCK_PAGE_ADDR;
+  if (page->tsc_freq == 0) {
+    struct SyscallResult tick = SyscallGetCurrentTick();
+    return tick.value * (1000000000ull / tick.error);
+  }
+
+  const unsigned __int128 delta = ReadTSC() - page->base_tsc;
+  return (uint64_t)((delta * page->mult) >> page->shift);
+}
@@ -0,0 +1,19 @@
+#ifdef __cplusplus
+#include <cstdint>
+
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+/** 起動からの経過時間をナノ秒単位で返す。
+ *
+ * カーネルが読み込み専用でマップする時刻情報ページと TSC から計算するため，
+ * システムコールを発行しない。TSC が使えない環境ではタイマ割り込みの
+ * 分解能（SyscallGetCurrentTick）に落ちる。
+ */
+uint64_t MonotonicNanoseconds(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
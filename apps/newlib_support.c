@@ -1,4 +1,5 @@
 ﻿#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
@@ -6,13 +7,30 @@
 #include "syscall.h"
 
 int close(int fd) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallCloseFile(fd);
+  if (res.error == 0) {
+    return 0;
+  }
+  errno = res.error;
   return -1;
 }
 
 int fstat(int fd, struct stat* buf) {
-  errno = EBADF;
-  return -1;
+  if (fd >= 0 && fd <= 2) {
+    buf->st_mode = S_IFCHR;
+    return 0;
+  }
+  // 大きさは末尾へ移動して得る
+  struct SyscallResult cur = SyscallSeekFile(fd, 0, SEEK_CUR);
+  if (cur.error) {
+    errno = cur.error;
+    return -1;
+  }
+  struct SyscallResult end = SyscallSeekFile(fd, 0, SEEK_END);
+  SyscallSeekFile(fd, cur.value, SEEK_SET);
+  buf->st_mode = S_IFREG;
+  buf->st_size = end.value;
+  return 0;
 }
 
 int isatty(int fd) {
@@ -21,12 +39,29 @@ int isatty(int fd) {
 }
 
 off_t lseek(int fd, off_t offset, int whence) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallSeekFile(fd, offset, whence);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
+  return -1;
+}
+
+int open(const char* path, int flags, ...) {
+  struct SyscallResult res = SyscallOpenFile(path, flags);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
   return -1;
 }
 
 ssize_t read(int fd, void* buf, size_t count) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallReadFile(fd, buf, count);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
   return -1;
 }
 
@@ -36,7 +71,8 @@ caddr_t sbrk(int incr) {
 }
 
 ssize_t write(int fd, const void* buf, size_t count) {
-  struct SyscallResult res = SyscallPutString(fd, (uint64_t)buf, count);
+  struct SyscallResult res = fd <= 2 ? SyscallPutString(fd, (uint64_t)buf, count)
+                                     : SyscallWriteFile(fd, buf, count);
   if (res.error == 0) {
     return res.value;
   }
@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <random>
 #include "../syscall.h"
+#include "../clock.h"
 
 static constexpr int kWidth = 100, kHeight = 100;
 
@@ -19,7 +20,7 @@ extern "C" void main(int argc, char** argv) {
     num_stars = atoi(argv[1]);
   }
 
-  auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+  const auto ns_start = MonotonicNanoseconds();
 
   std::default_random_engine rand_engine;
   std::uniform_int_distribution x_dist(0, kWidth - 2), y_dist(0, kHeight - 2);
@@ -31,10 +32,9 @@ extern "C" void main(int argc, char** argv) {
   }
   SyscallWinRedraw(layer_id);
 
-  auto tick_end = SyscallGetCurrentTick();
-  printf("%d stars in %lu ms.\n",
-          num_stars,
-          (tick_end.value - tick_start) * 1000 / timer_freq);
+  const auto elapsed_us = (MonotonicNanoseconds() - ns_start) / 1000;
+  printf("%d stars in %lu.%03lu ms.\n",
+          num_stars, elapsed_us / 1000, elapsed_us % 1000);
 
   exit(0);
 }
@@ -20,4 +20,11 @@ define_syscall GetCurrentTick,   0x80000006
 define_syscall WinRedraw,        0x80000007
 define_syscall WinDrawLine,      0x80000008
 define_syscall CloseWindow,      0x80000009
-define_syscall ReadEvent,        0x8000000a
\ No newline at end of file
+define_syscall ReadEvent,        0x8000000a
+define_syscall PerfCounters,     0x8000000b
+define_syscall OpenFile,         0x8000000c
+define_syscall ReadFile,         0x8000000d
+define_syscall SeekFile,         0x8000000e
+define_syscall CloseFile,        0x8000000f
+define_syscall MapFile,          0x80000010
+define_syscall WriteFile,        0x80000011
\ No newline at end of file
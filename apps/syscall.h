@@ -10,6 +10,7 @@ extern "C" {
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/perf_event.hpp"
 
 
 struct SyscallResult {
@@ -34,6 +35,16 @@ struct SyscallResult SyscallWinDrawLine(
 
 struct SyscallResult SyscallCloseWindow(uint64_t layer_id_flags);
 struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
+/* events はビット (1 << PerfEvent) の集合, counts は kPerfNumEvents 要素（NULL 可） */
+struct SyscallResult SyscallPerfCounters(enum PerfOp op, uint32_t events, uint64_t* counts);
+
+struct SyscallResult SyscallOpenFile(const char* path, int flags);
+struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
+struct SyscallResult SyscallSeekFile(int fd, int64_t offset, int whence);
+struct SyscallResult SyscallCloseFile(int fd);
+/* ファイル全体を読み込み専用でマップし，先頭アドレスを返す。*file_size にファイルの大きさを書く。 */
+struct SyscallResult SyscallMapFile(int fd, size_t* file_size);
+struct SyscallResult SyscallWriteFile(int fd, const void* buf, size_t count);
 
 #ifdef __cplusplus
 } // extern "C"
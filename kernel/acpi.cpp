@@ -67,7 +67,28 @@ namespace acpi {
         return (this->header.length - sizeof(DescriptionHeader)) /sizeof(uint64_t);
     }
 
+    size_t MADT::EnabledLocalAPICIDs(uint8_t* ids, size_t max_ids) const {
+        // エントリは type（1 バイト）, length（1 バイト）から始まる可変長の構造
+        auto p = reinterpret_cast<const uint8_t*>(this + 1);
+        const auto end = reinterpret_cast<const uint8_t*>(this) + this->header.length;
+        size_t n = 0;
+        while (p + 2 <= end && p[1] >= 2) {
+            const uint8_t type = p[0], length = p[1];
+            if (type == 0 && length >= 8) { // Processor Local APIC
+                const uint8_t apic_id = p[3];
+                const uint32_t flags = p[4] | p[5] << 8 | p[6] << 16 | p[7] << 24;
+                if ((flags & 1) && n < max_ids) {
+                    ids[n++] = apic_id;
+                }
+            }
+            p += length;
+        }
+        return n;
+    }
+
     const FADT* fadt;
+    const MADT* madt;
+    const MCFG* mcfg;
 
     void WaitMilliseconds(unsigned long msec) {
         const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -97,11 +118,16 @@ namespace acpi {
         }
 
         fadt = nullptr;
+        madt = nullptr;
+        mcfg = nullptr;
         for (int i = 0; i < xsdt.Count(); ++i) {
             const auto& entry = xsdt[i];
-            if (entry.IsValid("FACP")) {
+            if (fadt == nullptr && entry.IsValid("FACP")) {
                 fadt = reinterpret_cast<const FADT*>(&entry);
-                break;
+            } else if (madt == nullptr && entry.IsValid("APIC")) {
+                madt = reinterpret_cast<const MADT*>(&entry);
+            } else if (mcfg == nullptr && entry.IsValid("MCFG")) {
+                mcfg = reinterpret_cast<const MCFG*>(&entry);
             }
         }
 
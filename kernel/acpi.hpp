@@ -54,7 +54,41 @@ namespace acpi {
         char reserved3[276 - 116];
     } __attribute__((packed));
 
+    struct MADT {
+        DescriptionHeader header;
+
+        uint32_t lapic_address;
+        uint32_t flags;
+
+        /** @brief 有効なプロセッサの Local APIC ID を ids に書き込み，その個数を返す。 */
+        size_t EnabledLocalAPICIDs(uint8_t* ids, size_t max_ids) const;
+    } __attribute__((packed));
+
+    /** @brief PCI Express のメモリマップドコンフィグレーション空間（ECAM）の表 */
+    struct MCFG {
+        DescriptionHeader header;
+        char reserved[8];
+
+        struct Entry {
+            uint64_t base_address; // バス 0 のコンフィグレーション空間に当たるアドレス
+            uint16_t segment;
+            uint8_t start_bus, end_bus;
+            uint32_t reserved;
+        } __attribute__((packed));
+
+        size_t Count() const {
+            return (header.length - sizeof(MCFG)) / sizeof(Entry);
+        }
+        const Entry& operator[](size_t i) const {
+            return reinterpret_cast<const Entry*>(this + 1)[i];
+        }
+    } __attribute__((packed));
+
     extern const FADT* fadt;
+    /// MADT が見つからなければ nullptr
+    extern const MADT* madt;
+    /// MCFG が見つからなければ nullptr
+    extern const MCFG* mcfg;
     const int kPMTimerFreq = 3579545;
 
     void WaitMilliseconds(unsigned long msec);
@@ -0,0 +1,110 @@
+; ap_boot.asm
+;
+; AP（アプリケーションプロセッサ）起動用のトランポリン。
+; InitializeSMP が ApBootStart から ApBootEnd までを 1 MiB 未満のページへコピーし，
+; そのページ番号を SIPI のベクタとして AP を起動する。
+; AP は 16 ビットリアルモードで CS = ページ番号 << 8, IP = 0 から実行を始めるので，
+; コード中の絶対アドレスはすべて実行時にページの先頭アドレスから計算する。
+
+section .text
+
+global ApBootStart
+global ApBootParams
+global ApBootEnd
+
+bits 16
+ApBootStart:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4  ; ebx = トランポリンの物理アドレス
+
+    ; GDTR と遠隔ジャンプ先をトランポリンの位置に合わせて書き換える
+    lea eax, [ebx + (ApBootGDT - ApBootStart)]
+    mov [ApBootGDTR - ApBootStart + 2], eax
+    lea eax, [ebx + (.pm32 - ApBootStart)]
+    mov [.far32 - ApBootStart], eax
+    lea eax, [ebx + (.lm64 - ApBootStart)]
+    mov [.far64 - ApBootStart], eax
+
+    lgdt [ApBootGDTR - ApBootStart]
+
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    jmp dword far [.far32 - ApBootStart]
+
+.far32:
+    dd 0
+    dw 0x18  ; 32 ビットコードセグメント
+
+bits 32
+.pm32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10)  ; PAE, OSFXSR, OSXMMEXCPT
+    mov cr4, eax
+
+    mov eax, [ebx + (ApBootParams - ApBootStart) + 0]  ; CR3
+    mov cr3, eax
+
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+
+    mov eax, cr0
+    or eax, (1 << 31) | (1 << 1)  ; PG, MP
+    and eax, ~(1 << 2)            ; EM
+    mov cr0, eax
+
+    jmp far [ebx + (.far64 - ApBootStart)]
+
+.far64:
+    dd 0
+    dw 0x08  ; 64 ビットコードセグメント
+
+bits 64
+.lm64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    fninit
+    mov rsp, [rbx + (ApBootParams - ApBootStart) + 8]   ; スタック
+    mov rax, [rbx + (ApBootParams - ApBootStart) + 16]  ; 入口関数
+    mov edi, [rbx + (ApBootParams - ApBootStart) + 24]  ; CPU 番号
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ApBootGDT:
+    dq 0                   ; null
+    dq 0x00af9a000000ffff  ; 0x08: 64 ビットコード
+    dq 0x00cf92000000ffff  ; 0x10: データ
+    dq 0x00cf9a000000ffff  ; 0x18: 32 ビットコード
+ApBootGDTR:
+    dw ApBootGDTR - ApBootGDT - 1
+    dd 0
+
+align 8
+ApBootParams:  ; struct APBootParams（smp.cpp）と同じ並び
+    dq 0  ; cr3
+    dq 0  ; stack_end
+    dq 0  ; entry
+    dd 0  ; cpu
+    dd 0
+ApBootEnd:
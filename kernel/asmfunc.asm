@@ -19,6 +19,34 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut16  ; void IoOut16(uint16_t addr, uint16_t data);
+IoOut16:
+    mov dx, di    ; dx = addr
+    mov ax, si    ; ax = data
+    out dx, ax
+    ret
+
+global IoIn16  ; uint16_t IoIn16(uint16_t addr);
+IoIn16:
+    mov dx, di    ; dx = addr
+    xor eax, eax
+    in ax, dx
+    ret
+
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di    ; dx = addr
+    mov ax, si    ; al = data
+    out dx, al
+    ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di    ; dx = addr
+    xor eax, eax
+    in al, dx
+    ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax  ; also clears upper 32 bits of rax
@@ -81,6 +109,21 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR2  ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+global GetCR0  ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0  ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -93,7 +136,8 @@ KernelMain:
     jmp .fin
 
 global SwitchContext
-SwitchContext  ; void SwitchContext(void* next_ctx, void* current_ctx);
+SwitchContext  ; void SwitchContext(void* next_ctx, void* current_ctx,
+               ;                    void* lock, void* stack_end);
     mov [rsi + 0x40], rax
     mov [rsi + 0x48], rbx
     mov [rsi + 0x50], rcx
@@ -130,7 +174,14 @@ SwitchContext  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSE の状態は #NM で遅延して保存する（IntHandlerNM）
+
+    ; 現在のタスクのスタックを離れてから lock を解放する。
+    ; 解放後は他の CPU が現在のタスクを再開し得る。
+    mov rcx, [rsi + 0x50]  ; stack_end
+    mov rdx, [rsi + 0x58]  ; lock
+    mov rsp, rcx
+    mov dword [rdx], 0
     ; fall through to RestoreContext
 
 global RestoreContext
@@ -142,9 +193,7 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     push qword [rdi + 0x20] ; CS
     push qword [rdi + 0x08] ; RIP
 
-    ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ; コンテキストの復帰（FPU/SSE の状態は #NM で遅延して復帰する）
     mov rax, [rdi + 0x00]
     mov cr3, rax
     mov rax, [rdi + 0x30]
@@ -199,8 +248,8 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov rbp, rsp
 
     ; スタック上に TaskContext 型の構造を構築する
+    ; fxsave_area の分は場所だけ確保し，FPU/SSE の状態は保存しない
     sub rsp, 512
-    fxsave [rsp]
     push r15
     push r14
     push r13
@@ -250,12 +299,54 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+extern DeviceNotAvailable
+; void* DeviceNotAvailable(const void* live_fxsave_area);
+
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    push rbp
+    mov rbp, rsp
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    ; FPU レジスタに載っている状態（前の持ち主のもの）をまずスタックに退避する
+    clts
+    sub rsp, 512
+    and rsp, 0xfffffffffffffff0
+    fxsave [rsp]
+
+    mov rdi, rsp
+    call DeviceNotAvailable
+    test rax, rax
+    jz .no_restore
+    fxrstor [rax]
+.no_restore:
+
+    lea rsp, [rbp - 8 * 9]
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    pop rbp
+    iretq
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -270,8 +361,57 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
+global ReadMSR
+ReadMSR:  ; uint64_t ReadMSR(uint32_t msr);
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global MonitorAddress
+MonitorAddress:  ; void MonitorAddress(const volatile void* addr);
+    mov rax, rdi
+    xor ecx, ecx
+    xor edx, edx
+    monitor
+    ret
+
+global StiMWait
+StiMWait:  ; void StiMWait(uint32_t hint);
+    mov eax, edi
+    xor ecx, ecx
+    sti  ; 次の命令までは割り込みが入らないので，mwait に入る前の割り込みも取りこぼさない
+    mwait
+    ret
+
+global ReadTSC
+ReadTSC:  ; uint64_t ReadTSC(void);
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global CPUID
+CPUID:  ; void CPUID(uint32_t eax, uint32_t ecx, uint32_t* a,
+        ;            uint32_t* b, uint32_t* c, uint32_t* d);
+    push rbx
+    mov r10, rdx  ; a
+    mov r11, rcx  ; b
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
 extern GetCurrentTaskOSStackPointer
 extern syscall_table
+extern trace_enabled
+extern TraceSyscall
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
     push rbp
@@ -301,6 +441,29 @@ SyscallEntry:  ; void SyscallEntry(void);
     pop rax
     and rsp, 0xfffffffffffffff0
 
+    ; トレースが有効ならシステムコールの呼び出しを記録する
+    cmp byte [trace_enabled], 0
+    je .call
+    push rax
+    push rdi
+    push rsi
+    push rdx
+    push rcx
+    push r8
+    push r9
+    sub rsp, 8  ; 16 バイト境界を保つ
+    mov edi, eax
+    call TraceSyscall
+    add rsp, 8
+    pop r9
+    pop r8
+    pop rcx
+    pop rdx
+    pop rsi
+    pop rdi
+    pop rax
+
+.call:
     call [syscall_table + 8 * eax]
     ; rbx, r12-r15 は callee-saved なので呼び出し側で保存しない
     ; rax は戻り値用なので呼び出し側で保存しない
@@ -5,6 +5,10 @@
 extern "C" {
   void IoOut32(uint16_t addr, uint32_t data);
   uint32_t IoIn32(uint16_t addr);
+  void IoOut16(uint16_t addr, uint16_t data);
+  uint16_t IoIn16(uint16_t addr);
+  void IoOut8(uint16_t addr, uint8_t data);
+  uint8_t IoIn8(uint16_t addr);
   uint16_t GetCS(void);
   void LoadIDT(uint16_t limit, uint64_t offset);
   void LoadGDT(uint16_t limit, uint64_t offset);
@@ -12,11 +16,22 @@ extern "C" {
   void SetDSAll(uint16_t value);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
-  void SwitchContext(void* next_ctx, void* current_ctx);
+  uint64_t GetCR2();
+  uint64_t GetCR0();
+  void SetCR0(uint64_t value);
+  void SwitchContext(void* next_ctx, void* current_ctx,
+                     void* lock, void* stack_end);
   void RestoreContext(void* ctx);
   int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
   void IntHandlerLAPICTimer();
+  void IntHandlerNM();
   void LoadTR(uint16_t sel);
   void WriteMSR(uint32_t msr, uint64_t value);
+  uint64_t ReadMSR(uint32_t msr);
+  uint64_t ReadTSC(void);
+  void MonitorAddress(const volatile void* addr);
+  void StiMWait(uint32_t hint);
+  void CPUID(uint32_t eax, uint32_t ecx, uint32_t* a,
+             uint32_t* b, uint32_t* c, uint32_t* d);
   void SyscallEntry(void);
 }
@@ -0,0 +1,209 @@
+#include "block_device.hpp"
+
+#include "logger.hpp"
+#include "message.hpp"
+#include "pci.hpp"
+#include "task.hpp"
+#include "virtio_blk.hpp"
+
+BlockDevice* boot_block_device;
+
+namespace {
+    std::vector<BlockDevice*> block_devices;
+    uint64_t block_io_task_id = 0;
+
+    void Complete(BlockRequest* req, Error::Code result) {
+        // on_complete が req を解放しうるので，先に waiter を取り出しておく
+        BlockIOWaiter* waiter = req->waiter;
+        if (req->on_complete) {
+            req->on_complete(req, result);
+        }
+        if (waiter) {
+            if (result != Error::kSuccess) {
+                waiter->errors.fetch_add(1);
+            }
+            // remaining を減らした後は待ち手が waiter を解放しうるので，先に読んでおく。
+            // 完了を数えるのは I/O タスクだけなので，ここで読んだ errors が最後の値になる。
+            Message msg{Message::kBlockIOCompleted};
+            msg.arg.block_io.tag = waiter->tag;
+            msg.arg.block_io.errors = waiter->errors.load();
+            const uint64_t task_id = waiter->task_id;
+            if (waiter->remaining.fetch_sub(1) == 1) {
+                task_manager->SendMessage(task_id, msg);
+            }
+        }
+    }
+
+    void TaskBlockIO(uint64_t task_id, int64_t data) {
+        Task& task = task_manager->CurrentTask();
+        while (true) {
+            __asm__("cli");
+            auto msg = task.ReceiveMessage();
+            if (!msg) {
+                task.Sleep();
+                __asm__("sti");
+                continue;
+            }
+            __asm__("sti");
+
+            if (msg->type == Message::kBlockIOKick) {
+                for (auto dev : block_devices) {
+                    dev->Process();
+                }
+            }
+        }
+    }
+}
+
+void BlockDevice::Submit(BlockRequest* req) {
+    const bool intr = DisableInterrupts();
+    pending_lock_.Lock();
+    pending_.push_back(req);
+    pending_lock_.Unlock();
+    RestoreInterrupts(intr);
+
+    if (block_io_task_id) {
+        task_manager->SendMessage(block_io_task_id, Message{Message::kBlockIOKick});
+    } else {
+        Process();
+    }
+}
+
+void BlockDevice::Process() {
+    std::vector<BlockCommand*> done;
+    ReapCommands(done);
+    for (auto cmd : done) {
+        for (auto req : cmd->requests) {
+            Complete(req, cmd->result);
+        }
+        delete cmd;
+        --in_flight_;
+    }
+
+    while (true) {
+        const bool intr = DisableInterrupts();
+        pending_lock_.Lock();
+        if (pending_.empty() || (QueueDepth() > 0 && in_flight_ >= QueueDepth())) {
+            pending_lock_.Unlock();
+            RestoreInterrupts(intr);
+            return;
+        }
+
+        if (QueueDepth() == 0) {
+            auto req = pending_.front();
+            pending_.pop_front();
+            pending_lock_.Unlock();
+            RestoreInterrupts(intr);
+            Complete(req, ExecuteSync(*req));
+            continue;
+        }
+
+        auto first = pending_.front();
+        if (first->segments.size() > MaxSegments()) { // 1 要求だけで区間数の上限を超えている
+            pending_.pop_front();
+            pending_lock_.Unlock();
+            RestoreInterrupts(intr);
+            Complete(first, Error::kIndexOutOfRange);
+            continue;
+        }
+
+        // 先頭の要求に，LBA が続いている同種の要求を区間数の上限まで併合する
+        auto cmd = new BlockCommand{first->op, first->lba};
+        uint64_t next_lba = cmd->lba;
+        while (!pending_.empty()) {
+            auto req = pending_.front();
+            if (req->op != cmd->op || req->lba != next_lba ||
+                cmd->segments.size() + req->segments.size() > MaxSegments()) {
+                break;
+            }
+            pending_.pop_front();
+            for (const auto& seg : req->segments) {
+                cmd->segments.push_back(seg);
+                next_lba += seg.bytes / BlockSize();
+            }
+            cmd->requests.push_back(req);
+        }
+        pending_lock_.Unlock();
+        RestoreInterrupts(intr);
+
+        if (!StartCommand(*cmd)) {
+            for (auto req : cmd->requests) {
+                Complete(req, Error::kFull);
+            }
+            delete cmd;
+            continue;
+        }
+        ++in_flight_;
+    }
+}
+
+Error::Code BlockDevice::ExecuteSync(const BlockRequest& req) {
+    uint64_t lba = req.lba;
+    for (const auto& seg : req.segments) {
+        const size_t n = seg.bytes / BlockSize();
+        auto err = req.op == BlockRequest::kRead ? Read(lba, seg.buf, n)
+                                                 : Write(lba, seg.buf, n);
+        if (err) {
+            return err.Cause();
+        }
+        lba += n;
+    }
+    return Error::kSuccess;
+}
+
+void InitializeBlockDevice() {
+    for (auto dev_ptr : pci::FindDevicesByVendor(0x1af4)) {
+        auto& dev = *dev_ptr;
+        if (!virtio::IsLegacyBlockDevice(dev)) {
+            continue;
+        }
+        auto blk = new virtio::BlockDevice{dev};
+        if (auto err = blk->Initialize()) {
+            Log(kError, "virtio-blk %d.%d.%d: %s\n",
+                dev.bus, dev.device, dev.function, err.Name());
+            delete blk;
+            continue;
+        }
+        Log(kInfo, "virtio-blk %d.%d.%d: %lu blocks, queue depth %d\n",
+            dev.bus, dev.device, dev.function, blk->NumBlocks(), blk->QueueDepth());
+        block_devices.push_back(blk);
+        if (boot_block_device == nullptr) {
+            boot_block_device = blk;
+        }
+    }
+}
+
+void InitializeBlockIOTask() {
+    block_io_task_id = task_manager->NewTask()
+        .InitContext(TaskBlockIO, 0)
+        .Wakeup()
+        .ID();
+}
+
+void NotifyBlockIOInterrupt() {
+    if (block_io_task_id) {
+        task_manager->SendMessage(block_io_task_id, Message{Message::kBlockIOKick});
+    }
+}
+
+void ReleaseBlockIOWaiter(BlockIOWaiter& waiter) {
+    // 呼び出し元が waiter を持っているので，減らした後に読んでもよい
+    if (waiter.remaining.fetch_sub(1) == 1) {
+        Message msg{Message::kBlockIOCompleted};
+        msg.arg.block_io.tag = waiter.tag;
+        msg.arg.block_io.errors = waiter.errors.load();
+        task_manager->SendMessage(waiter.task_id, msg);
+    }
+}
+
+size_t WaitBlockIOCompletions(BlockIOWaiter& waiter) {
+    auto is_completion = [](const Message& msg, const void* arg) {
+        return msg.type == Message::kBlockIOCompleted &&
+            msg.arg.block_io.tag == *reinterpret_cast<const uint64_t*>(arg);
+    };
+    // 同じ tag の古いメッセージが残っていることもあるので，remaining が 0 になるまで待つ
+    while (waiter.remaining.load() > 0) {
+        task_manager->CurrentTask().WaitMessage(is_completion, &waiter.tag);
+    }
+    return waiter.errors.load();
+}
@@ -0,0 +1,130 @@
+/**
+ * @file block_device.hpp
+ *
+ * ブロックデバイス（セクタ単位で読み書きする記憶装置）を抽象化するプログラムを集めたファイル。
+ *
+ * 同期的な Read/Write のほかに，要求をキューに積んで完了をメッセージで受け取る
+ * 非同期 I/O を提供する。非同期要求は I/O タスクがデバイスのキューの深さまで
+ * まとめて発行し，LBA が連続する同種の要求は 1 つのスキャッタギャザー要求に併合する。
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+
+/** @brief 物理アドレス＝仮想アドレスのメモリ上の区間（非同期 I/O のバッファ） */
+struct IOSegment {
+    void* buf;
+    size_t bytes; // ブロックの大きさの倍数
+};
+
+/** @brief 一まとまりの非同期要求の完了をまとめて知らせるための計数器
+ *
+ * 要求が完了するたびに I/O タスクが remaining を減らし，0 になったら task_id のタスクへ
+ * kBlockIOCompleted を 1 つだけ送る。要求がいくつあってもメッセージキューからあふれない。
+ * remaining が 0 になるまで waiter を生かしておくこと。メッセージを他の受信ループが
+ * 受け取って捨てることもあるので，完了したかどうかは remaining で判断する。
+ */
+struct BlockIOWaiter {
+    std::atomic<size_t> remaining;
+    std::atomic<size_t> errors{0}; // 失敗した要求の数
+    uint64_t task_id; // 完了を kBlockIOCompleted で知らせるタスク
+    uint64_t tag;     // 完了メッセージにそのまま載せる値
+};
+
+/** @brief 非同期 I/O 要求
+ *
+ * Submit に渡してから完了するまで，要求とバッファを生かしておくこと。
+ */
+struct BlockRequest {
+    enum Op { kRead, kWrite } op;
+    uint64_t lba;
+    std::vector<IOSegment> segments;
+    BlockIOWaiter* waiter; // 完了を数える計数器（nullptr なら数えない）
+    /** @brief 完了時に I/O タスク上で呼ぶ関数（nullptr なら呼ばない）。中で req を解放してよい。 */
+    void (*on_complete)(BlockRequest* req, Error::Code result);
+};
+
+/** @brief デバイスへ 1 度に発行する単位。LBA の連続する要求を併合したもの。 */
+struct BlockCommand {
+    BlockRequest::Op op;
+    uint64_t lba;
+    std::vector<IOSegment> segments;
+    std::vector<BlockRequest*> requests;
+    Error::Code result;
+};
+
+class BlockDevice {
+public:
+    virtual ~BlockDevice() = default;
+
+    /** @brief lba から num_blocks ブロックを buf に読む */
+    virtual Error Read(uint64_t lba, void* buf, size_t num_blocks) = 0;
+    /** @brief buf の num_blocks ブロックを lba から書く */
+    virtual Error Write(uint64_t lba, const void* buf, size_t num_blocks) = 0;
+
+    virtual uint64_t NumBlocks() const = 0;
+    virtual size_t BlockSize() const = 0;
+
+    /** @brief 同時に発行できるコマンドの数。0 なら非同期コマンドを扱えない。 */
+    virtual int QueueDepth() const { return 0; }
+    /** @brief 1 つのコマンドに載せられる区間の数 */
+    virtual size_t MaxSegments() const { return 1; }
+    /** @brief コマンドを発行する。空きが無ければ false を返す。 */
+    virtual bool StartCommand(BlockCommand& cmd) { return false; }
+    /** @brief 完了したコマンドを done に追加する。 */
+    virtual void ReapCommands(std::vector<BlockCommand*>& done) {}
+
+    /** @brief 非同期要求をキューに積む。I/O タスクが無ければその場で処理する。 */
+    void Submit(BlockRequest* req);
+
+    /** @brief 完了したコマンドを通知し，待っている要求をキューの深さまで発行する。I/O タスクから呼ぶ。 */
+    void Process();
+
+private:
+    Spinlock pending_lock_;
+    std::deque<BlockRequest*> pending_;
+    int in_flight_{0};
+
+    /** @brief 非同期コマンドを扱えないデバイスで 1 要求を同期的に処理する */
+    Error::Code ExecuteSync(const BlockRequest& req);
+};
+
+/** @brief 起動ボリュームを載せたブロックデバイス。見つからなければ nullptr。 */
+extern BlockDevice* boot_block_device;
+
+/** @brief pci::devices からブロックデバイスを探して boot_block_device に設定する。
+ *
+ * InitializePCI の後に呼び出すこと。
+ */
+void InitializeBlockDevice();
+
+/** @brief 非同期要求を処理する I/O タスクを起動する。InitializeTask の後に呼び出すこと。 */
+void InitializeBlockIOTask();
+
+/** @brief デバイスの完了割り込みから呼ぶ。I/O タスクを起こす。 */
+void NotifyBlockIOInterrupt();
+
+/** @brief waiter に結びつけた要求を 1 つ完了したものとして数える。
+ *
+ * 要求を結びつけ終える前に完了が揃ってしまわないよう，投入側が remaining を
+ * 1 つ余分に数えておき，すべて投入してからこれで減らす。
+ */
+void ReleaseBlockIOWaiter(BlockIOWaiter& waiter);
+
+/** @brief waiter の要求がすべて完了するまで，kBlockIOCompleted を受け取って待つ。
+ *
+ * waiter.task_id は実行中のタスクの ID に，waiter.tag はそのタスクが待っている他の waiter と
+ * 重ならない値（waiter のアドレスなど）にしておくこと。
+ * 待っている間に届いた他のメッセージは，届いた順のまま後の ReceiveMessage で受け取れる。
+ *
+ * @return  失敗した要求の数
+ */
+size_t WaitBlockIOCompletions(BlockIOWaiter& waiter);
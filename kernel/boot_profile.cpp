@@ -0,0 +1,89 @@
+#include "boot_profile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+    BootProfile profile;
+    std::atomic<uint32_t> num_entries{0};
+    std::atomic<bool> finished{false};
+
+    /** @brief 1 ミリ秒あたりの TSC のカウント数。カーネルが測った値を優先する。 */
+    uint64_t TSCPerMillisecond() {
+        if (tsc_freq != 0) {
+            return tsc_freq / 1000;
+        }
+        return profile.tsc_per_ms;
+    }
+}
+
+void InitializeBootProfile(const BootProfile* loader_profile) {
+    if (loader_profile) {
+        profile.tsc_per_ms = loader_profile->tsc_per_ms;
+        const uint32_t n = std::min<uint32_t>(loader_profile->num_entries,
+                                              BOOT_PROFILE_MAX_ENTRIES);
+        memcpy(profile.entries, loader_profile->entries, sizeof(BootProfileEntry) * n);
+        num_entries.store(n);
+    }
+    RecordBootPhase("kernel entry");
+}
+
+void RecordBootPhase(const char* name) {
+    const uint64_t tsc = ReadTSC();
+    const uint32_t i = num_entries.fetch_add(1);
+    if (i >= BOOT_PROFILE_MAX_ENTRIES) {
+        num_entries.store(BOOT_PROFILE_MAX_ENTRIES);
+        return;
+    }
+    auto& e = profile.entries[i];
+    e.tsc = tsc;
+    strncpy(e.name, name, BOOT_PROFILE_NAME_LEN - 1);
+    e.name[BOOT_PROFILE_NAME_LEN - 1] = '\0';
+}
+
+void FinishBootProfile(const char* name) {
+    if (finished.exchange(true)) {
+        return;
+    }
+    RecordBootPhase(name);
+
+    const uint64_t per_ms = TSCPerMillisecond();
+    const uint32_t n = std::min<uint32_t>(num_entries.load(), BOOT_PROFILE_MAX_ENTRIES);
+    if (per_ms != 0 && n > 0) {
+        Log(kInfo, "boot: %lu ms until %s\n",
+            (profile.entries[n - 1].tsc - profile.entries[0].tsc) / per_ms, name);
+    }
+}
+
+std::vector<std::string> FormatBootProfile() {
+    std::vector<std::string> lines;
+    const uint64_t per_ms = TSCPerMillisecond();
+    const uint32_t n = std::min<uint32_t>(num_entries.load(), BOOT_PROFILE_MAX_ENTRIES);
+    if (per_ms == 0 || n == 0) {
+        return lines;
+    }
+
+    // 並行に動く初期化処理は記録の順と終わった順が入れ替わりうるので，時刻順に並べる
+    std::vector<BootProfileEntry> entries(profile.entries, profile.entries + n);
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const auto& a, const auto& b) { return a.tsc < b.tsc; });
+
+    // 経過時間はミリ秒，段階ごとの時間は 0.1 ミリ秒単位で表示する
+    const uint64_t per_100us = per_ms / 10 ? per_ms / 10 : 1;
+    const uint64_t base = entries[0].tsc;
+    char s[80];
+    for (uint32_t i = 0; i < n; ++i) {
+        const auto& e = entries[i];
+        const uint64_t phase = i == 0 ? 0 : (e.tsc - entries[i - 1].tsc) / per_100us;
+        sprintf(s, "%6lu ms %5lu.%lu ms  %s",
+                (e.tsc - base) / per_ms, phase / 10, phase % 10, e.name);
+        lines.push_back(s);
+    }
+    return lines;
+}
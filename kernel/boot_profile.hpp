@@ -0,0 +1,51 @@
+/**
+ * @file boot_profile.hpp
+ *
+ * 起動処理の各段階が終わった時刻（TSC）を記録するプログラムを集めたファイル。
+ *
+ * ローダが記録した分はエントリポイントの引数でカーネルへ渡し，
+ * カーネルはその後ろに自分の段階を追記する。TSC はリセットされないので，
+ * ローダとカーネルの時刻はそのまま比べられる。
+ * BootProfile はローダ（C）からも使うので C の構造体として定義する。
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define BOOT_PROFILE_MAX_ENTRIES 48
+#define BOOT_PROFILE_NAME_LEN 24
+
+struct BootProfileEntry {
+  uint64_t tsc;                     // 段階が終わった時刻
+  char name[BOOT_PROFILE_NAME_LEN]; // 段階の名前（NUL 終端）
+};
+
+struct BootProfile {
+  uint64_t tsc_per_ms; // ローダが測った TSC の周波数（0 なら不明）
+  uint32_t num_entries;
+  struct BootProfileEntry entries[BOOT_PROFILE_MAX_ENTRIES];
+};
+
+#ifdef __cplusplus
+#include <string>
+#include <vector>
+
+/** @brief ローダから受け取った記録を写し取る。ローダのスタックは後で再利用されるので最初に呼ぶ。
+ *
+ * @param loader_profile  ローダの記録（古いローダなら nullptr）
+ */
+void InitializeBootProfile(const BootProfile* loader_profile);
+
+/** @brief 直前の段階が終わった時刻として，現在の TSC を name と一緒に記録する。 */
+void RecordBootPhase(const char* name);
+
+/** @brief 起動の完了（最初のプロンプトの表示）を記録し，そこまでの時間をログに出す。
+ *
+ * 2 回目以降の呼び出しは何もしない。遅れて終わる初期化処理はこの後も記録できる。
+ */
+void FinishBootProfile(const char* name);
+
+/** @brief 記録を 1 段階 1 行（最初の記録からの経過時間と，その段階にかかった時間）に整形する。 */
+std::vector<std::string> FormatBootProfile();
+#endif
@@ -0,0 +1,58 @@
+#include "clock.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "timer.hpp"
+
+namespace {
+    constexpr uint32_t kClockShift = 32;
+}
+
+bool IsInvariantTSC() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) {
+        return false;
+    }
+    CPUID(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+ClockPage* clock_page;
+
+void InitializeClock() {
+    auto [ frame, err ] = memory_manager->Allocate(1);
+    if (err) {
+        Log(kError, "failed to allocate clock page: %s\n", err.Name());
+        exit(1);
+    }
+    clock_page = reinterpret_cast<ClockPage*>(frame.Frame());
+    memset(clock_page, 0, kBytesPerFrame);
+
+    if (!IsInvariantTSC() || tsc_freq == 0) {
+        Log(kWarn, "invariant TSC is not available\n");
+        return;
+    }
+
+    clock_page->mult = (1'000'000'000ul << kClockShift) / tsc_freq;
+    clock_page->shift = kClockShift;
+    clock_page->base_tsc = ReadTSC();
+    clock_page->tsc_freq = tsc_freq;
+}
+
+uint64_t MonotonicNanoseconds() {
+    if (clock_page == nullptr || clock_page->tsc_freq == 0) {
+        return 0;
+    }
+    const unsigned __int128 delta = ReadTSC() - clock_page->base_tsc;
+    return (delta * clock_page->mult) >> clock_page->shift;
+}
+
+Error MapClockPage() {
+    return MapUserPageReadOnly(LinearAddress4Level{CLOCK_PAGE_ADDR},
+                               reinterpret_cast<uintptr_t>(clock_page));
+}
@@ -0,0 +1,29 @@
+/**
+ * @file clock.hpp
+ *
+ * TSC を用いた高分解能な単調増加時計を提供する。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "clock_page.hpp"
+#include "error.hpp"
+
+/** @brief TSC が周波数一定（invariant TSC）なら true を返す。 */
+bool IsInvariantTSC();
+
+/** @brief 時刻情報ページを初期化する。
+ *
+ * tsc_freq が設定された後（InitializeLAPICTimer の後）に呼び出すこと。
+ */
+void InitializeClock();
+
+/** @brief InitializeClock からの経過時間をナノ秒単位で返す。TSC が使えなければ 0。 */
+uint64_t MonotonicNanoseconds();
+
+/** @brief 時刻情報ページを現在のページテーブルの CLOCK_PAGE_ADDR に読み込み専用でマップする。 */
+Error MapClockPage();
+
+extern ClockPage* clock_page;
@@ -0,0 +1,36 @@
+/**
+ * @file clock_page.hpp
+ *
+ * カーネルとアプリケーションで共有する時刻情報ページの定義。
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+/** @brief 時刻情報ページをアプリケーション空間にマップする仮想アドレス */
+#define CLOCK_PAGE_ADDR 0xffffffffffffd000ull
+
+/** @brief 時刻情報ページの内容
+ *
+ * カーネルが起動時に一度だけ書き込み，アプリケーションからは読み込み専用で見える。
+ * 起動からの経過時間（ナノ秒）は次の式で求まる。
+ *   ((rdtsc() - base_tsc) * mult) >> shift
+ * tsc_freq が 0 のときは TSC が時刻源として使えないことを表す。
+ */
+struct ClockPage {
+  uint64_t tsc_freq;
+  uint64_t base_tsc;
+  uint64_t mult;
+  uint32_t shift;
+  uint32_t reserved;
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -12,18 +12,22 @@ Console::Console( const PixelColor& fg_color, const PixelColor& bg_color)
 
 
 void Console::PutString(const char* s) {
-    while (*s) {
-        if (*s == '\n') {
-            Newline();
-        } else if (cursor_column_ < kColumns - 1) {
-            WriteAscii(
-                *writer_, Vector2D<int>{8 * cursor_column_, 16 * cursor_row_},
-                *s, fg_color_
-            );
-            buffer_[cursor_row_][cursor_column_] = *s;
-            ++cursor_column_;
+    {
+        // 複数の CPU から同時に書き込まれてもバッファを壊さないように
+        LockGuard guard{layer_lock};
+        while (*s) {
+            if (*s == '\n') {
+                Newline();
+            } else if (cursor_column_ < kColumns - 1) {
+                WriteAscii(
+                    *writer_, Vector2D<int>{8 * cursor_column_, 16 * cursor_row_},
+                    *s, fg_color_
+                );
+                buffer_[cursor_row_][cursor_column_] = *s;
+                ++cursor_column_;
+            }
+            ++s;
         }
-        ++s;
     }
     if (layer_manager) {
         layer_manager->Draw(layer_id_);
@@ -31,6 +31,9 @@ class Error {
     kNoSuchTask,
     kInvalidFormat,
     kFrameTooSmall,
+    kNoSuchEntry,
+    kIsReadOnly,
+    kBusy,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -61,6 +64,9 @@ class Error {
     "kNoSuchTask",
     "kInvalidFormat",
     "kFrameTooSmall",
+    "kNoSuchEntry",
+    "kIsReadOnly",
+    "kBusy",
   };
 
   static_assert(Error::Code::kLastOfCode == code_names_.size());
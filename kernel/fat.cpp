@@ -1,17 +1,500 @@
 #include "fat.hpp"
 
-#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "block_device.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+#include "volume_cache.hpp"
 
 namespace fat {
     BPB* boot_volume_image;
     unsigned long bytes_per_cluster;
 
+    namespace {
+        uint32_t* fat_table; // 使用中の FAT の先頭。Initialize で求めておく。
+        const size_t kLoadChunkBytes = 16 * 1024; // LoadFile が先読みを挟みながら写す単位
+
+        // 書き込み用の状態。すべて volume_lock で守る。
+        Spinlock volume_lock;
+        std::vector<uint64_t> free_clusters;      // ビットが 1 のクラスタは空き
+        unsigned long num_clusters;               // クラスタ番号の上限（2 + データ領域のクラスタ数）
+        unsigned long next_free_hint;             // 次に空きを探し始めるクラスタ
+        std::vector<uint64_t> dirty_sectors;      // 書き戻しが必要なボリュームのセクタ
+        std::vector<uint64_t> pending_fat_sectors; // FAT 0 だけ更新して他の FAT へ写していないセクタ
+        std::map<const DirectoryEntry*, int> open_files; // 開いている FileDescriptor の数
+
+        void SetBit(std::vector<uint64_t>& bits, unsigned long i) {
+            bits[i / 64] |= 1ul << (i % 64);
+        }
+
+        void ClearBit(std::vector<uint64_t>& bits, unsigned long i) {
+            bits[i / 64] &= ~(1ul << (i % 64));
+        }
+
+        // 名前の最大長（UTF-8 でのバイト数）。VFAT の長い名前は最大 255 文字。
+        const size_t kMaxNameLen = 255;
+
+        /** @brief VFAT の長い名前を格納するエントリ（attr が kLongName のもの） */
+        struct LongNameEntry {
+            uint8_t ord; // ビット 6 が最後の断片の印，ビット 4:0 が断片の番号（1 始まり）
+            uint16_t name1[5];
+            Attribute attr;
+            uint8_t type;
+            uint8_t checksum; // 対応する短名のチェックサム
+            uint16_t name2[6];
+            uint16_t first_cluster_low;
+            uint16_t name3[2];
+        } __attribute__((packed));
+        static_assert(sizeof(LongNameEntry) == sizeof(DirectoryEntry));
+
+        /** @brief 比較用に ASCII の英小文字を大文字にする（FAT の名前は大文字小文字を区別しない） */
+        size_t NormalizeName(const char* name, size_t len, char* key) {
+            for (size_t i = 0; i < len; ++i) {
+                key[i] = toupper(static_cast<unsigned char>(name[i]));
+            }
+            return len;
+        }
+
+        /** @brief 短名を "BASE.EXT" 形式（拡張子が無ければ "BASE"）にして返す。戻り値は長さ。 */
+        size_t FormatShortName(const DirectoryEntry& entry, char* name) {
+            char base[9], ext[4];
+            ReadName(entry, base, ext);
+            if (ext[0]) {
+                return sprintf(name, "%s.%s", base, ext);
+            }
+            return sprintf(name, "%s", base);
+        }
+
+        uint8_t ShortNameChecksum(const unsigned char* name83) {
+            uint8_t sum = 0;
+            for (int i = 0; i < 11; ++i) {
+                sum = ((sum & 1) << 7) + (sum >> 1) + name83[i];
+            }
+            return sum;
+        }
+
+        /** @brief ディレクトリを先頭から読みながら，短名の直前に並ぶ長い名前の断片を組み立てる */
+        class LongNameReader {
+        public:
+            void Feed(const DirectoryEntry& entry) {
+                auto& lfn = reinterpret_cast<const LongNameEntry&>(entry);
+                const int seq = lfn.ord & 0x1f;
+                if (lfn.ord & 0x40) { // 断片は最後のものから逆順に並ぶ
+                    if (seq == 0 || seq > kMaxParts) {
+                        num_parts_ = 0;
+                        return;
+                    }
+                    num_parts_ = seq;
+                    checksum_ = lfn.checksum;
+                } else if (num_parts_ == 0 || seq != next_ || lfn.checksum != checksum_) {
+                    num_parts_ = 0;
+                    return;
+                }
+                next_ = seq - 1;
+
+                uint16_t* chars = &chars_[(seq - 1) * kCharsPerPart];
+                memcpy(&chars[0], lfn.name1, sizeof(lfn.name1));
+                memcpy(&chars[5], lfn.name2, sizeof(lfn.name2));
+                memcpy(&chars[11], lfn.name3, sizeof(lfn.name3));
+            }
+
+            void Reset() {
+                num_parts_ = 0;
+            }
+
+            /** @brief 短名 entry に対応する長い名前を UTF-8 で name に書く。
+             *
+             * @return 名前の長さ。対応する長い名前が無ければ 0。
+             */
+            size_t Take(const DirectoryEntry& entry, char* name) {
+                size_t len = 0;
+                if (num_parts_ != 0 && next_ == 0 && ShortNameChecksum(entry.name) == checksum_) {
+                    for (int i = 0; i < num_parts_ * kCharsPerPart; ++i) {
+                        const uint16_t c = chars_[i];
+                        if (c == 0x0000 || c == 0xffff) {
+                            break;
+                        }
+                        const size_t n = c < 0x80 ? 1 : c < 0x800 ? 2 : 3;
+                        if (len + n > kMaxNameLen) {
+                            len = 0;
+                            break;
+                        }
+                        if (n == 1) {
+                            name[len++] = c;
+                        } else if (n == 2) {
+                            name[len++] = 0xc0 | (c >> 6);
+                            name[len++] = 0x80 | (c & 0x3f);
+                        } else {
+                            name[len++] = 0xe0 | (c >> 12);
+                            name[len++] = 0x80 | ((c >> 6) & 0x3f);
+                            name[len++] = 0x80 | (c & 0x3f);
+                        }
+                    }
+                    name[len] = 0;
+                }
+                num_parts_ = 0;
+                return len;
+            }
+
+        private:
+            static const int kCharsPerPart = 13;
+            static const int kMaxParts = 20;
+
+            std::array<uint16_t, kMaxParts * kCharsPerPart> chars_{};
+            int num_parts_{0}; // 0 なら組み立て中の名前は無い
+            int next_{0};      // 次に来るべき断片の番号
+            uint8_t checksum_{0};
+        };
+
+        /** @brief ディレクトリの有効なエントリを順に f(entry, long_name) へ渡す。
+         *
+         * long_name は長い名前（UTF-8）か，無ければ nullptr。ボリュームラベルは渡さない。
+         * f が false を返したら走査をやめて false を返す。
+         */
+        template <class F>
+        bool ForEachEntry(unsigned long dir_cluster, F f) {
+            LongNameReader lfn;
+            char long_name[kMaxNameLen + 1];
+            for (unsigned long c = dir_cluster; c != kEndOfClusterchain; c = NextCluster(c)) {
+                auto dir = GetSectorByCluster<DirectoryEntry>(c);
+                for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
+                    if (dir[i].name[0] == 0x00) { // 以降のエントリは未使用
+                        return true;
+                    }
+                    if (dir[i].name[0] == 0xe5) {
+                        lfn.Reset();
+                        continue;
+                    }
+                    if (dir[i].attr == Attribute::kLongName) {
+                        lfn.Feed(dir[i]);
+                        continue;
+                    }
+                    const size_t len = lfn.Take(dir[i], long_name);
+                    if (static_cast<uint8_t>(dir[i].attr) &
+                        static_cast<uint8_t>(Attribute::kVolumeID)) {
+                        continue;
+                    }
+                    if (!f(dir[i], len ? long_name : nullptr)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        uint64_t HashName(unsigned long dir_cluster, const char* key, size_t len) {
+            // FNV-1a
+            uint64_t h = 0xcbf29ce484222325;
+            for (int i = 0; i < 4; ++i) {
+                h = (h ^ ((dir_cluster >> (8 * i)) & 0xff)) * 0x100000001b3;
+            }
+            for (size_t i = 0; i < len; ++i) {
+                h = (h ^ static_cast<uint8_t>(key[i])) * 0x100000001b3;
+            }
+            return h;
+        }
+
+        /** @brief (ディレクトリの開始クラスタ, 名前) からエントリを引くハッシュ表
+         *
+         * 開番地法（線形探査）で，登録はディレクトリ単位でまとめて行う。
+         * 長い名前を持つエントリは短名と長い名前の両方で登録する。
+         * 全エントリを登録し終えたディレクトリは complete_dirs_ に記録し，
+         * そこで見つからない名前は走査せずに「存在しない」と答える。
+         * 個別の削除はせず，無効化は表全体を空にして行う。
+         */
+        class DentryCache {
+        public:
+            /** @brief name（長さ len，大文字小文字は区別しない）をディレクトリから探す */
+            DirectoryEntry* Find(unsigned long dir_cluster, const char* name, size_t len) {
+                if (len == 0 || len > kMaxNameLen) {
+                    return nullptr;
+                }
+                char key[kMaxNameLen];
+                NormalizeName(name, len, key);
+
+                const bool intr = DisableInterrupts();
+                lock_.Lock();
+                const bool complete = IsComplete(dir_cluster) || Populate(dir_cluster);
+                DirectoryEntry* entry = Lookup(dir_cluster, key, len);
+                lock_.Unlock();
+                RestoreInterrupts(intr);
+
+                // 表が一杯で登録しきれなかったディレクトリは従来どおり走査する
+                if (entry == nullptr && !complete) {
+                    entry = Scan(dir_cluster, key, len);
+                }
+                return entry;
+            }
+
+            void Clear() {
+                const bool intr = DisableInterrupts();
+                lock_.Lock();
+                for (auto& s : slots_) {
+                    s.entry = nullptr;
+                }
+                num_used_ = 0;
+                names_.clear();
+                complete_dirs_.clear();
+                lock_.Unlock();
+                RestoreInterrupts(intr);
+            }
+
+        private:
+            static const size_t kSlots = 8192; // 2 のべき乗
+            static const size_t kMaxUsed = kSlots * 3 / 4;
+
+            struct Slot {
+                uint64_t hash;
+                uint32_t dir_cluster;
+                uint32_t name_offset; // names_ 中の正規化した名前の位置
+                uint16_t name_len;
+                DirectoryEntry* entry; // nullptr なら空き
+            };
+
+            std::array<Slot, kSlots> slots_{};
+            size_t num_used_{0};
+            std::vector<char> names_{};
+            std::vector<uint32_t> complete_dirs_{};
+            Spinlock lock_;
+
+            bool IsComplete(unsigned long dir_cluster) const {
+                return std::find(complete_dirs_.begin(), complete_dirs_.end(),
+                                 dir_cluster) != complete_dirs_.end();
+            }
+
+            bool Matches(const Slot& s, uint64_t hash, unsigned long dir_cluster,
+                         const char* key, size_t len) const {
+                return s.hash == hash && s.dir_cluster == dir_cluster && s.name_len == len &&
+                       memcmp(&names_[s.name_offset], key, len) == 0;
+            }
+
+            DirectoryEntry* Lookup(unsigned long dir_cluster, const char* key, size_t len) const {
+                const uint64_t h = HashName(dir_cluster, key, len);
+                for (size_t i = h & (kSlots - 1); slots_[i].entry; i = (i + 1) & (kSlots - 1)) {
+                    if (Matches(slots_[i], h, dir_cluster, key, len)) {
+                        return slots_[i].entry;
+                    }
+                }
+                return nullptr;
+            }
+
+            bool Insert(unsigned long dir_cluster, const char* name, size_t len,
+                        DirectoryEntry* entry) {
+                if (num_used_ >= kMaxUsed) {
+                    return false;
+                }
+                char key[kMaxNameLen];
+                NormalizeName(name, len, key);
+                const uint64_t h = HashName(dir_cluster, key, len);
+                size_t i = h & (kSlots - 1);
+                for (; slots_[i].entry; i = (i + 1) & (kSlots - 1)) {
+                    if (Matches(slots_[i], h, dir_cluster, key, len)) {
+                        return true; // 同じ名前が複数あれば先頭のものを使う
+                    }
+                }
+                slots_[i] = {h, static_cast<uint32_t>(dir_cluster),
+                             static_cast<uint32_t>(names_.size()),
+                             static_cast<uint16_t>(len), entry};
+                names_.insert(names_.end(), key, key + len);
+                ++num_used_;
+                return true;
+            }
+
+            /** @brief ディレクトリの全エントリを登録する。登録しきれなければ false を返す。 */
+            bool Populate(unsigned long dir_cluster) {
+                const bool complete = ForEachEntry(dir_cluster,
+                    [this, dir_cluster](DirectoryEntry& entry, const char* long_name) {
+                        char short_name[13];
+                        const size_t len = FormatShortName(entry, short_name);
+                        if (!Insert(dir_cluster, short_name, len, &entry)) {
+                            return false;
+                        }
+                        return long_name == nullptr ||
+                               Insert(dir_cluster, long_name, strlen(long_name), &entry);
+                    });
+                if (complete) {
+                    complete_dirs_.push_back(dir_cluster);
+                }
+                return complete;
+            }
+
+            static DirectoryEntry* Scan(unsigned long dir_cluster, const char* key, size_t len) {
+                DirectoryEntry* found = nullptr;
+                const auto matches = [key, len](const char* name, size_t name_len) {
+                    char name_key[kMaxNameLen];
+                    return name_len == len &&
+                           memcmp(key, name_key, NormalizeName(name, name_len, name_key)) == 0;
+                };
+                ForEachEntry(dir_cluster,
+                    [&](DirectoryEntry& entry, const char* long_name) {
+                        char short_name[13];
+                        if (matches(short_name, FormatShortName(entry, short_name)) ||
+                            (long_name && matches(long_name, strlen(long_name)))) {
+                            found = &entry;
+                            return false;
+                        }
+                        return true;
+                    });
+                return found;
+            }
+        };
+
+        /** @brief (起点ディレクトリ, パス) から解決結果を引く直接写像のキャッシュ
+         *
+         * 見つからなかったパスも nullptr として記録するので，存在しないコマンド名の
+         * 繰り返し検索もハッシュ 1 回で済む。長すぎるパスは記録しない。
+         * 衝突したら上書きし，無効化は全体を空にして行う。
+         *
+         * 引いている間に無効化されると古い結果を書き込んでしまうので，引く前に Generation を
+         * 読んでおき，Store は世代が変わっていなければ記録する。
+         */
+        class PathCache {
+        public:
+            static const size_t kMaxPathLen = 63;
+
+            bool Find(unsigned long dir_cluster, const char* key, size_t len,
+                      DirectoryEntry*& entry) {
+                const uint64_t h = HashName(dir_cluster, key, len);
+                bool hit = false;
+                const bool intr = DisableInterrupts();
+                lock_.Lock();
+                const auto& s = slots_[h & (kSlots - 1)];
+                if (s.valid && s.hash == h && s.dir_cluster == dir_cluster &&
+                    s.len == len && memcmp(s.path, key, len) == 0) {
+                    entry = s.entry;
+                    hit = true;
+                }
+                lock_.Unlock();
+                RestoreInterrupts(intr);
+                return hit;
+            }
+
+            /** @brief Clear のたびに進む世代 */
+            uint64_t Generation() const {
+                return generation_.load();
+            }
+
+            /** @brief generation の後に Clear されていなければ記録する */
+            void Store(unsigned long dir_cluster, const char* key, size_t len,
+                       DirectoryEntry* entry, uint64_t generation) {
+                const uint64_t h = HashName(dir_cluster, key, len);
+                const bool intr = DisableInterrupts();
+                lock_.Lock();
+                if (generation != generation_.load()) {
+                    lock_.Unlock();
+                    RestoreInterrupts(intr);
+                    return;
+                }
+                auto& s = slots_[h & (kSlots - 1)];
+                s.hash = h;
+                s.dir_cluster = dir_cluster;
+                s.len = len;
+                memcpy(s.path, key, len);
+                s.entry = entry;
+                s.valid = true;
+                lock_.Unlock();
+                RestoreInterrupts(intr);
+            }
+
+            void Clear() {
+                const bool intr = DisableInterrupts();
+                lock_.Lock();
+                for (auto& s : slots_) {
+                    s.valid = false;
+                }
+                generation_.fetch_add(1);
+                lock_.Unlock();
+                RestoreInterrupts(intr);
+            }
+
+        private:
+            static const size_t kSlots = 1024; // 2 のべき乗
+
+            struct Slot {
+                uint64_t hash;
+                uint32_t dir_cluster;
+                uint8_t len;
+                bool valid;
+                char path[kMaxPathLen];
+                DirectoryEntry* entry; // nullptr なら「存在しない」
+            };
+
+            std::array<Slot, kSlots> slots_{};
+            std::atomic<uint64_t> generation_{0}; // 書き換えは lock_ の中で行う
+            Spinlock lock_;
+        };
+
+        DentryCache dentry_cache;
+        PathCache path_cache;
+
+        /** @brief path を '/' で区切り，dir_cluster から 1 段ずつ辿る */
+        DirectoryEntry* WalkPath(const char* path, unsigned long dir_cluster) {
+            DirectoryEntry* entry = nullptr;
+            for (const char* p = path; ; ) {
+                while (*p == '/') {
+                    ++p;
+                }
+                if (*p == 0) {
+                    return entry;
+                }
+                if (entry) { // 途中の要素はディレクトリでなければならない
+                    if ((static_cast<uint8_t>(entry->attr) &
+                         static_cast<uint8_t>(Attribute::kDirectory)) == 0) {
+                        return nullptr;
+                    }
+                    dir_cluster = entry->FirstCluster();
+                    if (dir_cluster == 0) { // ".." がルートディレクトリを指す場合
+                        dir_cluster = boot_volume_image->root_cluster;
+                    }
+                }
+                const char* end = strchr(p, '/');
+                const size_t len = end ? end - p : strlen(p);
+                entry = dentry_cache.Find(dir_cluster, p, len);
+                if (entry == nullptr) {
+                    return nullptr;
+                }
+                p += len;
+            }
+        }
+    }
+
     void Initialize(void* volume_image) {
         boot_volume_image = reinterpret_cast<fat::BPB*>(volume_image);
         bytes_per_cluster = 
             static_cast<unsigned long>(boot_volume_image->bytes_per_sector) *
             boot_volume_image->sectors_per_cluster;
+        // ext_flags のビット 7 が立っていればミラーリングは無効で，ビット 3:0 の FAT だけが使われている
+        const unsigned active_fat = (boot_volume_image->ext_flags & 0x80)
+            ? boot_volume_image->ext_flags & 0x0f : 0;
+        fat_table = reinterpret_cast<uint32_t*>(
+            reinterpret_cast<uintptr_t>(boot_volume_image) +
+            (boot_volume_image->reserved_sector_count +
+             active_fat * boot_volume_image->fat_size_32) * boot_volume_image->bytes_per_sector);
+
+        // 空きクラスタのビットマップは FAT を 1 回だけ走査して作る
+        const unsigned long data_sectors = boot_volume_image->total_sectors_32 -
+            (boot_volume_image->reserved_sector_count +
+             boot_volume_image->num_fats * boot_volume_image->fat_size_32);
+        num_clusters = std::min<unsigned long>(
+            2 + data_sectors / boot_volume_image->sectors_per_cluster,
+            boot_volume_image->fat_size_32 * boot_volume_image->bytes_per_sector / 4);
+        free_clusters.assign((num_clusters + 63) / 64, 0);
+        for (unsigned long c = 2; c < num_clusters; ++c) {
+            if ((fat_table[c] & 0x0ffffffflu) == 0) {
+                SetBit(free_clusters, c);
+            }
+        }
+        next_free_hint = 2;
+        dirty_sectors.assign((boot_volume_image->total_sectors_32 + 63) / 64, 0);
+        pending_fat_sectors.assign((boot_volume_image->fat_size_32 + 63) / 64, 0);
     }
 
     uintptr_t GetClusterAddr(unsigned long cluster) {
@@ -39,75 +522,576 @@ namespace fat {
     }
 
     unsigned long NextCluster(unsigned long cluster) {
-        uintptr_t fat_offset = 
-            boot_volume_image->reserved_sector_count * 
-            boot_volume_image->bytes_per_sector;
-        uint32_t* fat = reinterpret_cast<uint32_t*>(
-            reinterpret_cast<uintptr_t>(boot_volume_image) + fat_offset);
-        uint32_t next = fat[cluster];
+        uint32_t next = fat_table[cluster];
         if (next >= 0x0ffffff8ul) {
             return kEndOfClusterchain;
         }
         return next;
     }
 
-    DirectoryEntry* FindFile(const char* name, unsigned long directory_cluster) {
+    DirectoryEntry* FindFile(const char* path, unsigned long directory_cluster) {
+        if (path[0] == '/') {
+            directory_cluster = 0;
+        }
         if (directory_cluster == 0) {
             directory_cluster = boot_volume_image->root_cluster;
         }
 
-        while (directory_cluster != kEndOfClusterchain) {
-            auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
-            for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
-                if (NameIsEqual(dir[i], name)) {
-                    return &dir[i];
+        const size_t len = strlen(path);
+        if (len > PathCache::kMaxPathLen) {
+            return WalkPath(path, directory_cluster);
+        }
+
+        char key[PathCache::kMaxPathLen];
+        NormalizeName(path, len, key);
+        DirectoryEntry* entry;
+        if (path_cache.Find(directory_cluster, key, len, entry)) {
+            return entry;
+        }
+        // 辿っている間にファイルが作られて無効化されたら，古い「存在しない」を記録しない
+        const uint64_t generation = path_cache.Generation();
+        entry = WalkPath(path, directory_cluster);
+        path_cache.Store(directory_cluster, key, len, entry, generation);
+        return entry;
+    }
+
+    bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
+        char short_name[13], key[13];
+        const size_t len = FormatShortName(entry, short_name);
+        if (strlen(name) != len) {
+            return false;
+        }
+        NormalizeName(short_name, len, short_name);
+        NormalizeName(name, len, key);
+        return memcmp(short_name, key, len) == 0;
+    }
+
+    void InvalidateDentryCache() {
+        dentry_cache.Clear();
+        path_cache.Clear();
+    }
+
+    std::vector<std::pair<DirectoryEntry*, std::string>>
+    ListDirectory(unsigned long directory_cluster) {
+        if (directory_cluster == 0) {
+            directory_cluster = boot_volume_image->root_cluster;
+        }
+
+        std::vector<std::pair<DirectoryEntry*, std::string>> entries;
+        ForEachEntry(directory_cluster, [&entries](DirectoryEntry& entry, const char* long_name) {
+            char short_name[13];
+            if (long_name == nullptr) {
+                FormatShortName(entry, short_name);
+            }
+            entries.push_back({&entry, long_name ? long_name : short_name});
+            return true;
+        });
+        return entries;
+    }
+
+    namespace {
+        void MarkDirtyLocked(const void* addr, size_t bytes) {
+            if (bytes == 0) {
+                return;
+            }
+            const uintptr_t offset =
+                reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(boot_volume_image);
+            const unsigned long bps = boot_volume_image->bytes_per_sector;
+            for (unsigned long s = offset / bps; s <= (offset + bytes - 1) / bps; ++s) {
+                SetBit(dirty_sectors, s);
+            }
+        }
+
+        /** @brief 使用中の FAT のエントリを書き換える。他の FAT へは CommitFATLocked でまとめて写す。 */
+        void SetFATEntryLocked(unsigned long cluster, uint32_t value) {
+            // 上位 4 ビットは予約なので保存する
+            fat_table[cluster] = (fat_table[cluster] & 0xf0000000u) | (value & 0x0fffffffu);
+            MarkDirtyLocked(&fat_table[cluster], sizeof(uint32_t));
+            SetBit(pending_fat_sectors,
+                   cluster * sizeof(uint32_t) / boot_volume_image->bytes_per_sector);
+        }
+
+        /** @brief 更新された FAT 0 のセクタを残りの FAT へ写す
+         *
+         * ミラーリングが有効なときは使用中の FAT は FAT 0 なので，FAT 0 から写せばよい。
+         */
+        void CommitFATLocked() {
+            const unsigned long bps = boot_volume_image->bytes_per_sector;
+            // ext_flags のビット 7 が立っていればミラーリングは無効（ビット 3:0 の FAT だけを使う）
+            const bool mirror = (boot_volume_image->ext_flags & 0x80) == 0;
+            for (size_t w = 0; w < pending_fat_sectors.size(); ++w) {
+                for (uint64_t bits = pending_fat_sectors[w]; mirror && bits; bits &= bits - 1) {
+                    const unsigned long s = w * 64 + __builtin_ctzll(bits);
+                    auto src = reinterpret_cast<uint8_t*>(fat_table) + s * bps;
+                    for (int k = 1; k < boot_volume_image->num_fats; ++k) {
+                        auto dst = src + k * boot_volume_image->fat_size_32 * bps;
+                        memcpy(dst, src, bps);
+                        MarkDirtyLocked(dst, bps);
+                    }
+                }
+                pending_fat_sectors[w] = 0;
+            }
+        }
+
+        /** @brief 空きクラスタを 1 つ取り，0 で埋めてチェーンの終端にする。空きが無ければ 0。 */
+        unsigned long AllocateClusterLocked() {
+            const size_t num_words = free_clusters.size();
+            const size_t start = next_free_hint / 64;
+            for (size_t i = 0; i < num_words; ++i) {
+                const size_t w = (start + i) % num_words;
+                if (free_clusters[w] == 0) {
+                    continue;
+                }
+                const unsigned long c = w * 64 + __builtin_ctzll(free_clusters[w]);
+                ClearBit(free_clusters, c);
+                SetFATEntryLocked(c, kEndOfClusterchain);
+                auto p = GetSectorByCluster<uint8_t>(c);
+                memset(p, 0, bytes_per_cluster);
+                MarkDirtyLocked(p, bytes_per_cluster);
+                next_free_hint = c + 1;
+                return c;
+            }
+            return 0;
+        }
+
+        void FreeClusterChainLocked(unsigned long cluster) {
+            while (cluster != 0 && cluster != kEndOfClusterchain) {
+                const unsigned long next = NextCluster(cluster);
+                SetFATEntryLocked(cluster, 0);
+                SetBit(free_clusters, cluster);
+                cluster = next;
+            }
+        }
+
+        void SetFirstCluster(DirectoryEntry& entry, unsigned long cluster) {
+            entry.first_cluster_low = cluster & 0xffff;
+            entry.first_cluster_high = cluster >> 16;
+        }
+
+        /** @brief name を 8.3 形式（11 バイト，大文字・空白詰め）にする。収まらない名前なら false。 */
+        bool ToName83(const char* name, unsigned char* name83) {
+            memset(name83, 0x20, 11);
+            const char* dot = strrchr(name, '.');
+            const size_t base_len = dot ? dot - name : strlen(name);
+            const size_t ext_len = dot ? strlen(dot + 1) : 0;
+            if (base_len == 0 || base_len > 8 || ext_len > 3) {
+                return false;
+            }
+
+            const auto copy = [](const char* src, size_t len, unsigned char* dst) {
+                for (size_t i = 0; i < len; ++i) {
+                    const unsigned char c = src[i];
+                    if (c <= 0x20 || c >= 0x7f || strchr("\"*+,./:;<=>?[\\]|", c)) {
+                        return false;
+                    }
+                    dst[i] = toupper(c);
+                }
+                return true;
+            };
+            return copy(name, base_len, name83) && copy(dot ? dot + 1 : "", ext_len, name83 + 8);
+        }
+
+        /** @brief ディレクトリから短名が name83 のエントリを探す。無ければ nullptr。 */
+        DirectoryEntry* FindEntryLocked(unsigned long dir_cluster, const unsigned char* name83) {
+            const size_t entries_per_cluster = bytes_per_cluster / sizeof(DirectoryEntry);
+            for (unsigned long c = dir_cluster; c != kEndOfClusterchain; c = NextCluster(c)) {
+                auto dir = GetSectorByCluster<DirectoryEntry>(c);
+                for (size_t i = 0; i < entries_per_cluster; ++i) {
+                    if (dir[i].name[0] == 0x00) {
+                        return nullptr;
+                    }
+                    if (dir[i].attr != Attribute::kLongName && memcmp(dir[i].name, name83, 11) == 0) {
+                        return &dir[i];
+                    }
                 }
             }
-            directory_cluster = NextCluster(directory_cluster);
+            return nullptr;
         }
 
-        return nullptr;
+        /** @brief ディレクトリの空きエントリを返す。無ければクラスタを足して作る。 */
+        DirectoryEntry* AllocateEntryLocked(unsigned long dir_cluster) {
+            const size_t entries_per_cluster = bytes_per_cluster / sizeof(DirectoryEntry);
+            unsigned long last = dir_cluster;
+            for (unsigned long c = dir_cluster; c != kEndOfClusterchain; c = NextCluster(c)) {
+                auto dir = GetSectorByCluster<DirectoryEntry>(c);
+                for (size_t i = 0; i < entries_per_cluster; ++i) {
+                    if (dir[i].name[0] == 0x00 || dir[i].name[0] == 0xe5) {
+                        return &dir[i];
+                    }
+                }
+                last = c;
+            }
+
+            const unsigned long c = AllocateClusterLocked();
+            if (c == 0) {
+                return nullptr;
+            }
+            SetFATEntryLocked(last, c);
+            return GetSectorByCluster<DirectoryEntry>(c);
+        }
     }
 
-    bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
+    WithError<DirectoryEntry*> CreateFile(const char* path) {
+        unsigned long dir_cluster = boot_volume_image->root_cluster;
+        const char* name = path;
+        if (const char* slash = strrchr(path, '/')) {
+            name = slash + 1;
+            const std::string parent(path, slash);
+            if (!parent.empty()) {
+                auto parent_entry = FindFile(parent.c_str());
+                if (parent_entry == nullptr) {
+                    return { nullptr, MAKE_ERROR(Error::kNoSuchEntry) };
+                }
+                if ((static_cast<uint8_t>(parent_entry->attr) &
+                     static_cast<uint8_t>(Attribute::kDirectory)) == 0) {
+                    return { nullptr, MAKE_ERROR(Error::kNoSuchEntry) };
+                }
+                if (parent_entry->FirstCluster() != 0) { // ".." がルートを指すと 0
+                    dir_cluster = parent_entry->FirstCluster();
+                }
+            }
+        }
+
         unsigned char name83[11];
-        memset(name83, 0x20, sizeof(name83));
+        if (!ToName83(name, name83)) {
+            return { nullptr, MAKE_ERROR(Error::kInvalidFormat) };
+        }
+
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        // 呼び出し元が FindFile で確かめてからここまでに，他のタスクが作っているかもしれない
+        if (auto existing = FindEntryLocked(dir_cluster, name83)) {
+            volume_lock.Unlock();
+            RestoreInterrupts(intr);
+            return { existing, MAKE_ERROR(Error::kAlreadyAllocated) };
+        }
+        DirectoryEntry* entry = AllocateEntryLocked(dir_cluster);
+        if (entry) {
+            memset(entry, 0, sizeof(DirectoryEntry));
+            memcpy(entry->name, name83, sizeof(name83));
+            entry->attr = Attribute::kArchive;
+            MarkDirtyLocked(entry, sizeof(DirectoryEntry));
+            CommitFATLocked();
+        }
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+
+        if (entry == nullptr) {
+            return { nullptr, MAKE_ERROR(Error::kFull) };
+        }
+        InvalidateDentryCache();
+        return { entry, MAKE_ERROR(Error::kSuccess) };
+    }
+
+    Error ResizeFile(DirectoryEntry& entry, size_t size) {
+        const size_t old_size = entry.file_size;
+        const size_t num_needed = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+        if (size > 0xffffffffu) {
+            return MAKE_ERROR(Error::kFull);
+        }
 
-        int i = 0;
-        int i83 = 0;
-        for (; name[i] != 0 && i83 < sizeof(name83); ++i, ++i83) {
-            if (name[i] == '.') {
-                i83 = 7;
-                continue;
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        if (size < old_size && open_files.count(&entry)) {
+            volume_lock.Unlock();
+            RestoreInterrupts(intr);
+            return MAKE_ERROR(Error::kBusy);
+        }
+
+        // 必要な分だけチェーンを辿る。伸ばす範囲 [old_size, size) にかかる既存クラスタは 0 で埋める。
+        unsigned long prev = 0, c = entry.FirstCluster();
+        size_t n = 0;
+        for (; n < num_needed && c != 0 && c != kEndOfClusterchain; ++n) {
+            const size_t begin = std::max(old_size, n * bytes_per_cluster);
+            const size_t end = std::min(size, (n + 1) * bytes_per_cluster);
+            if (begin < end) {
+                auto p = GetSectorByCluster<uint8_t>(c) + (begin - n * bytes_per_cluster);
+                memset(p, 0, end - begin);
+                MarkDirtyLocked(p, end - begin);
+            }
+            prev = c;
+            c = NextCluster(c);
+        }
+
+        Error err = MAKE_ERROR(Error::kSuccess);
+        if (n == num_needed) { // 余ったクラスタを解放する
+            if (c != 0 && c != kEndOfClusterchain) {
+                FreeClusterChainLocked(c);
+                if (prev) {
+                    SetFATEntryLocked(prev, kEndOfClusterchain);
+                } else {
+                    SetFirstCluster(entry, 0);
+                }
+            }
+        } else {
+            for (; n < num_needed; ++n) { // 新しいクラスタは割り当て時に 0 で埋めてある
+                const unsigned long next = AllocateClusterLocked();
+                if (next == 0) {
+                    err = MAKE_ERROR(Error::kFull);
+                    break;
+                }
+                if (prev) {
+                    SetFATEntryLocked(prev, next);
+                } else {
+                    SetFirstCluster(entry, next);
+                }
+                prev = next;
             }
-            name83[i83] = toupper(name[i]);
         }
 
-        return memcmp(entry.name, name83, sizeof(name83)) == 0;
+        if (!err) {
+            entry.file_size = size;
+        }
+        MarkDirtyLocked(&entry, sizeof(DirectoryEntry));
+        CommitFATLocked();
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+        return err;
     }
 
+    void MarkDirty(const void* addr, size_t bytes) {
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        MarkDirtyLocked(addr, bytes);
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+    }
 
+    std::vector<std::pair<unsigned long, unsigned long>> TakeDirtySectors() {
+        std::vector<std::pair<unsigned long, unsigned long>> ranges;
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        for (size_t w = 0; w < dirty_sectors.size(); ++w) {
+            for (uint64_t bits = dirty_sectors[w]; bits; bits &= bits - 1) {
+                const unsigned long s = w * 64 + __builtin_ctzll(bits);
+                if (!ranges.empty() && ranges.back().first + ranges.back().second == s) {
+                    ++ranges.back().second;
+                } else {
+                    ranges.push_back({s, 1});
+                }
+            }
+            dirty_sectors[w] = 0;
+        }
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+        return ranges;
+    }
 
+    unsigned long CountFreeClusters() {
+        unsigned long n = 0;
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        for (auto bits : free_clusters) {
+            n += __builtin_popcountll(bits);
+        }
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+        return n;
+    }
 
     size_t LoadFile(void* buf, size_t len, const DirectoryEntry& entry) {
-        auto is_valid_cluster = [](uint32_t c) {
-            return c != 0 && c != fat::kEndOfClusterchain;
-        };
-        auto cluster = entry.FirstCluster();
+        const ExtentMap extents{entry};
+        if (!IsVolumePaged()) {
+            return extents.Read(0, buf, len);
+        }
+        // 一度に全部写すと 1 ページずつ同期的に読むことになるので，
+        // 少しずつ写しながら先を読ませてデバイスの待ち時間と重ねる
+        auto p = reinterpret_cast<uint8_t*>(buf);
+        ReadAhead read_ahead;
+        size_t total = 0;
+        while (total < len) {
+            const size_t chunk = std::min(kLoadChunkBytes, len - total);
+            read_ahead.BeforeRead(extents, total, chunk);
+            const size_t n = extents.Read(total, p + total, chunk);
+            total += n;
+            if (n < chunk) {
+                break;
+            }
+        }
+        return total;
+    }
 
-        const auto buf_uint8 = reinterpret_cast<uint8_t*>(buf);
-        const auto buf_end = buf_uint8 + len;
-        auto p = buf_uint8;
+    ExtentMap::ExtentMap(const DirectoryEntry& entry) : file_size_{entry.file_size} {
+        unsigned long file_cluster = 0;
+        for (unsigned long c = entry.FirstCluster(); c != 0 && c != kEndOfClusterchain;
+             c = NextCluster(c), ++file_cluster) {
+            if (!extents_.empty()) {
+                auto& last = extents_.back();
+                if (last.cluster + last.length == c) {
+                    ++last.length;
+                    continue;
+                }
+            }
+            extents_.push_back({file_cluster, c, 1});
+        }
+    }
 
-        while (is_valid_cluster(cluster)) {
-            if (bytes_per_cluster >= buf_end - p) {
-            memcpy(p, GetSectorByCluster<uint8_t>(cluster), buf_end - p);
-            return len;
+    FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry, bool writable, bool append)
+        : fat_entry_{fat_entry}, writable_{writable}, append_{append}, extents_{fat_entry} {
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        ++open_files[&fat_entry_];
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+    }
+
+    FileDescriptor::~FileDescriptor() {
+        const bool intr = DisableInterrupts();
+        volume_lock.Lock();
+        if (--open_files[&fat_entry_] == 0) {
+            open_files.erase(&fat_entry_);
+        }
+        volume_lock.Unlock();
+        RestoreInterrupts(intr);
+    }
+
+    size_t FileDescriptor::Read(void* buf, size_t len) {
+        Refresh();
+        read_ahead_.BeforeRead(extents_, offset_, len);
+        const size_t n = extents_.Read(offset_, buf, len);
+        offset_ += n;
+        return n;
+    }
+
+    WithError<size_t> FileDescriptor::Write(const void* buf, size_t len) {
+        if (!writable_) {
+            return { 0, MAKE_ERROR(Error::kIsReadOnly) };
+        }
+        if (append_) {
+            offset_ = fat_entry_.file_size;
+        }
+        if (offset_ + len > fat_entry_.file_size) {
+            if (auto err = ResizeFile(fat_entry_, offset_ + len)) {
+                return { 0, err };
+            }
+        }
+        Refresh();
+
+        auto src = reinterpret_cast<const uint8_t*>(buf);
+        size_t total = 0;
+        while (total < len) {
+            size_t n;
+            auto dst = const_cast<uint8_t*>(extents_.Locate(offset_ + total, n));
+            if (dst == nullptr) {
+                break;
+            }
+            n = std::min(n, len - total);
+            memcpy(dst, src + total, n);
+            MarkDirty(dst, n);
+            total += n;
+        }
+        offset_ += total;
+        return { total, MAKE_ERROR(Error::kSuccess) };
+    }
+
+    void FileDescriptor::Refresh() const {
+        if (extents_.FileSize() != fat_entry_.file_size) {
+            extents_ = ExtentMap{fat_entry_};
+        }
+    }
+
+    const uint8_t* ExtentMap::Locate(size_t offset, size_t& contiguous_bytes) const {
+        contiguous_bytes = 0;
+        if (offset >= file_size_) {
+            return nullptr;
+        }
+        const unsigned long file_cluster = offset / bytes_per_cluster;
+        // file_cluster を含む最後のエクステントを探す
+        auto it = std::upper_bound(extents_.begin(), extents_.end(), file_cluster,
+            [](unsigned long fc, const Extent& e) { return fc < e.file_cluster; });
+        if (it == extents_.begin()) {
+            return nullptr;
+        }
+        --it;
+        if (file_cluster >= it->file_cluster + it->length) {
+            return nullptr; // チェーンがファイルの大きさより短い
+        }
+
+        const size_t extent_offset = offset - it->file_cluster * bytes_per_cluster;
+        contiguous_bytes = std::min<size_t>(it->length * bytes_per_cluster - extent_offset,
+                                            file_size_ - offset);
+        return GetSectorByCluster<uint8_t>(it->cluster) + extent_offset;
+    }
+
+    size_t ExtentMap::Prefetch(size_t offset, size_t len, BlockIOWaiter& waiter) const {
+        if (!IsVolumePaged()) {
+            return 0;
+        }
+        size_t num_requests = 0;
+        for (size_t done = 0; done < len; ) {
+            size_t n;
+            auto p = Locate(offset + done, n);
+            if (p == nullptr) {
+                break;
             }
-            memcpy(p, GetSectorByCluster<uint8_t>(cluster), bytes_per_cluster);
-            p += bytes_per_cluster;
-            cluster = NextCluster(cluster);
+            n = std::min(n, len - done);
+            num_requests += PrefetchVolume(p, n, waiter);
+            done += n;
         }
-        return p - buf_uint8;
+        return num_requests;
+    }
+
+    ReadAhead::~ReadAhead() {
+        for (auto& p : pending_) {
+            WaitBlockIOCompletions(*p.waiter);
+        }
+    }
+
+    void ReadAhead::BeforeRead(const ExtentMap& extents, size_t offset, size_t len) {
+        const auto [ ahead, ahead_len ] = OnRead(offset, len);
+        if (ahead_len > 0 && IsVolumePaged()) {
+            auto waiter = std::make_unique<BlockIOWaiter>();
+            waiter->remaining = 1; // 要求をすべて出すまで完了が揃わないよう，自分の分を数えておく
+            waiter->task_id = task_manager->CurrentTask().ID();
+            waiter->tag = reinterpret_cast<uint64_t>(waiter.get());
+            if (extents.Prefetch(ahead, ahead_len, *waiter) > 0) {
+                ReleaseBlockIOWaiter(*waiter);
+                pending_.push_back({ahead, ahead + ahead_len, std::move(waiter)});
             }
-} 
\ No newline at end of file
+        }
+
+        const size_t end = offset + len;
+        for (auto it = pending_.begin(); it != pending_.end(); ) {
+            if (it->begin < end && offset < it->end) {
+                WaitBlockIOCompletions(*it->waiter);
+                it = pending_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::pair<size_t, size_t> ReadAhead::OnRead(size_t offset, size_t len) {
+        const size_t end = offset + len;
+        if (offset == next_offset_) {
+            window_ = window_ == 0 ? kInitialWindow : std::min(2 * window_, kMaxWindow);
+        } else {
+            window_ = 0; // ランダムアクセス。続きが読まれるまで先読みしない
+            ahead_end_ = end;
+        }
+        next_offset_ = end;
+
+        if (window_ == 0 || ahead_end_ >= end + window_ / 2) {
+            return {end, 0};
+        }
+        const size_t begin = std::max(ahead_end_, end);
+        ahead_end_ = end + window_;
+        return {begin, ahead_end_ - begin};
+    }
+
+    size_t ExtentMap::Read(size_t offset, void* buf, size_t len) const {
+        auto p = reinterpret_cast<uint8_t*>(buf);
+        size_t total = 0;
+        while (total < len) {
+            size_t n;
+            const uint8_t* src = Locate(offset + total, n);
+            if (src == nullptr) {
+                break;
+            }
+            n = std::min(n, len - total);
+            memcpy(p + total, src, n);
+            total += n;
+        }
+        return total;
+    }
+}
@@ -8,6 +8,15 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file.hpp"
+
+struct BlockIOWaiter;
 
 namespace fat {
 
@@ -110,16 +119,39 @@ static const unsigned long kEndOfClusterchain = 0x0ffffffflu;
  */
 unsigned long NextCluster(unsigned long cluster);
 
-/** @brief 指定されたディレクトリからファイルを探す。
+/** @brief パスで指定されたファイルを探す。
  *
- * @param name  8+3形式のファイル名（大文字小文字は区別しない）
- * @param directory_cluster  ディレクトリの開始クラスタ（省略するとルートディレクトリから検索する）
- * @return ファイルを表すエントリ。見つからなければ nullptr。
+ * パスは '/' で区切ってサブディレクトリを辿る。'/' で始まるパスはルートディレクトリから探す。
+ * 各要素は 8.3 形式の短名か VFAT の長い名前と比べる（大文字小文字は区別しない）。
+ * ディレクトリを初めて探すときに全エントリを走査してキャッシュに登録し，
+ * パス全体の解決結果も（見つからなかったことも含めて）キャッシュするので，
+ * 2 回目以降はハッシュ表を 1 回引くだけで済む。
+ *
+ * @param path  ファイルのパス
+ * @param directory_cluster  相対パスの起点となるディレクトリの開始クラスタ（省略するとルートディレクトリ）
+ * @return ファイルまたはディレクトリを表すエントリ。見つからなければ nullptr。
  */
-DirectoryEntry* FindFile(const char* name, unsigned long directory_cluster = 0);
+DirectoryEntry* FindFile(const char* path, unsigned long directory_cluster = 0);
 
+/** @brief エントリの短名が name と等しければ true（大文字小文字は区別しない） */
 bool NameIsEqual(const DirectoryEntry& entry, const char* name);
 
+/** @brief FindFile のキャッシュをすべて捨てる。
+ *
+ * ディレクトリエントリを追加・削除・移動したら呼び出すこと。
+ */
+void InvalidateDentryCache();
+
+/** @brief ディレクトリ内のエントリを，表示用の名前と組にしてすべて返す。
+ *
+ * 名前は長い名前（UTF-8）があればそれを，無ければ "BASE.EXT" 形式の短名を使う。
+ * 削除済みのエントリとボリュームラベルは含まない。
+ *
+ * @param directory_cluster  ディレクトリの開始クラスタ（0 ならルートディレクトリ）
+ */
+std::vector<std::pair<DirectoryEntry*, std::string>>
+ListDirectory(unsigned long directory_cluster = 0);
+
 /** @brief 指定されたファイルの内容をバッファへコピーする。
  *
  * @param buf  ファイル内容の格納先
@@ -129,4 +161,147 @@ bool NameIsEqual(const DirectoryEntry& entry, const char* name);
  */
 size_t LoadFile(void* buf, size_t len, const DirectoryEntry& entry);
 
+/** @brief クラスタチェーン上で連続するクラスタの並び */
+struct Extent {
+  unsigned long file_cluster; // ファイル先頭から数えたクラスタの番号
+  unsigned long cluster;      // ボリューム上の開始クラスタ
+  unsigned long length;       // 連続するクラスタの数
+};
+
+/** @brief ファイルのクラスタチェーンを連続区間（エクステント）の列に圧縮したもの
+ *
+ * 構築時に一度だけチェーンをたどる。ボリュームはメモリ上にあるので，
+ * 1 つのエクステントはメモリ上でも連続しており，1 回の memcpy で読める。
+ * 任意の位置の読み出しはエクステントの二分探索で済む。
+ */
+class ExtentMap {
+ public:
+  ExtentMap() = default;
+  explicit ExtentMap(const DirectoryEntry& entry);
+
+  /** @brief ファイルの offset バイト目から最大 len バイトを buf に読み，読んだバイト数を返す。 */
+  size_t Read(size_t offset, void* buf, size_t len) const;
+
+  /** @brief ファイルの offset バイト目が置いてあるメモリアドレスと，そこから連続して読めるバイト数を返す。
+   *
+   * offset がファイルの大きさ以上なら nullptr と 0 を返す。
+   */
+  const uint8_t* Locate(size_t offset, size_t& contiguous_bytes) const;
+
+  /** @brief ファイルの offset バイト目から len バイトのうち，ボリュームに無いページの読み込みを始める。
+   *
+   * 発行した要求は waiter に結びつけ，その数を返す。ボリュームがメモリ上にあるときは何もしない。
+   */
+  size_t Prefetch(size_t offset, size_t len, BlockIOWaiter& waiter) const;
+
+  const std::vector<Extent>& Extents() const { return extents_; }
+  size_t FileSize() const { return file_size_; }
+
+ private:
+  std::vector<Extent> extents_{};
+  size_t file_size_{0};
+};
+
+/** @brief ファイルの読み出し位置から順次アクセスを検出し，先読みする
+ *
+ * 直前の読み出しの続きを読むと順次アクセスとみなして先読みの窓を倍々に広げ，
+ * それ以外の位置へ飛ぶと窓を 0 に戻す。先読み済みの範囲の残りが窓の半分を
+ * 切ったら，次の窓の分を読み込み始める。
+ *
+ * 読み込み中の先読みの完了は，それを始めたタスクへのメッセージで知らされるので，
+ * 先読みを始めたタスクの中で使い，破棄すること。
+ */
+class ReadAhead {
+ public:
+  static const size_t kInitialWindow = 32 * 1024;
+  static const size_t kMaxWindow = 1024 * 1024;
+
+  ReadAhead() = default;
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+  /** @brief 読み込み中の先読みがあれば，終わるまで待つ */
+  ~ReadAhead();
+
+  /** @brief offset から len バイト読むことを記録し，新たに先読みする範囲 {先頭, バイト数} を返す。 */
+  std::pair<size_t, size_t> OnRead(size_t offset, size_t len);
+
+  /** @brief extents の offset から len バイトを読む直前に呼ぶ。
+   *
+   * OnRead で決まった範囲の先読みを始め，読もうとしている範囲にかかる先読みが
+   * 終わるまで待つ。読み込み中のページに触れてページフォルトで読み直すのを防ぐ。
+   */
+  void BeforeRead(const ExtentMap& extents, size_t offset, size_t len);
+
+  size_t Window() const { return window_; }
+
+ private:
+  /** @brief 読み込み中の先読み。ファイル上の範囲 [begin, end) の要求を waiter で待つ。 */
+  struct Pending {
+    size_t begin, end;
+    std::unique_ptr<BlockIOWaiter> waiter;
+  };
+
+  size_t next_offset_{0}; // 順次アクセスなら次に読まれる位置
+  size_t window_{0};
+  size_t ahead_end_{0};   // ここまでは先読みを始めている
+  std::deque<Pending> pending_{};
+};
+
+/** @brief FAT 上のファイルを読み書きするファイル記述子
+ *
+ * 大きさとクラスタチェーンはディレクトリエントリを正とし，
+ * 他の記述子が書いて変わっていればエクステントを作り直す。
+ */
+class FileDescriptor : public ::FileDescriptor {
+ public:
+  explicit FileDescriptor(DirectoryEntry& fat_entry, bool writable = false, bool append = false);
+  ~FileDescriptor();
+  size_t Read(void* buf, size_t len) override;
+  WithError<size_t> Write(const void* buf, size_t len) override;
+  size_t Size() const override { return fat_entry_.file_size; }
+  const uint8_t* Locate(size_t offset, size_t& contiguous_bytes) const override {
+    Refresh();
+    return extents_.Locate(offset, contiguous_bytes);
+  }
+
+ private:
+  DirectoryEntry& fat_entry_;
+  const bool writable_, append_;
+  mutable ExtentMap extents_;
+  ReadAhead read_ahead_;
+
+  void Refresh() const;
+};
+
+/** @brief path に大きさ 0 の通常ファイルを作る。
+ *
+ * 親ディレクトリは存在していなければならない。作れる名前は 8.3 形式に収まるものだけ。
+ * 親ディレクトリに空きエントリが無ければクラスタを 1 つ足して伸ばす。
+ * 同じ名前の確認とエントリの確保はまとめて行うので，同時に呼ばれても 1 つしか作らない。
+ *
+ * @return 作ったファイルのエントリ。同じ名前が既にあればそのエントリと kAlreadyAllocated
+ */
+WithError<DirectoryEntry*> CreateFile(const char* path);
+
+/** @brief ファイルの大きさを size バイトに変える。
+ *
+ * 縮めるときは不要になったクラスタを解放し，伸ばすときはクラスタを割り当てて
+ * 新しい部分を 0 で埋める。FAT の変更は最後にまとめてすべての FAT へ反映する。
+ * 解放したクラスタを他の記述子のエクステントや MapFile の割り当てが指し続けないよう，
+ * 開いている記述子（FileDescriptor）があるファイルは縮められず kBusy を返す。
+ */
+Error ResizeFile(DirectoryEntry& entry, size_t size);
+
+/** @brief ボリュームイメージ上の [addr, addr + bytes) を書き戻しが必要な範囲として記録する。 */
+void MarkDirty(const void* addr, size_t bytes);
+
+/** @brief 書き戻しが必要なセクタを (先頭セクタ, セクタ数) の連続区間の列として返し，記録を消す。
+ *
+ * ブロックデバイスへ書き出す側が呼ぶ。
+ */
+std::vector<std::pair<unsigned long, unsigned long>> TakeDirtySectors();
+
+/** @brief 空いているクラスタの数 */
+unsigned long CountFreeClusters();
+
 } // namespace fat
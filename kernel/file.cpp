@@ -0,0 +1,107 @@
+#include "file.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "fat.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "volume_cache.hpp"
+
+namespace {
+    // MapFile の割り当て先。アプリ本体（PML4 のエントリ 256）とは別のエントリにして，
+    // CleanPageMaps がボリュームイメージのフレームを解放しないようにする。
+    const uint64_t kFileMapBase = 0xffff'8080'0000'0000;
+    const uint64_t kFileMapEnd  = 0xffff'8100'0000'0000;
+    const size_t kPageBytes = 4096;
+
+    bool IsInVolumeImage(uintptr_t addr) {
+        const auto begin = reinterpret_cast<uintptr_t>(fat::boot_volume_image);
+        const uint64_t volume_bytes =
+            static_cast<uint64_t>(fat::boot_volume_image->total_sectors_32) *
+            fat::boot_volume_image->bytes_per_sector;
+        return begin <= addr && addr < begin + volume_bytes;
+    }
+
+    /** @brief ファイルの offset から 1 ページ分（ファイル末尾を越える部分は 0）を dst に書く */
+    void CopyPage(const FileDescriptor& fd, size_t offset, uint8_t* dst) {
+        memset(dst, 0, kPageBytes);
+        size_t copied = 0;
+        while (copied < kPageBytes) {
+            size_t n;
+            const uint8_t* src = fd.Locate(offset + copied, n);
+            if (src == nullptr) {
+                break;
+            }
+            n = std::min(n, kPageBytes - copied);
+            memcpy(dst + copied, src, n);
+            copied += n;
+        }
+    }
+}
+
+WithError<uint64_t> MapFile(Task& task, const std::shared_ptr<FileDescriptor>& file) {
+    const FileDescriptor& fd = *file;
+    auto& maps = task.FileMaps();
+    const uint64_t begin = maps.empty() ? kFileMapBase : maps.back().end;
+    const size_t num_pages = (fd.Size() + kPageBytes - 1) / kPageBytes;
+    if (num_pages == 0 || begin + num_pages * kPageBytes > kFileMapEnd) {
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        const size_t offset = i * kPageBytes;
+        LinearAddress4Level addr{begin + offset};
+        size_t contiguous;
+        const uint8_t* src = fd.Locate(offset, contiguous);
+        uintptr_t phys = reinterpret_cast<uintptr_t>(src);
+        bool copied = false;
+        // 1 ページ丸ごとがページ境界から連続していればそのフレームを共有する。
+        // ボリュームが窓を通して見えているときは src は物理アドレスではないので常にコピーする。
+        if (src == nullptr || IsVolumePaged() ||
+            phys % kPageBytes != 0 || contiguous < kPageBytes) {
+            auto [ frame, err ] = memory_manager->Allocate(1);
+            if (err) {
+                maps.push_back({begin, addr.value, file});
+                return {0, err};
+            }
+            CopyPage(fd, offset, reinterpret_cast<uint8_t*>(frame.Frame()));
+            phys = reinterpret_cast<uintptr_t>(frame.Frame());
+            copied = true;
+        }
+        if (auto err = MapUserPageReadOnly(addr, phys)) {
+            if (copied) { // マップできなかったフレームは UnmapFiles でも回収されない
+                memory_manager->Free(FrameID{phys / kBytesPerFrame}, 1);
+            }
+            maps.push_back({begin, addr.value, file});
+            return {0, err};
+        }
+    }
+
+    const uint64_t end = begin + num_pages * kPageBytes;
+    maps.push_back({begin, end, file});
+    return {begin, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error UnmapFiles(Task& task) {
+    auto& maps = task.FileMaps();
+    if (maps.empty()) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    for (const auto& map : maps) {
+        const auto owned = [](uintptr_t phys) { return !IsInVolumeImage(phys); };
+        if (auto err = UnmapUserPages(LinearAddress4Level{map.begin},
+                                      (map.end - map.begin) / kPageBytes, owned)) {
+            return err;
+        }
+    }
+    maps.clear();
+    // 葉のエントリはすべて外したので，残りのページング構造だけが解放される
+    if (auto err = CleanPageMaps(LinearAddress4Level{kFileMapBase})) {
+        return err;
+    }
+    SetCR3(GetCR3());
+    return MAKE_ERROR(Error::kSuccess);
+}
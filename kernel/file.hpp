@@ -0,0 +1,83 @@
+/**
+ * @file file.hpp
+ *
+ * アプリに見せるファイル（ファイル記述子）を扱うプログラムを集めたファイル。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "error.hpp"
+
+/** @brief Seek の基準位置（newlib の SEEK_SET, SEEK_CUR, SEEK_END と同じ値） */
+enum SeekWhence {
+    kSeekSet = 0,
+    kSeekCur = 1,
+    kSeekEnd = 2,
+};
+
+class FileDescriptor {
+public:
+    virtual ~FileDescriptor() = default;
+
+    /** @brief 現在位置から最大 len バイトを buf に読み，読んだバイト数を返す。現在位置はその分進む。 */
+    virtual size_t Read(void* buf, size_t len) = 0;
+
+    /** @brief 現在位置に buf の len バイトを書き，書いたバイト数を返す。現在位置はその分進む。
+     *
+     * 末尾を越えて書くとファイルが伸びる。書き込めない記述子なら kIsReadOnly を返す。
+     */
+    virtual WithError<size_t> Write(const void* buf, size_t len) = 0;
+
+    virtual size_t Size() const = 0;
+
+    /** @brief offset バイト目のデータが置いてあるメモリアドレスと，そこから連続して読めるバイト数を返す。
+     *
+     * データがメモリ上に無いファイルや，offset がファイルの外なら nullptr を返す。
+     */
+    virtual const uint8_t* Locate(size_t offset, size_t& contiguous_bytes) const = 0;
+
+    /** @brief 現在位置を変更し，変更後の位置を返す。負の位置になる場合は変更しない。 */
+    WithError<size_t> Seek(int64_t offset, int whence) {
+        int64_t base;
+        switch (whence) {
+        case kSeekSet: base = 0; break;
+        case kSeekCur: base = offset_; break;
+        case kSeekEnd: base = Size(); break;
+        default: return {offset_, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        if (base + offset < 0) {
+            return {offset_, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        offset_ = base + offset;
+        return {offset_, MAKE_ERROR(Error::kSuccess)};
+    }
+
+protected:
+    size_t offset_{0};
+};
+
+class Task;
+
+/** @brief MapFile で割り当てた仮想アドレスの範囲 [begin, end) */
+struct FileMapping {
+    uint64_t begin, end;
+    // ボリュームのフレームを共有している間は，ファイルを開いたままにして縮められないようにする
+    std::shared_ptr<FileDescriptor> file;
+};
+
+/** @brief fd のファイル全体を，実行中のアプリのアドレス空間へ読み込み専用で割り当てる。
+ *
+ * ページ境界にそろったデータはボリュームイメージのフレームをそのままマップし（コピーしない），
+ * そろっていないページと末尾の端数ページだけ新しいフレームへコピーする。
+ * 割り当てた領域を UnmapFiles で解放するまで fd を保持する。
+ *
+ * @return 割り当てた領域の先頭アドレス
+ */
+WithError<uint64_t> MapFile(Task& task, const std::shared_ptr<FileDescriptor>& fd);
+
+/** @brief MapFile で割り当てた領域をすべて解放する。アプリの終了時に呼ぶ。 */
+Error UnmapFiles(Task& task);
@@ -0,0 +1,95 @@
+#include "idle.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "timer.hpp"
+
+namespace {
+    struct CPUIdleState {
+        IdleStats stats;
+        uint64_t reset_tsc;
+        uint64_t avg_idle_tsc; // 最近の停止時間の指数移動平均。深い C ステートを選ぶ目安
+    };
+
+    std::array<CPUIdleState, kMaxCPUs> idle_states{};
+
+    bool mwait_available = false;
+    // MWAIT のヒント（EAX）。ビット 7:4 が C ステート - 1，ビット 3:0 がサブステート。
+    const uint32_t kHintC1 = 0x00;
+    uint32_t deep_hint = kHintC1;
+
+    // この時間（1/kDeepIdleDivisor 秒）より長く止まりそうなら深いヒントを使う
+    const unsigned long kDeepIdleDivisor = 1000;
+}
+
+void InitializeIdle() {
+    ResetIdleStats();
+
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx & (1u << 3)) == 0) {
+        Log(kDebug, "MONITOR/MWAIT not supported, idle with HLT\n");
+        return;
+    }
+    mwait_available = true;
+
+    CPUID(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 5) {
+        CPUID(5, 0, &eax, &ebx, &ecx, &edx);
+        // EDX のビット 11:8 は C2 のサブステート数
+        if ((edx >> 8) & 0xf) {
+            deep_hint = 0x10;
+        }
+    }
+    Log(kDebug, "idle with MWAIT, deep hint 0x%x\n", deep_hint);
+}
+
+bool MWaitAvailable() {
+    return mwait_available;
+}
+
+void CPUIdle(const std::atomic<uint32_t>& wake, uint32_t expected) {
+    auto& s = idle_states[CurrentCPU()];
+    const uint64_t begin = ReadTSC();
+
+    if (mwait_available) {
+        MonitorAddress(&wake);
+        if (wake.load(std::memory_order_acquire) != expected) {
+            __asm__("sti");
+            return;
+        }
+        const bool deep = deep_hint != kHintC1 && tsc_freq != 0 &&
+                          s.avg_idle_tsc > tsc_freq / kDeepIdleDivisor;
+        StiMWait(deep ? deep_hint : kHintC1);
+        if (deep) {
+            ++s.stats.deep_entries;
+        }
+    } else {
+        // sti の次の命令までは割り込みが入らないので，ここで起床を取りこぼすことはない
+        __asm__("sti\n\thlt");
+    }
+
+    // 割り込みハンドラの実行時間も含むが，タイマ割り込み 1 回分程度なので区別しない
+    const uint64_t idle = ReadTSC() - begin;
+    s.stats.idle_tsc += idle;
+    ++s.stats.entries;
+    s.avg_idle_tsc = (s.avg_idle_tsc * 7 + idle) / 8;
+}
+
+IdleStats GetIdleStats(int cpu) {
+    auto& s = idle_states[cpu];
+    IdleStats stats = s.stats;
+    stats.total_tsc = ReadTSC() - s.reset_tsc;
+    return stats;
+}
+
+void ResetIdleStats() {
+    const uint64_t now = ReadTSC();
+    for (auto& s : idle_states) {
+        s.stats = {};
+        s.reset_tsc = now;
+    }
+}
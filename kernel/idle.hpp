@@ -0,0 +1,38 @@
+/**
+ * @file idle.hpp
+ *
+ * 実行するタスクが無い CPU を止めておくためのプログラムを集めたファイル。
+ *
+ * MONITOR/MWAIT が使える CPU では実行キューの起床カウンタを監視しながら止まるので，
+ * 他の CPU がタスクを積むと割り込み（IPI）なしで直ちに再開する。
+ * 使えない CPU では HLT で止まり，次の割り込みまで再開しない。
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** @brief MONITOR/MWAIT の有無と使える C ステートを調べる。BSP で 1 回呼ぶ。 */
+void InitializeIdle();
+
+/** @brief MONITOR/MWAIT を使って待つなら true */
+bool MWaitAvailable();
+
+/** @brief 割り込みか wake への書き込みがあるまで呼び出した CPU を止める。
+ *
+ * 割り込みを禁止した状態で呼ぶ。wake が expected から変わっていれば止まらずに戻る。
+ * 戻ったときには割り込みが許可されている。
+ */
+void CPUIdle(const std::atomic<uint32_t>& wake, uint32_t expected);
+
+struct IdleStats {
+    uint64_t idle_tsc;  // 止まっていた時間の合計（TSC カウント）
+    uint64_t total_tsc; // 統計を取り始めてからの時間
+    uint64_t entries;   // 止まった回数
+    uint64_t deep_entries; // そのうち C1 より深いヒントで MWAIT した回数
+};
+
+IdleStats GetIdleStats(int cpu);
+/** @brief すべての CPU の統計を 0 に戻す。 */
+void ResetIdleStats();
@@ -0,0 +1,98 @@
+#include "init_step.hpp"
+
+#include <vector>
+
+#include "boot_profile.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "message.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+    struct InitStep {
+        const char* name;
+        bool (*func)();
+        InitContext context;
+        int waiting; // まだ終わっていない依存先の数
+        std::vector<int> dependents;
+        bool launched; // Launch 済みか。waiting と同じく steps_lock で守る
+
+    };
+
+    std::vector<InitStep> steps; // StartInitSteps の後は要素を増やさない
+    Spinlock steps_lock;
+    uint64_t main_task_id;
+
+    void TaskInitStep(uint64_t task_id, int64_t data) {
+        RunInitStep(data);
+        task_manager->Exit();
+    }
+
+    void Launch(int id) {
+        if (steps[id].context == InitContext::kMainTask) {
+            Message msg{Message::kInitStep};
+            msg.arg.init_step.id = id;
+            task_manager->SendMessage(main_task_id, msg);
+            return;
+        }
+        task_manager->NewTask()
+            .InitContext(TaskInitStep, id)
+            .Wakeup();
+    }
+}
+
+int AddInitStep(const char* name, bool (*func)(), InitContext context,
+                std::initializer_list<int> deps) {
+    const int id = steps.size();
+    steps.push_back({name, func, context, static_cast<int>(deps.size()), {}, false});
+    for (int dep : deps) {
+        steps[dep].dependents.push_back(id);
+    }
+    return id;
+}
+
+void StartInitSteps() {
+    main_task_id = task_manager->CurrentTask().ID();
+    // 先に起動したステップが終わって依存先を起動していることがあるので，
+    // launched を見て 2 度起動しないようにする
+    std::vector<int> ready;
+    const bool intr = DisableInterrupts();
+    steps_lock.Lock();
+    for (size_t id = 0; id < steps.size(); ++id) {
+        if (steps[id].waiting == 0 && !steps[id].launched) {
+            steps[id].launched = true;
+            ready.push_back(id);
+        }
+    }
+    steps_lock.Unlock();
+    RestoreInterrupts(intr);
+
+    for (int id : ready) {
+        Launch(id);
+    }
+}
+
+void RunInitStep(int id) {
+    if (!steps[id].func()) {
+        Log(kError, "init step %s failed; its dependents are skipped\n", steps[id].name);
+        return;
+    }
+    RecordBootPhase(steps[id].name);
+
+    std::vector<int> ready;
+    const bool intr = DisableInterrupts();
+    steps_lock.Lock();
+    for (int d : steps[id].dependents) {
+        if (--steps[d].waiting == 0 && !steps[d].launched) {
+            steps[d].launched = true;
+            ready.push_back(d);
+        }
+    }
+    steps_lock.Unlock();
+    RestoreInterrupts(intr);
+
+    for (int d : ready) {
+        Launch(d);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file init_step.hpp
+ *
+ * 起動時の初期化処理を依存関係に従って並行に実行するプログラムを集めたファイル。
+ *
+ * 各ステップは依存先がすべて終わった時点で起動する。依存し合わないステップは
+ * 別々のタスクで並行に動くので，遅いデバイスの初期化がデスクトップの表示や
+ * 他のステップを待たせない。
+ */
+
+#pragma once
+
+#include <initializer_list>
+
+enum class InitContext {
+    kTask,     // 専用のタスクを作って実行する
+    kMainTask, // メインタスクのイベントループで実行する（メインタスクが扱うデバイス用）
+};
+
+/** @brief ステップを登録し，その番号を返す。StartInitSteps より前に呼ぶ。
+ *
+ * @param func  ステップの本体。false を返すと失敗とみなし，依存するステップは起動しない。
+ * @param deps  このステップより先に終わっていなければならないステップの番号
+ */
+int AddInitStep(const char* name, bool (*func)(), InitContext context,
+                std::initializer_list<int> deps = {});
+
+/** @brief 依存先の無いステップから実行を始める。メインタスクから 1 回だけ呼ぶ。 */
+void StartInitSteps();
+
+/** @brief ステップを実行し，それを待っていたステップを起動する。
+ *
+ * kMainTask のステップは，メインタスクが kInitStep を受け取ったときにここを呼ぶ。
+ */
+void RunInitStep(int id);
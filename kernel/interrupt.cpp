@@ -1,9 +1,12 @@
 ﻿#include "interrupt.hpp"
 
 #include "asmfunc.h"
+#include "block_device.hpp"
+#include "kernel_stack.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 #include "task.hpp"
+#include "volume_cache.hpp"
 #include "graphics.hpp"
 #include "font.hpp"
 
@@ -28,8 +31,18 @@ void NotifyEndOfInterrupt() {
 namespace {
     __attribute__((interrupt))
     void IntHandlerXHCI(InterruptFrame* frame) {
+        task_manager->EnterInterrupt();
         task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
         NotifyEndOfInterrupt();
+        task_manager->LeaveInterrupt();
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerBlockIO(InterruptFrame* frame) {
+        task_manager->EnterInterrupt();
+        NotifyBlockIOInterrupt();
+        NotifyEndOfInterrupt();
+        task_manager->LeaveInterrupt();
     }
 
     void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
@@ -78,18 +91,41 @@ namespace {
     FaultHandlerNoError(OF)
     FaultHandlerNoError(BR)
     FaultHandlerNoError(UD)
-    FaultHandlerNoError(NM)
     FaultHandlerWithError(DF)
     FaultHandlerWithError(TS)
     FaultHandlerWithError(NP)
     FaultHandlerWithError(SS)
     FaultHandlerWithError(GP)
-    FaultHandlerWithError(PF)
     FaultHandlerNoError(MF)
     FaultHandlerWithError(AC)
     FaultHandlerNoError(MC)
     FaultHandlerNoError(XM)
     FaultHandlerNoError(VE)
+
+    __attribute__((interrupt))
+    void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
+        const uint64_t cr2 = GetCR2();
+        // カーネルが存在しないページに触れたなら，ボリュームの窓のページかもしれない
+        if ((error_code & 0x5) == 0) {
+            // 読み込み処理が SSE レジスタを使っても割り込まれた側の値を壊さないようにする
+            alignas(16) uint8_t fxsave_area[512];
+            __asm__ volatile("fxsave %0" : "=m"(fxsave_area));
+            const bool handled = HandleVolumePageFault(cr2);
+            __asm__ volatile("fxrstor %0" : : "m"(fxsave_area));
+            if (handled) {
+                return;
+            }
+        }
+        PrintFrame(frame, "#PF");
+        WriteString(*screen_writer, {500, 16 * 4}, "ERR", {0, 0, 0});
+        PrintHex(error_code, 16, {500 + 8 * 4, 16 * 4});
+        WriteString(*screen_writer, {500, 16 * 5}, "CR2", {0, 0, 0});
+        PrintHex(cr2, 16, {500 + 8 * 4, 16 * 5});
+        if (IsKernelStackGuard(cr2)) {
+            WriteString(*screen_writer, {500, 16 * 6}, "kernel stack overflow", {0, 0, 0});
+        }
+        while (true) __asm__("hlt");
+    }
 }
 
 void InitializeInterrupt() {
@@ -100,25 +136,37 @@ void InitializeInterrupt() {
                     kKernelCS);
     };
     set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+    set_idt_entry(InterruptVector::kBlockIO, IntHandlerBlockIO);
     SetIDTEntry(idt[InterruptVector::kLAPICTimer],
                 MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
                             true /* present */, kISTForTimer /* IST */),
                 reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
                 kKernelCS);
-    set_idt_entry(InterruptVector::kLAPICTimer, IntHandlerLAPICTimer);
     set_idt_entry(0,  IntHandlerDE);
     set_idt_entry(1,  IntHandlerDB);
     set_idt_entry(3,  IntHandlerBP);
     set_idt_entry(4,  IntHandlerOF);
     set_idt_entry(5,  IntHandlerBR);
     set_idt_entry(6,  IntHandlerUD);
-    set_idt_entry(7,  IntHandlerNM);
-    set_idt_entry(8,  IntHandlerDF);
+    SetIDTEntry(idt[7],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                            true /* present */, kISTForNM /* IST */),
+                reinterpret_cast<uint64_t>(IntHandlerNM),
+                kKernelCS);
+    SetIDTEntry(idt[8],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                            true /* present */, kISTForFault /* IST */),
+                reinterpret_cast<uint64_t>(IntHandlerDF),
+                kKernelCS);
     set_idt_entry(10, IntHandlerTS);
     set_idt_entry(11, IntHandlerNP);
     set_idt_entry(12, IntHandlerSS);
     set_idt_entry(13, IntHandlerGP);
-    set_idt_entry(14, IntHandlerPF);
+    SetIDTEntry(idt[14],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                            true /* present */, kISTForFault /* IST */),
+                reinterpret_cast<uint64_t>(IntHandlerPF),
+                kKernelCS);
     set_idt_entry(16, IntHandlerMF);
     set_idt_entry(17, IntHandlerAC);
     set_idt_entry(18, IntHandlerMC);
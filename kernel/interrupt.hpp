@@ -46,6 +46,8 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 }
 
 const int kISTForTimer = 1; // index of the interrupt stack table
+const int kISTForNM = 2; // #NM はタスクの小さなスタックで FPU 状態を退避しないよう専用の IST を使う
+const int kISTForFault = 3; // #PF, #DF はスタックあふれでも報告できるよう専用の IST を使う
 
 void SetIDTEntry(InterruptDescriptor& desc, 
                  InterruptDescriptorAttribute attr, 
@@ -57,6 +59,7 @@ class InterruptVector {
     enum Number {
         kXHCI = 0x40,
         kLAPICTimer = 0x41,
+        kBlockIO = 0x42,
     };
 };
 
@@ -70,4 +73,18 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+/** @brief 割り込みを禁止し，禁止する前に割り込みが許可されていたかを返す。 */
+inline bool DisableInterrupts() {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+    return rflags & 0x200;
+}
+
+/** @brief DisableInterrupts() の戻り値に従って割り込み許可状態を元に戻す。 */
+inline void RestoreInterrupts(bool enabled) {
+    if (enabled) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
 void InitializeInterrupt();
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "kernel_stack.hpp"
+
+#include <array>
+#include <vector>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    static_assert(kBytesPerFrame == 4096);
+
+    const size_t kStackPageBytes = 4096;
+    const size_t kMaxStackPages = kMaxKernelStackBytes / kStackPageBytes;
+
+    // スロットごとにマップ済みのページ数。0 なら未使用。
+    std::array<uint8_t, kKernelStackSlots> mapped_pages{};
+    size_t num_slots_used = 0;
+    // 解放されたスロットの番号をページ数ごとに保持する
+    std::array<std::vector<uint32_t>, kMaxStackPages + 1> free_slots;
+    Spinlock stack_lock;
+
+    uint64_t SlotEnd(size_t slot) {
+        return kKernelStackRegionBase + (slot + 1) * kKernelStackSlotBytes;
+    }
+
+    WithError<size_t> NewSlot(size_t pages) {
+        if (num_slots_used >= kKernelStackSlots) {
+            return {0, MAKE_ERROR(Error::kFull)};
+        }
+        auto [ frame, err ] = memory_manager->Allocate(pages * kStackPageBytes / kBytesPerFrame);
+        if (err) {
+            return {0, err};
+        }
+        const size_t slot = num_slots_used;
+        LinearAddress4Level addr{SlotEnd(slot) - pages * kStackPageBytes};
+        if (auto err = MapKernelPages(addr, reinterpret_cast<uintptr_t>(frame.Frame()), pages)) {
+            memory_manager->Free(frame, pages * kStackPageBytes / kBytesPerFrame);
+            return {0, err};
+        }
+        ++num_slots_used;
+        mapped_pages[slot] = pages;
+        return {slot, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    size_t StackPages(size_t bytes) {
+        return (bytes + kStackPageBytes - 1) / kStackPageBytes;
+    }
+}
+
+WithError<uint64_t> AllocateKernelStack(size_t bytes) {
+    const size_t pages = StackPages(bytes);
+    if (pages == 0 || pages > kMaxStackPages) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    const bool intr = DisableInterrupts();
+    stack_lock.Lock();
+    WithError<size_t> slot{0, MAKE_ERROR(Error::kSuccess)};
+    if (auto& pool = free_slots[pages]; !pool.empty()) {
+        slot.value = pool.back();
+        pool.pop_back();
+    } else {
+        slot = NewSlot(pages);
+    }
+    stack_lock.Unlock();
+    RestoreInterrupts(intr);
+
+    if (slot.error) {
+        return {0, slot.error};
+    }
+    return {SlotEnd(slot.value), MAKE_ERROR(Error::kSuccess)};
+}
+
+void FreeKernelStack(uint64_t stack_end, size_t bytes) {
+    const size_t slot = (stack_end - kKernelStackRegionBase) / kKernelStackSlotBytes - 1;
+    const bool intr = DisableInterrupts();
+    stack_lock.Lock();
+    free_slots[StackPages(bytes)].push_back(slot);
+    stack_lock.Unlock();
+    RestoreInterrupts(intr);
+}
+
+bool IsKernelStackGuard(uint64_t addr) {
+    const uint64_t end = KernelStackEnd(addr);
+    if (end == 0) {
+        return false;
+    }
+    const size_t slot = (end - kKernelStackRegionBase) / kKernelStackSlotBytes - 1;
+    return addr < end - mapped_pages[slot] * kStackPageBytes;
+}
+
+uint64_t KernelStackEnd(uint64_t addr) {
+    if (addr < kKernelStackRegionBase ||
+        addr >= kKernelStackRegionBase + kKernelStackSlots * kKernelStackSlotBytes) {
+        return 0;
+    }
+    const size_t slot = (addr - kKernelStackRegionBase) / kKernelStackSlotBytes;
+    return SlotEnd(slot);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file kernel_stack.hpp
+ *
+ * タスクのカーネルスタックを割り当てるプログラムを集めたファイル。
+ *
+ * スタックはカーネル専用の仮想アドレス領域を固定長のスロットに分けて 1 つずつ置く。
+ * スタックはスロットの上端に詰めてマップし，下端のページは必ず未マップのまま残すので，
+ * スタックを使い切ると隣のスタックを壊す前に #PF が起きる。
+ * 解放したスタックはマップしたまま大きさごとのプールに戻し，次の割り当てで再利用する。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief カーネルスタック用の仮想アドレス領域（PML4 のエントリ 384） */
+const uint64_t kKernelStackRegionBase = 0xffff'c000'0000'0000;
+const size_t kKernelStackSlotBytes = 64 * 1024;
+const size_t kKernelStackSlots = 4096;
+const size_t kKernelStackGuardBytes = 4096;
+/** @brief 1 つのスタックに割り当てられる最大のバイト数 */
+const size_t kMaxKernelStackBytes = kKernelStackSlotBytes - kKernelStackGuardBytes;
+
+/** @brief bytes（4 KiB 単位に切り上げ）のスタックを割り当て，その終端アドレスを返す。 */
+WithError<uint64_t> AllocateKernelStack(size_t bytes);
+
+/** @brief AllocateKernelStack で得たスタックをプールに戻す。bytes は割り当て時と同じ値を渡す。 */
+void FreeKernelStack(uint64_t stack_end, size_t bytes);
+
+/** @brief addr がカーネルスタック領域の中でマップされていない部分なら true。
+ *
+ * #PF ハンドラがスタックあふれかどうかを判定するのに使う。
+ */
+bool IsKernelStackGuard(uint64_t addr);
+
+/** @brief addr を含むスタックスロットの終端アドレス。カーネルスタック領域の外なら 0。 */
+uint64_t KernelStackEnd(uint64_t addr);
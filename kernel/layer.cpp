@@ -4,6 +4,8 @@
 #include "console.hpp"
 #include "logger.hpp"
 
+RecursiveSpinlock layer_lock;
+
 namespace {
     template <class T, class U>
     void EraseIf(T& c, const U& pred) {
@@ -64,11 +66,13 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
 }
 
 Layer& LayerManager::NewLayer() {
+    LockGuard guard{layer_lock};
     ++latest_id_;
     return *layers_.emplace_back(new Layer{latest_id_});
 }
 
 void LayerManager::RemoveLayer(unsigned int id) {
+    LockGuard guard{layer_lock};
     Hide(id);
 
     auto pred = [id](const std::unique_ptr<Layer>& elem) {
@@ -77,11 +81,34 @@ void LayerManager::RemoveLayer(unsigned int id) {
     EraseIf(layers_, pred);
 }
 
-void LayerManager::Draw(const Rectangle<int>& area) const {
-    for (Layer* layer : layer_stack_) {
-        layer->DrawTo(back_buffer_, area);
+std::vector<LayerManager::DrawItem> LayerManager::SnapshotLocked(size_t first) const {
+    std::vector<DrawItem> items;
+    items.reserve(layer_stack_.size() - first);
+    for (size_t i = first; i < layer_stack_.size(); ++i) {
+        if (auto window = layer_stack_[i]->GetWindow()) {
+            items.push_back({std::move(window), layer_stack_[i]->GetPosition()});
+        }
+    }
+    return items;
+}
+
+void LayerManager::ComposeAndUnlock(const std::vector<DrawItem>& items,
+                                    const Rectangle<int>& area) const {
+    draw_lock_.Lock();
+    layer_lock.Unlock();
+    for (const auto& item : items) {
+        item.window->DrawTo(back_buffer_, item.pos, area);
     }
     screen_->Copy(area.pos, back_buffer_, area);
+    draw_lock_.Unlock();
+}
+
+void LayerManager::Draw(const Rectangle<int>& area) const {
+    const bool intr = DisableInterrupts();
+    layer_lock.Lock();
+    const auto items = SnapshotLocked(0);
+    ComposeAndUnlock(items, area);
+    RestoreInterrupts(intr);
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -89,44 +116,57 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-    bool draw = false;
+    const bool intr = DisableInterrupts();
+    layer_lock.Lock();
+    const auto it = std::find_if(layer_stack_.begin(), layer_stack_.end(),
+                                 [id](Layer* layer) { return layer->ID() == id; });
+    if (it == layer_stack_.end()) { // 非表示のレイヤー
+        layer_lock.Unlock();
+        RestoreInterrupts(intr);
+        return;
+    }
+
     Rectangle<int> window_area;
-    for (Layer* layer: layer_stack_) {
-        if (layer->ID() == id) {
-            window_area.size = layer->GetWindow()->Size();
-            window_area.pos = layer->GetPosition();
-            if (area.size.x >= 0 || area.size.y >= 0) {
-                area.pos = area.pos + window_area.pos;
-                window_area = window_area & area;
-            }
-            draw = true;
-        }
-        if (draw) {
-            layer->DrawTo(back_buffer_, window_area);
-        }
+    window_area.size = (*it)->GetWindow()->Size();
+    window_area.pos = (*it)->GetPosition();
+    if (area.size.x >= 0 || area.size.y >= 0) {
+        area.pos = area.pos + window_area.pos;
+        window_area = window_area & area;
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
+    // 指定したレイヤーとそれより上のレイヤーだけを描けばよい
+    const auto items = SnapshotLocked(it - layer_stack_.begin());
+    ComposeAndUnlock(items, window_area);
+    RestoreInterrupts(intr);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_position) {
-    auto layer = FindLayer(id);
-    const Vector2D<int> window_size = layer->GetWindow()->Size();
-    const Vector2D<int> old_pos = layer->GetPosition();
-    layer->Move(new_position);
+    Vector2D<int> window_size, old_pos;
+    {
+        LockGuard guard{layer_lock};
+        auto layer = FindLayer(id);
+        window_size = layer->GetWindow()->Size();
+        old_pos = layer->GetPosition();
+        layer->Move(new_position);
+    }
     Draw({old_pos, window_size});
     Draw(id);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
-    auto layer = FindLayer(id);
-    const Vector2D<int> window_size = layer->GetWindow()->Size();
-    const Vector2D<int> old_pos = layer->GetPosition();
-    layer->MoveRelative(pos_diff);
+    Vector2D<int> window_size, old_pos;
+    {
+        LockGuard guard{layer_lock};
+        auto layer = FindLayer(id);
+        window_size = layer->GetWindow()->Size();
+        old_pos = layer->GetPosition();
+        layer->MoveRelative(pos_diff);
+    }
     Draw({old_pos, window_size});
     Draw(id);
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
+    LockGuard guard{layer_lock};
     if (new_height < 0) {
         Hide(id);
         return;
@@ -153,6 +193,7 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
 }
 
 void LayerManager::Hide(unsigned int id) {
+    LockGuard guard{layer_lock};
     Layer* layer = FindLayer(id);
     auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
     if (pos != layer_stack_.end()) {
@@ -162,6 +203,7 @@ void LayerManager::Hide(unsigned int id) {
 
 Layer* LayerManager::FindLayerByPosition(
     Vector2D<int> pos, unsigned int exclude_id) const {
+    LockGuard guard{layer_lock};
     auto pred = [pos, exclude_id](Layer* layer) {
         if (layer->ID() == exclude_id) {
             return false;
@@ -183,6 +225,7 @@ Layer* LayerManager::FindLayerByPosition(
 }
 
 Layer* LayerManager::FindLayer(unsigned int id) {
+    LockGuard guard{layer_lock};
     const auto pred = [id](const std::unique_ptr<Layer>& elem) -> bool {
         return elem->ID() == id;
     };
@@ -194,6 +237,7 @@ Layer* LayerManager::FindLayer(unsigned int id) {
 }
 
 int LayerManager::GetHeight(unsigned int id) {
+    LockGuard guard{layer_lock};
     for (int h = 0; h < layer_stack_.size(); ++h) {
         if (layer_stack_[h]->ID() == id) {
             return h;
@@ -216,22 +260,30 @@ void ActiveLayer::SetMouseLayer(unsigned int mouse_layer) {
 }
 
 void ActiveLayer::Activate(unsigned int layer_id) {
-    if (active_layer_ == layer_id) {
-        return;
+    unsigned int old_active;
+    {
+        LockGuard guard{layer_lock};
+        if (active_layer_ == layer_id) {
+            return;
+        }
+
+        old_active = active_layer_;
+        if (old_active > 0) {
+            manager_.FindLayer(old_active)->GetWindow()->Deactivate();
+        }
+        active_layer_ = layer_id;
+        if (active_layer_ > 0) {
+            manager_.FindLayer(active_layer_)->GetWindow()->Activate();
+            manager_.UpDown(active_layer_, manager_.GetHeight(mouse_layer_) - 1);
+        }
     }
 
-    if (active_layer_ > 0) {
-        Layer* layer = manager_.FindLayer(active_layer_);
-        layer->GetWindow()->Deactivate();
-        manager_.Draw(active_layer_);
+    // 描画はレイヤーの操作を終えてロックを放してから行う
+    if (old_active > 0) {
+        manager_.Draw(old_active);
     }
-    
-    active_layer_ = layer_id;
-    if (active_layer_ > 0) {
-        Layer* layer = manager_.FindLayer(active_layer_);
-        layer->GetWindow()->Activate();
-        manager_.UpDown(active_layer_, manager_.GetHeight(mouse_layer_) - 1);
-        manager_.Draw(active_layer_);
+    if (layer_id > 0) {
+        manager_.Draw(layer_id);
     }
 }
 ActiveLayer* active_layer;
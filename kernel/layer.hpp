@@ -13,6 +13,14 @@
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "spinlock.hpp"
+
+/** @brief layer_manager, active_layer, layer_task_map, terminals を保護するロック
+ *
+ * LayerManager と ActiveLayer のメソッドは内部でこのロックを取る。
+ * layer_task_map や terminals を直接操作するときは呼び出し側で取ること。
+ */
+extern RecursiveSpinlock layer_lock;
 
 /** Layer は1つの層を表す
  * 将来的には複数のウィンドウを持ち得る
@@ -89,12 +97,29 @@ public:
     Layer* FindLayer(unsigned int id);
     int GetHeight(unsigned int id);
 private:
+    /** @brief 描画するレイヤーの写し。layer_lock を放した後も窓が解放されないよう shared_ptr で持つ。 */
+    struct DrawItem {
+        std::shared_ptr<Window> window;
+        Vector2D<int> pos;
+    };
+
     FrameBuffer* screen_{nullptr};
     mutable FrameBuffer back_buffer_{};
     std::vector<std::unique_ptr<Layer>> layers_{};
     std::vector<Layer*> layer_stack_{};
     unsigned int latest_id_{0};
-
+    // back_buffer_ と画面への書き込みを守る。layer_lock とは別にして，
+    // 合成している間もレイヤーの検索や操作を待たせない。
+    mutable Spinlock draw_lock_;
+
+    /** @brief layer_stack_ の first 番目から上のレイヤーを写す。layer_lock を取って呼ぶ。 */
+    std::vector<DrawItem> SnapshotLocked(size_t first) const;
+    /** @brief 写しを area に合成して画面へ送る。
+     *
+     * layer_lock を取り，割り込みを禁止した状態で呼ぶ。draw_lock_ を取ってから layer_lock を放すので，
+     * 合成の順序は写しを取った順序と一致し，古い写しが新しい描画を上書きすることはない。
+     */
+    void ComposeAndUnlock(const std::vector<DrawItem>& items, const Rectangle<int>& area) const;
 };
 
 extern LayerManager* layer_manager;
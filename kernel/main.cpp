@@ -4,6 +4,7 @@
  * カーネル本体のプログラムを書いたファイル．
  */
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 #include <cstdio>
@@ -37,6 +38,14 @@
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "clock.hpp"
+#include "smp.hpp"
+#include "pmu.hpp"
+#include "idle.hpp"
+#include "block_device.hpp"
+#include "volume_cache.hpp"
+#include "boot_profile.hpp"
+#include "init_step.hpp"
 
 int printk(const char* format, ...) {
     va_list ap;
@@ -118,15 +127,48 @@ void InputTextWindow(char c) {
 
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
+namespace {
+    void* loader_volume_image; // ローダが読み込んだボリューム（無ければ nullptr）
+    // 最初のターミナル。起動するまでは 0。初期化タスクが書き，メインタスクが読む。
+    std::atomic<uint64_t> task_terminal_id{0};
+
+    bool InitializeVolume() {
+        InitializeBlockDevice();
+        void* volume_image = loader_volume_image;
+        if (volume_image == nullptr) {
+            // ローダがボリュームを読み込んでいなければブロックデバイスから必要な分だけ読む
+            if (boot_block_device == nullptr) {
+                Log(kError, "no boot volume\n");
+                return false;
+            }
+            volume_image = MapVolume(*boot_block_device);
+        }
+        fat::Initialize(volume_image);
+        return true;
+    }
+
+    bool InitializeTerminal() {
+        terminals = new std::map<uint64_t, Terminal*>;
+        task_terminal_id = task_manager->NewTask()
+            .InitContext(TaskTerminal, 0)
+            .Wakeup()
+            .ID();
+        return true;
+    }
+}
+
 extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref, 
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table,
-    void* volume_image) {
+    void* volume_image,
+    const BootProfile* boot_profile) {
     MemoryMap memory_map{memory_map_ref};
+    InitializeBootProfile(boot_profile);
 
     InitializeGraphics(frame_buffer_config_ref);
     InitializeConsole();
+    RecordBootPhase("graphics");
 
     printk("Welcome to MikanOS!\n");
     SetLogLevel(kWarn);
@@ -134,20 +176,28 @@ extern "C" void KernelMainNewStack(
     InitializeSegmentation();
     InitializePaging();
     InitializeMemoryManager(memory_map);
+    RecordBootPhase("memory manager");
+    ReserveAPBootPage();
     InitializeTSS();
     InitializeInterrupt();
+    RecordBootPhase("segment/paging/intr");
 
-    fat::Initialize(volume_image);
+    // PCI の探索は MCFG（ECAM の場所）を使うので ACPI を先に読む
+    acpi::Initialize(acpi_table);
+    RecordBootPhase("acpi");
     InitializePCI();
-
+    RecordBootPhase("pci scan");
+    loader_volume_image = volume_image;
 
     InitializeLayer();
     InitializeMainWindow();
     InitializeTextWindow();
     layer_manager->Draw({{0, 0}, ScreenSize()});
+    RecordBootPhase("layers");
 
-    acpi::Initialize(acpi_table);
     InitializeLAPICTimer();
+    RecordBootPhase("lapic timer calib");
+    InitializeClock();
 
     const int kTextboxCursorTimer = 1;
     const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
@@ -155,19 +205,25 @@ extern "C" void KernelMainNewStack(
     bool textbox_cursor_visible= false;
 
     InitializeSyscall();
+    InitializePMU();
+    InitializeIdle();
+    RecordBootPhase("syscall/pmu/idle");
 
     InitializeTask();
     Task& main_task = task_manager->CurrentTask();
-    terminals = new std::map<uint64_t, Terminal*>;
-    const uint64_t task_terminal_id = task_manager->NewTask()
-        .InitContext(TaskTerminal, 0)
-        .Wakeup()
-        .ID();
-
-    usb::xhci::Initialize();
+    InitializeBlockIOTask();
+    RecordBootPhase("tasks");
     InitializeKeyboard();
     InitializeMouse();
-    
+
+    // 残りはデスクトップを表示したまま並行に進める。
+    // xHCI のイベントはメインタスクが処理するので，その初期化もメインタスクで行う。
+    // ボリュームが見つからなければターミナルは起動しないが，デスクトップとマウスは使える
+    const int step_volume = AddInitStep("volume", InitializeVolume, InitContext::kTask);
+    AddInitStep("terminal", InitializeTerminal, InitContext::kTask, {step_volume});
+    AddInitStep("smp", [] { InitializeSMP(); return true; }, InitContext::kTask);
+    AddInitStep("xhci", [] { usb::xhci::Initialize(); return true; }, InitContext::kMainTask);
+    StartInitSteps();
 
     char str[128];
 
@@ -195,6 +251,9 @@ extern "C" void KernelMainNewStack(
         case Message::kInterruptXHCI:
             usb::xhci::ProcessEvents();
             break;
+        case Message::kInitStep:
+            RunInitStep(msg->arg.init_step.id);
+            break;
         case Message::kTimerTimeout:
         if (msg->arg.timer.value == kTextboxCursorTimer) {
             __asm__("cli");
@@ -205,22 +264,22 @@ extern "C" void KernelMainNewStack(
             DrawTextCursor(textbox_cursor_visible);
             layer_manager->Draw(text_window_layer_id);
 
-            __asm__("cli");
-            task_manager->SendMessage(task_terminal_id, *msg);
-            __asm__("sti");
+            if (const uint64_t terminal_id = task_terminal_id.load()) {
+                task_manager->SendMessage(terminal_id, *msg);
+            }
         }
         break;
         case Message::kKeyPush:
             if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
                 InputTextWindow(msg->arg.keyboard.ascii);
             } else {
-                __asm__("cli");
+                layer_lock.Lock();
                 auto task_it = layer_task_map->find(act);
-                __asm__("sti");
-                if (task_it != layer_task_map->end()) {
-                    __asm__("cli");
-                    task_manager->SendMessage(task_it->second, *msg);
-                    __asm__("sti");
+                const bool found = task_it != layer_task_map->end();
+                const uint64_t task_id = found ? task_it->second : 0;
+                layer_lock.Unlock();
+                if (found) {
+                    task_manager->SendMessage(task_id, *msg);
                 } else {
                     printk("key push not handled: keycode %02x, ascii %02x\n",
                            msg->arg.keyboard.keycode,
@@ -230,10 +289,10 @@ extern "C" void KernelMainNewStack(
             break;
         case Message::kLayer:
             ProcessLayerMessage(*msg);
-            __asm__("cli");
             task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-            __asm__("sti");
             break;
+        case Message::kBlockIOCompleted:
+            break; // 待ち終えた後に届いた先読みの完了
         default:
             Log(kError, "Unknown message type: %d\n", msg->type);
         }
@@ -26,14 +26,22 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
         return num_frames;
     };
 
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
     size_t current_start_frame_id = range_begin_.ID();
     while(true) {
         size_t result = countContinuousFreeFrame(current_start_frame_id);
         if (result == num_frames) {
-            MarkAllocated(FrameID{current_start_frame_id}, num_frames);
+            for (size_t i = 0; i < num_frames; ++i) {
+                SetBit(FrameID{current_start_frame_id + i}, true);
+            }
+            lock_.Unlock();
+            RestoreInterrupts(intr);
             return {FrameID{current_start_frame_id}, MAKE_ERROR(Error::kSuccess)};
         }
         if (result == -1) {
+            lock_.Unlock();
+            RestoreInterrupts(intr);
             return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
         }
         //次のフレームから再探索
@@ -42,16 +50,24 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
     for (size_t i = 0; i < num_frames; ++i) {
         SetBit(FrameID{start_frame.ID() + i}, false);
     }
+    lock_.Unlock();
+    RestoreInterrupts(intr);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
     for (size_t i = 0; i < num_frames; ++i) {
         SetBit(FrameID{start_frame.ID() + i}, true);
     }
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
@@ -80,6 +96,7 @@ extern "C" caddr_t program_break, program_break_end;
 
 namespace {
     char memory_manager_buf[sizeof(BitmapMemoryManager)];
+    RecursiveSpinlock malloc_lock;
 
     Error InitializeHeap(BitmapMemoryManager& memory_manager) {
         const int kHeapFrames = 64 * 512;
@@ -133,4 +150,13 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
             err.Name(), err.File(), err.Line());
         exit(1);
     }
-}
\ No newline at end of file
+}
+
+// newlib の malloc/free は内部でこれらを呼んでヒープを保護する
+extern "C" void __malloc_lock(struct _reent*) {
+    malloc_lock.Lock();
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+    malloc_lock.Unlock();
+}
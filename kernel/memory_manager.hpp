@@ -11,6 +11,7 @@
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace {
     constexpr unsigned long long operator""_KiB(unsigned long long kib) {
@@ -76,6 +77,7 @@ private:
     std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
     FrameID range_begin_;
     FrameID range_end_;
+    Spinlock lock_; // 複数の CPU から同時に割り当てを行うためのロック
 
     bool GetBit(FrameID frame) const;
     void SetBit(FrameID frame, bool allocated);
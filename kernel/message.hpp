@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 enum class LayerOperation {
   Move, MoveRelative, Draw, DrawArea
 };
@@ -12,6 +14,10 @@ struct Message {
     kLayer,
     kLayerFinish,
     kMouseMove,
+    kTaskExited,
+    kBlockIOKick,
+    kBlockIOCompleted,
+    kInitStep,
   } type;
 
   uint64_t src_task;
@@ -41,5 +47,14 @@ struct Message {
       uint8_t buttons;
     } mouse_move;
 
+    struct {
+      uint64_t tag;
+      uint64_t errors; // 失敗した要求の数
+    } block_io;
+
+    struct {
+      int id;
+    } init_step;
+
   } arg;
 };
@@ -0,0 +1,168 @@
+#include "message_queue.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+#include "interrupt.hpp"
+
+namespace {
+    bool IsCoalescable(const Message& msg) {
+        if (msg.type == Message::kMouseMove) {
+            return true;
+        }
+        return msg.type == Message::kLayer &&
+            (msg.arg.layer.op == LayerOperation::Draw ||
+             msg.arg.layer.op == LayerOperation::DrawArea);
+    }
+}
+
+bool Coalesce(Message& queued, const Message& msg) {
+    if (queued.type != msg.type || queued.src_task != msg.src_task) {
+        return false;
+    }
+
+    if (msg.type == Message::kMouseMove) {
+        auto& q = queued.arg.mouse_move;
+        const auto& m = msg.arg.mouse_move;
+        if (q.buttons != m.buttons) {
+            return false;
+        }
+        q.x = m.x;
+        q.y = m.y;
+        q.dx += m.dx;
+        q.dy += m.dy;
+        return true;
+    }
+
+    if (msg.type == Message::kLayer && IsCoalescable(queued) && IsCoalescable(msg)) {
+        auto& q = queued.arg.layer;
+        const auto& m = msg.arg.layer;
+        if (q.layer_id != m.layer_id) {
+            return false;
+        }
+        if (q.op == LayerOperation::Draw || m.op == LayerOperation::Draw) {
+            q.op = LayerOperation::Draw;
+            return true;
+        }
+        const int x0 = std::min(q.x, m.x), y0 = std::min(q.y, m.y);
+        const int x1 = std::max(q.x + q.w, m.x + m.w);
+        const int y1 = std::max(q.y + q.h, m.y + m.h);
+        q.x = x0;
+        q.y = y0;
+        q.w = x1 - x0;
+        q.h = y1 - y0;
+        return true;
+    }
+
+    return false;
+}
+
+MessageQueue::MessageQueue() {
+    // operator new は 16 バイト境界までしか揃えないので，キャッシュライン境界へは自前で揃える
+    size_t space = sizeof(Ring) + kCacheLineBytes;
+    storage_ = new uint8_t[space];
+    void* p = storage_;
+    ring_ = new(std::align(alignof(Ring), sizeof(Ring), p, space)) Ring;
+
+    ring_->tail.store(0, std::memory_order_relaxed);
+    ring_->overflows.store(0, std::memory_order_relaxed);
+    ring_->coalesced.store(0, std::memory_order_relaxed);
+    ring_->head = 0;
+    for (size_t i = 0; i < kCapacity; ++i) {
+        ring_->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+MessageQueue::~MessageQueue() {
+    ring_->~Ring();
+    delete[] storage_;
+}
+
+bool MessageQueue::Push(const Message& msg) {
+    if (IsCoalescable(msg) && TryCoalesce(msg)) {
+        ring_->coalesced.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t pos = ring_->tail.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &ring_->cells[pos & (kCapacity - 1)];
+        const uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        const int64_t diff = static_cast<int64_t>(seq - pos);
+        if (diff == 0) {
+            if (ring_->tail.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 受信者がまだ読んでいないセルに一周して追いついた
+            ring_->overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = ring_->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->msg = msg;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool MessageQueue::TryCoalesce(const Message& msg) {
+    // 合体中は割り込みを禁止し，受信者を待たせる時間を数命令に抑える
+    const bool intr = DisableInterrupts();
+
+    bool merged = false;
+    const uint64_t pos = ring_->tail.load(std::memory_order_acquire);
+    if (pos > 0) {
+        const uint64_t last = pos - 1;
+        Cell& cell = ring_->cells[last & (kCapacity - 1)];
+        uint64_t expected = last + 1;
+        // 末尾のセルが書き込み済みかつ未読のときだけ，セルを占有して書き換える
+        if (cell.seq.compare_exchange_strong(expected, (last + 1) | kBusy,
+                                             std::memory_order_acquire)) {
+            if (ring_->tail.load(std::memory_order_relaxed) == pos) {
+                merged = Coalesce(cell.msg, msg);
+            }
+            cell.seq.store(last + 1, std::memory_order_release);
+        }
+    }
+
+    RestoreInterrupts(intr);
+    return merged;
+}
+
+std::optional<Message> MessageQueue::Pop() {
+    const uint64_t pos = ring_->head;
+    Cell& cell = ring_->cells[pos & (kCapacity - 1)];
+    uint64_t expected = pos + 1;
+    // 合体中の送信者と競合しないよう，セルを占有してから読み出す
+    while (!cell.seq.compare_exchange_weak(expected, (pos + 1) | kBusy,
+                                           std::memory_order_acquire)) {
+        if ((expected & ~kBusy) != pos + 1) {
+            return std::nullopt;
+        }
+        expected = pos + 1;
+    }
+
+    Message msg = cell.msg;
+    cell.seq.store(pos + kCapacity, std::memory_order_release);
+    ring_->head = pos + 1;
+    return msg;
+}
+
+bool MessageQueue::Empty() const {
+    const uint64_t pos = ring_->head;
+    const Cell& cell = ring_->cells[pos & (kCapacity - 1)];
+    return (cell.seq.load(std::memory_order_acquire) & ~kBusy) != pos + 1;
+}
+
+uint64_t MessageQueue::Overflows() const {
+    return ring_->overflows.load(std::memory_order_relaxed);
+}
+
+uint64_t MessageQueue::Coalesced() const {
+    return ring_->coalesced.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file message_queue.hpp
+ *
+ * タスクごとのメッセージキューを提供する。
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "message.hpp"
+
+/** @brief 固定長のロックフリーなメッセージリングバッファ
+ *
+ * 送信側（Push）は割り込みハンドラを含む複数の文脈から同時に呼び出してよい。
+ * 受信側（Pop）はキューを持つタスク 1 つだけが呼び出す前提である。
+ * Push はメモリ確保もロックも行わないため，割り込みハンドラから安全に呼び出せる。
+ * ただし合体（TryCoalesce）の間だけは，受信者を待たせないよう数命令の間割り込みを禁止する。
+ * キューが満杯のときはメッセージを捨て，捨てた数を Overflows() で数える。
+ *
+ * マウス移動やレイヤー再描画のように頻度の高いメッセージは，末尾の未読メッセージと
+ * 合体できる場合は新しいセルを使わずに末尾を書き換える（Coalesce を参照）。
+ */
+class MessageQueue {
+public:
+    /// @brief キューに格納できるメッセージの数（2 のべき乗）
+    static const size_t kCapacity = 128;
+    static const size_t kCacheLineBytes = 64;
+
+    MessageQueue();
+    ~MessageQueue();
+    MessageQueue(const MessageQueue&) = delete;
+    MessageQueue& operator=(const MessageQueue&) = delete;
+
+    /// @brief メッセージを末尾に追加する。満杯なら false を返す。
+    bool Push(const Message& msg);
+    /// @brief 先頭のメッセージを取り出す。空なら std::nullopt を返す。
+    std::optional<Message> Pop();
+    /// @brief 取り出せるメッセージが無ければ true を返す。
+    bool Empty() const;
+    /// @brief 満杯のために捨てたメッセージの累計
+    uint64_t Overflows() const;
+    /// @brief 末尾のメッセージと合体させたメッセージの累計
+    uint64_t Coalesced() const;
+
+private:
+    static_assert((kCapacity & (kCapacity - 1)) == 0);
+
+    /** seq は次の状態を表す（pos はセルに対応する通し番号）
+     *   seq == pos               : 空き。pos 番目の送信者が書き込める。
+     *   seq == pos + 1           : 書き込み済み。受信者が読み出せる。
+     *   seq == (pos + 1) | kBusy : 受信者が読み出し中，または送信者が合体中。
+     */
+    static const uint64_t kBusy = 1ull << 63;
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        Message msg;
+    };
+
+    /** 送信者が更新する tail_ と受信者が更新する head_ を別のキャッシュラインに置く */
+    struct Ring {
+        alignas(kCacheLineBytes) std::atomic<uint64_t> tail;
+        std::atomic<uint64_t> overflows;
+        std::atomic<uint64_t> coalesced;
+        alignas(kCacheLineBytes) uint64_t head;
+        alignas(kCacheLineBytes) std::array<Cell, kCapacity> cells;
+    };
+
+    uint8_t* storage_;
+    Ring* ring_;
+
+    bool TryCoalesce(const Message& msg);
+};
+
+/** @brief 2 つのメッセージを 1 つにまとめられるなら queued を書き換えて true を返す。
+ *
+ * - 連続するマウス移動（ボタン状態が同じもの）は移動量を足し合わせ，座標は新しい方を使う。
+ * - 同じタスクから同じレイヤーへの再描画要求は，描画範囲を包含する矩形にまとめる。
+ */
+bool Coalesce(Message& queued, const Message& msg);
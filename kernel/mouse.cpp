@@ -51,6 +51,7 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
 
 void SendMouseMessage(Vector2D<int> newpos, Vector2D<int> posdiff, 
                       uint8_t buttons) {
+    LockGuard guard{layer_lock};
     const auto act = active_layer->GetActive();
     if (!act) {
       return;
@@ -6,3 +6,8 @@ static constexpr uint32_t kIA32_EFER  = 0xc0000080;
 static constexpr uint32_t kIA32_STAR  = 0xc0000081;
 static constexpr uint32_t kIA32_LSTAR = 0xc0000082;
 static constexpr uint32_t kIA32_FMASK = 0xc0000084;
+
+// アーキテクチャ定義の性能モニタリングカウンタ（汎用カウンタ i は +i）
+static constexpr uint32_t kIA32_PMC0             = 0x0c1;
+static constexpr uint32_t kIA32_PERFEVTSEL0      = 0x186;
+static constexpr uint32_t kIA32_PERF_GLOBAL_CTRL = 0x38f;
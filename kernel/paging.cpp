@@ -1,8 +1,10 @@
 #include "paging.hpp"
 
 #include <array>
+#include <cstring>
 
 #include "asmfunc.h"
+#include "memory_manager.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
@@ -30,3 +32,193 @@ void SetupIdentityPageTable() {
 void InitializePaging() {
   SetupIdentityPageTable();
 }
+
+namespace {
+  static_assert(kBytesPerFrame >= 4096);
+
+  WithError<PageMapEntry*> NewPageMap() {
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return {nullptr, frame.error};
+    }
+
+    auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
+    memset(e, 0, sizeof(uint64_t) * 512);
+    return {e, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+    if (entry.bits.present) {
+      return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
+    }
+
+    auto [child_map, err] = NewPageMap();
+    if (err) {
+      return {nullptr, err};
+    }
+
+    entry.SetPointer(child_map);
+    entry.bits.present = 1;
+
+    return {child_map, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<size_t> SetupPageMap(
+      PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages) {
+    while (num_4kpages > 0) {
+      const auto entry_index = addr.Part(page_map_level);
+
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
+      if (err) {
+        return {num_4kpages, err};
+      }
+      page_map[entry_index].bits.writable = 1;
+      page_map[entry_index].bits.user = 1;
+
+      if (page_map_level == 1) {
+        --num_4kpages;
+      } else {
+        auto [ num_remain_pages, err ] =
+          SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages);
+        if (err) {
+          return {num_4kpages, err};
+        }
+        num_4kpages = num_remain_pages;
+      }
+
+      if (entry_index == 511) {
+        break;
+      }
+
+      addr.SetPart(page_map_level, entry_index + 1);
+      for (int level = page_map_level - 1; level >= 1; --level) {
+        addr.SetPart(level, 0);
+      }
+    }
+
+    return { num_4kpages, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  Error CleanPageMap(PageMapEntry* page_map, int page_map_level) {
+    for (int i = 0; i < 512; ++i) {
+      auto entry = page_map[i];
+      if (!entry.bits.present) {
+        continue;
+      }
+      if (page_map_level > 1) {
+        if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1)) {
+          return err;
+        }
+      }
+
+      const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+      const FrameID map_frame{entry_addr / kBytesPerFrame};
+      if (auto err = memory_manager->Free(map_frame, 1)) {
+        return err;
+      }
+      page_map[i].data = 0;
+    }
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
+
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages) {
+  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  return SetupPageMap(pml4_table, 4, addr, num_4kpages).error;
+}
+
+Error CleanPageMaps(LinearAddress4Level addr) {
+  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  if (!pml4_table[addr.parts.pml4].bits.present) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto pdp_table = pml4_table[addr.parts.pml4].Pointer();
+  pml4_table[addr.parts.pml4].data = 0;
+  if (auto err = CleanPageMap(pdp_table, 3)) {
+    return err;
+  }
+
+  const auto pdp_addr = reinterpret_cast<uintptr_t>(pdp_table);
+  const FrameID pdp_frame{pdp_addr / kBytesPerFrame};
+  return memory_manager->Free(pdp_frame, 1);
+}
+
+Error MapUserPageReadOnly(LinearAddress4Level addr, uintptr_t phys_addr) {
+  auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+  for (int level = 4; level > 1; --level) {
+    auto& entry = page_map[addr.Part(level)];
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return err;
+    }
+    entry.bits.writable = 1;
+    entry.bits.user = 1;
+    page_map = child_map;
+  }
+
+  auto& entry = page_map[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(phys_addr));
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapUserPages(LinearAddress4Level addr, size_t num_4kpages, bool (*owned)(uintptr_t)) {
+  for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K) {
+    auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+    for (int level = 4; level > 1 && page_map; --level) {
+      const auto& entry = page_map[addr.Part(level)];
+      page_map = entry.bits.present ? entry.Pointer() : nullptr;
+    }
+    if (page_map == nullptr || !page_map[addr.Part(1)].bits.present) {
+      continue;
+    }
+
+    auto& entry = page_map[addr.Part(1)];
+    const auto phys = reinterpret_cast<uintptr_t>(entry.Pointer());
+    entry.data = 0;
+    if (owned(phys)) {
+      if (auto err = memory_manager->Free(FrameID{phys / kBytesPerFrame}, 1)) {
+        return err;
+      }
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapKernelPages(LinearAddress4Level addr, uintptr_t phys_addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+    for (int level = 4; level > 1; --level) {
+      auto& entry = page_map[addr.Part(level)];
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+      if (err) {
+        return err;
+      }
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+
+    auto& entry = page_map[addr.Part(1)];
+    entry.data = 0;
+    entry.SetPointer(reinterpret_cast<PageMapEntry*>(phys_addr + i * kPageSize4K));
+    entry.bits.present = 1;
+    entry.bits.writable = 1;
+    addr.value += kPageSize4K;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+PageMapEntry* FindPageMapEntry(LinearAddress4Level addr) {
+  auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+  for (int level = 4; level > 1; --level) {
+    const auto& entry = page_map[addr.Part(level)];
+    if (!entry.bits.present || entry.bits.huge_page) {
+      return nullptr;
+    }
+    page_map = entry.Pointer();
+  }
+  return &page_map[addr.Part(1)];
+}
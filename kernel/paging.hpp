@@ -9,6 +9,8 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "error.hpp"
+
 /** @brief 静的に確保するページディレクトリの個数
  *
  * この定数は SetupIdentityPageMap で使用される．
@@ -86,3 +88,39 @@ union PageMapEntry {
   }
 };
 
+/** @brief 指定された仮想アドレスから num_4kpages 個のページをユーザー空間に確保する．
+ *
+ * 必要な階層ページング構造と物理フレームは memory_manager から割り当てる．
+ */
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages);
+
+/** @brief addr を含む PML4 エントリ配下のページング構造と物理フレームをすべて解放する．
+ *
+ * エントリが存在しなければ何もしない．
+ */
+Error CleanPageMaps(LinearAddress4Level addr);
+
+/** @brief 既存の物理フレームを指定された仮想アドレスにユーザー読み込み専用でマップする．
+ *
+ * 中間のページング構造は必要に応じて割り当てる．phys_addr のフレームは解放されない．
+ */
+Error MapUserPageReadOnly(LinearAddress4Level addr, uintptr_t phys_addr);
+
+/** @brief 指定された仮想アドレスから num_4kpages 個のページのマップを外す．
+ *
+ * owned(物理アドレス) が true を返すフレームは memory_manager へ返す．
+ * 中間のページング構造は解放しない（CleanPageMaps で解放する）．
+ */
+Error UnmapUserPages(LinearAddress4Level addr, size_t num_4kpages, bool (*owned)(uintptr_t));
+
+/** @brief 連続する物理フレームを指定された仮想アドレスからカーネル専用（読み書き可）でマップする．
+ *
+ * 中間のページング構造は必要に応じて割り当てる．phys_addr のフレームは解放されない．
+ */
+Error MapKernelPages(LinearAddress4Level addr, uintptr_t phys_addr, size_t num_4kpages);
+
+/** @brief addr を写している 4KiB ページのエントリを返す．
+ *
+ * 途中のページング構造が無ければ nullptr を返す（エントリ自体は present でなくてもよい）．
+ */
+PageMapEntry* FindPageMapEntry(LinearAddress4Level addr);
@@ -6,8 +6,14 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+#include <map>
+
+#include "acpi.hpp"
 #include "asmfunc.h"
 #include "logger.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
 
 namespace {
     using namespace pci;
@@ -22,15 +28,67 @@ namespace {
                 | shl(function, 8) | (reg_addr & 0xfcu);
     }
 
+    // ECAM の設定。ecam_base が 0 なら CONFIG_ADDRESS/CONFIG_DATA のポート I/O を使う。
+    uintptr_t ecam_base;
+    uint8_t ecam_start_bus, ecam_end_bus;
+
+    // CONFIG_ADDRESS に書いてから CONFIG_DATA を読み書きするまでの間を守る。
+    // 起動時のステップが別々のタスクで並行にデバイスを初期化するため。
+    Spinlock config_port_lock;
+
+    /** @brief ECAM 上のレジスタのアドレス。ECAM で扱えないバスなら nullptr */
+    volatile uint32_t* ECAMRegister(uint8_t bus, uint8_t device,
+                                    uint8_t function, uint8_t reg_addr) {
+        if (ecam_base == 0 || bus < ecam_start_bus || bus > ecam_end_bus) {
+            return nullptr;
+        }
+        // 1 ファンクションあたり 4 KiB が，バス，デバイス，ファンクションの順に並ぶ
+        return reinterpret_cast<volatile uint32_t*>(
+            ecam_base + (static_cast<uintptr_t>(bus) << 20 | device << 15 |
+                         function << 12 | (reg_addr & 0xfcu)));
+    }
+
+    /** @brief コンフィグレーション空間の 32 ビットを読む。ECAM なら 1 回のメモリアクセスで済む。 */
+    uint32_t ReadConfig(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg_addr) {
+        if (auto reg = ECAMRegister(bus, device, function, reg_addr)) {
+            return *reg;
+        }
+        const bool intr = DisableInterrupts();
+        config_port_lock.Lock();
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        const uint32_t value = ReadData();
+        config_port_lock.Unlock();
+        RestoreInterrupts(intr);
+        return value;
+    }
+
+    void WriteConfig(uint8_t bus, uint8_t device, uint8_t function,
+                     uint8_t reg_addr, uint32_t value) {
+        if (auto reg = ECAMRegister(bus, device, function, reg_addr)) {
+            *reg = value;
+            return;
+        }
+        const bool intr = DisableInterrupts();
+        config_port_lock.Lock();
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        WriteData(value);
+        config_port_lock.Unlock();
+        RestoreInterrupts(intr);
+    }
+
+    // devices の添字の索引。ScanAllBus で作る。
+    std::map<uint16_t, std::vector<size_t>> vendor_index;
+    std::map<uint32_t, std::vector<size_t>> class_index;
+
+    uint32_t ClassKey(uint8_t base, uint8_t sub, uint8_t interface) {
+        return static_cast<uint32_t>(base) << 16 | sub << 8 | interface;
+    }
+
     /**
-     * devices[num_device] に情報を書き込み nub_device をインクリメントする
+     * devices の末尾にデバイスを追加する
     */
     Error AddDevice(const Device& device) {
-        if (num_device ==  devices.size()) {
-            return MAKE_ERROR(Error::kFull);
-        }
-        devices[num_device] = device;
-        ++num_device;
+        devices.push_back(device);
         return MAKE_ERROR(Error::kSuccess);
     }
 
@@ -42,7 +100,9 @@ namespace {
     Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function) {
         auto class_code = ReadClassCode(bus, device, function);
         auto header_type = ReadHeaderType(bus, device, function);
-        Device dev{bus, device, function, header_type, class_code};
+        const uint32_t id = ReadConfig(bus, device, function, 0x00);
+        Device dev{bus, device, function, header_type, class_code,
+                   static_cast<uint16_t>(id & 0xffffu), static_cast<uint16_t>(id >> 16)};
         if (auto err = AddDevice(dev)) {
             return err;
         }
@@ -168,11 +228,38 @@ namespace {
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /** @brief 指定された MSI レジスタを設定する */
+    /** @brief 指定された MSI-X レジスタとテーブルを設定する */
     Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
                                 uint32_t msg_addr, uint32_t msg_data,
                                 unsigned int num_vector_exponent) {
-        return MAKE_ERROR(Error::kNotImplemented);
+        // ヘッダのビット 26:16 がテーブルのエントリ数 - 1，次の DWORD が BIR とオフセット
+        auto header = ReadConfReg(dev, cap_addr);
+        const uint32_t table = ReadConfReg(dev, cap_addr + 4);
+        Device bar_dev = dev;
+        auto [ bar, err ] = ReadBar(bar_dev, table & 0x7u);
+        if (err) {
+            return err;
+        }
+        if (bar & 1) { // テーブルはメモリ空間に置かれる
+            return MAKE_ERROR(Error::kUnknownDevice);
+        }
+
+        const unsigned int table_size = ((header >> 16) & 0x7ffu) + 1;
+        const unsigned int num_vectors = std::min(table_size, 1u << num_vector_exponent);
+        auto entries = reinterpret_cast<volatile uint32_t*>(
+            (bar & ~static_cast<uint64_t>(0xf)) + (table & ~0x7u));
+        for (unsigned int i = 0; i < num_vectors; ++i) {
+            // エントリは Message Address（下位，上位），Message Data，Vector Control
+            entries[4 * i + 0] = msg_addr;
+            entries[4 * i + 1] = 0;
+            entries[4 * i + 2] = msg_data;
+            entries[4 * i + 3] = 0; // マスクを外す
+        }
+
+        // ビット 31 が MSI-X Enable，ビット 30 が Function Mask
+        header = (header | (1u << 31)) & ~(1u << 30);
+        WriteConfReg(dev, cap_addr, header);
+        return MAKE_ERROR(Error::kSuccess);
     }
 }
 
@@ -190,23 +277,19 @@ namespace pci {
     }
 
     uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() & 0xffffu;
+        return ReadConfig(bus, device, function, 0x00) & 0xffffu;
     }
 
     uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() >> 16;
+        return ReadConfig(bus, device, function, 0x00) >> 16;
     }
 
     uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x0c));
-        return (ReadData() >> 16) & 0xffu;
+        return (ReadConfig(bus, device, function, 0x0c) >> 16) & 0xffu;
     }
 
     ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x08));
-        auto reg = ReadData();
+        auto reg = ReadConfig(bus, device, function, 0x08);
         ClassCode cc;
         cc.base       = (reg >> 24) & 0xffu;
         cc.sub        = (reg >> 16) & 0xffu;
@@ -215,8 +298,7 @@ namespace pci {
     }
 
     uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x18));
-        return ReadData();
+        return ReadConfig(bus, device, function, 0x18);
     }
     
     bool IsSingleFunctionDevice(uint8_t header_type) {
@@ -224,31 +306,62 @@ namespace pci {
     }
 
     Error ScanAllBus() {
-        num_device = 0;
+        devices.clear();
+        vendor_index.clear();
+        class_index.clear();
+
+        Error err = MAKE_ERROR(Error::kSuccess);
         auto header_type = ReadHeaderType(0, 0, 0);
         if (IsSingleFunctionDevice(header_type)) {
-            return ScanBus(0);
+            err = ScanBus(0);
+        } else {
+            for (uint8_t function = 0; function < 8 && !err; ++function) {
+                if (ReadVendorId(0, 0, function) == 0xffffu) {
+                    continue;
+                }
+                err = ScanBus(function);
+            }
         }
 
-        for (uint8_t function = 0; function < 8; ++function) {
-            if (ReadVendorId(0, 0, function) == 0xffffu) {
-                continue;
+        for (size_t i = 0; i < devices.size(); ++i) {
+            const auto& dev = devices[i];
+            vendor_index[dev.vendor_id].push_back(i);
+            class_index[ClassKey(dev.class_code.base, dev.class_code.sub,
+                                 dev.class_code.interface)].push_back(i);
+        }
+        return err;
+    }
+
+    std::vector<Device*> FindDevicesByVendor(uint16_t vendor_id) {
+        std::vector<Device*> result;
+        if (auto it = vendor_index.find(vendor_id); it != vendor_index.end()) {
+            for (size_t i : it->second) {
+                result.push_back(&devices[i]);
             }
-            if (auto err = ScanBus(function)) {
-                return err;
+        }
+        return result;
+    }
+
+    std::vector<Device*> FindDevicesByClass(uint8_t base, uint8_t sub, uint8_t interface) {
+        std::vector<Device*> result;
+        if (auto it = class_index.find(ClassKey(base, sub, interface)); it != class_index.end()) {
+            for (size_t i : it->second) {
+                result.push_back(&devices[i]);
             }
         }
-        return MAKE_ERROR(Error::kSuccess);
+        return result;
+    }
+
+    bool ECAMEnabled() {
+        return ecam_base != 0;
     }
 
     uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        return ReadData();
+        return ReadConfig(dev.bus, dev.device, dev.function, reg_addr);
     }
 
     void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        WriteData(value);
+        WriteConfig(dev.bus, dev.device, dev.function, reg_addr, value);
     }
 
     WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
@@ -318,17 +431,34 @@ namespace pci {
 }
 
 void InitializePCI() {
+    // セグメント 0 の ECAM があればそれを使う（このカーネルはセグメント 0 だけを扱う）
+    if (acpi::mcfg) {
+        for (size_t i = 0; i < acpi::mcfg->Count(); ++i) {
+            const auto& entry = (*acpi::mcfg)[i];
+            // カーネルが恒等写像している範囲に無ければポート I/O のままにする
+            const uint64_t ecam_end = entry.base_address + ((entry.end_bus + 1ul) << 20);
+            if (entry.segment == 0 && entry.base_address != 0 &&
+                ecam_end <= kPageDirectoryCount * 1024 * 1024 * 1024) {
+                ecam_base = entry.base_address;
+                ecam_start_bus = entry.start_bus;
+                ecam_end_bus = entry.end_bus;
+                Log(kInfo, "PCI ECAM at 0x%lx, bus %u-%u\n",
+                    ecam_base, ecam_start_bus, ecam_end_bus);
+                break;
+            }
+        }
+    }
+
     if (auto err = pci::ScanAllBus()) {
         Log(kError, "ScanAllBus: %s\n", err.Name());
         exit(1);
     }
 
-    for (int i = 0; i < pci::num_device; ++i) {
-        const auto& dev = pci::devices[i];
-        auto vendor_id = pci::ReadVendorId(dev);
-        auto class_code = pci::ReadClassCode(dev.bus, dev.device, dev.function);
-        Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
-            dev.bus, dev.device, dev.function,
-            vendor_id, class_code, dev.header_type);
+    for (const auto& dev : pci::devices) {
+        Log(kDebug, "%d.%d.%d: vend %04x, class %02x%02x%02x, head %02x\n",
+            dev.bus, dev.device, dev.function, dev.vendor_id,
+            dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+            dev.header_type);
     }
+    Log(kInfo, "%lu PCI functions found\n", pci::devices.size());
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
 #include "error.hpp"
 
 namespace pci {
@@ -37,6 +38,7 @@ namespace pci {
     struct Device {
         uint8_t bus, device, function, header_type;
         ClassCode class_code;
+        uint16_t vendor_id, device_id; // 探索時に読んだ値
     };
 
     /// CONFIG_ADDRESS　に指定された整数を書き込む
@@ -76,18 +78,23 @@ namespace pci {
     bool IsSingleFunctionDevice(uint8_t header_type);
 
     /** ScanAllBus() により発見された PCI デバイスの一覧 */
-    inline std::array<Device, 32> devices;
-    
-    /** devices の有効な要素の数 */
-    inline int num_device;
+    inline std::vector<Device> devices;
 
     /** PCI デバイスをすべて探索し devices に格納する
      *
-     * バス 0 から再帰的に PCI デバイスを探索し，devices の先頭から詰めて書き込む．
-     * 発見したデバイスの数を num_devices に設定する．
+     * バス 0 から再帰的に PCI デバイスを探索し，見つけた順に devices へ追加する．
+     * ベンダ ID とクラスコードの索引も作り直す．
      */
     Error ScanAllBus();
 
+    /** @brief ベンダ ID が vendor_id のデバイスを見つけた順に返す */
+    std::vector<Device*> FindDevicesByVendor(uint16_t vendor_id);
+    /** @brief クラスコードが一致するデバイスを見つけた順に返す */
+    std::vector<Device*> FindDevicesByClass(uint8_t base, uint8_t sub, uint8_t interface);
+
+    /** @brief ECAM でコンフィグレーション空間にアクセスしているなら真 */
+    bool ECAMEnabled();
+
     constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
         return 0x10 + 4 * bar_index;
     }
@@ -171,4 +178,8 @@ namespace pci {
         uint8_t vector, unsigned int num_vector_exponent);
 }
 
+/** @brief ACPI の MCFG があれば ECAM を有効にし，すべてのバスを探索する。
+ *
+ * acpi::Initialize の後に呼び出すこと。
+ */
 void InitializePCI();
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief 計測できるイベント。SyscallPerfCounters ではビット (1 << イベント) の集合で指定する。 */
+enum PerfEvent {
+  kPerfCycles,       // コアクロックサイクル
+  kPerfInstructions, // リタイアした命令数
+  kPerfCacheMisses,  // 最終レベルキャッシュのミス
+  kPerfBranchMisses, // 分岐予測ミス
+  kPerfNumEvents,
+};
+
+enum PerfOp {
+  kPerfStart, // 計数値を 0 にして指定したイベントの計測を始める
+  kPerfStop,  // 計測を止め，計数値を返す
+  kPerfRead,  // 計測を続けたまま現在の計数値を返す
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,134 @@
+#include "pmu.hpp"
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "msr.hpp"
+#include "task.hpp"
+
+namespace {
+    struct EventSpec {
+        uint8_t event, umask;
+        int cpuid_bit; // CPUID.0AH:EBX でこのイベントが使えないことを示すビット
+    };
+
+    // Intel SDM Vol.3 "Architectural Performance Monitoring" の事前定義イベント
+    const std::array<EventSpec, kPerfNumEvents> kEventSpecs{{
+        {0x3c, 0x00, 0}, // UnHalted Core Cycles
+        {0xc0, 0x00, 1}, // Instructions Retired
+        {0x2e, 0x41, 4}, // LLC Misses
+        {0xc5, 0x00, 6}, // Branch Misses Retired
+    }};
+
+    const uint64_t kEvtSelUser   = 1u << 16;
+    const uint64_t kEvtSelOS     = 1u << 17;
+    const uint64_t kEvtSelEnable = 1u << 22;
+
+    uint32_t supported_events = 0;
+    uint32_t pmu_version = 0;
+    uint64_t counter_mask = 0; // 汎用カウンタの有効ビット
+
+    void StartCounters(uint32_t events) {
+        for (int i = 0; i < kPerfNumEvents; ++i) {
+            if (events & (1u << i)) {
+                const auto& spec = kEventSpecs[i];
+                WriteMSR(kIA32_PMC0 + i, 0);
+                WriteMSR(kIA32_PERFEVTSEL0 + i,
+                         spec.event | spec.umask << 8 |
+                         kEvtSelUser | kEvtSelOS | kEvtSelEnable);
+            }
+        }
+    }
+
+    /** @brief 計数値を counts に足し込む。stop なら同時にカウンタを止める。 */
+    void AccumulateCounters(uint32_t events, std::array<uint64_t, kPerfNumEvents>& counts,
+                            bool stop) {
+        for (int i = 0; i < kPerfNumEvents; ++i) {
+            if (events & (1u << i)) {
+                if (stop) {
+                    WriteMSR(kIA32_PERFEVTSEL0 + i, 0);
+                }
+                counts[i] += ReadMSR(kIA32_PMC0 + i) & counter_mask;
+            }
+        }
+    }
+}
+
+void InitializePMU() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0xa) {
+        return;
+    }
+    CPUID(0xa, 0, &eax, &ebx, &ecx, &edx);
+    pmu_version = eax & 0xff;
+    const int num_counters = (eax >> 8) & 0xff;
+    const int counter_width = (eax >> 16) & 0xff;
+    const int ebx_length = (eax >> 24) & 0xff;
+    if (pmu_version == 0 || num_counters == 0) {
+        return;
+    }
+    counter_mask = counter_width >= 64 ? ~0ul : (1ul << counter_width) - 1;
+
+    uint32_t events = 0;
+    for (int i = 0; i < kPerfNumEvents && i < num_counters; ++i) {
+        const int bit = kEventSpecs[i].cpuid_bit;
+        if (bit < ebx_length && (ebx & (1u << bit)) == 0) {
+            events |= 1u << i;
+        }
+    }
+    supported_events = events;
+
+    for (int i = 0; i < kPerfNumEvents && i < num_counters; ++i) {
+        WriteMSR(kIA32_PERFEVTSEL0 + i, 0);
+    }
+    // バージョン 2 以降は全体の有効ビットも立てないと数えない
+    if (pmu_version >= 2) {
+        WriteMSR(kIA32_PERF_GLOBAL_CTRL, (1ul << num_counters) - 1);
+    }
+    Log(kDebug, "PMU version %u, %d counters, events 0x%x\n",
+        pmu_version, num_counters, supported_events);
+}
+
+uint32_t PMUSupportedEvents() {
+    return supported_events;
+}
+
+void PMUSwitch(PMUState& prev, PMUState& next) {
+    if (prev.events) {
+        AccumulateCounters(prev.events, prev.counts, true);
+    }
+    if (next.events) {
+        StartCounters(next.events);
+    }
+}
+
+uint32_t StartTaskCounters(uint32_t events) {
+    const bool intr = DisableInterrupts();
+    auto& state = task_manager->CurrentTask().PMU();
+    if (state.events) {
+        AccumulateCounters(state.events, state.counts, true);
+    }
+    state.events = events & supported_events;
+    state.counts = {};
+    StartCounters(state.events);
+    RestoreInterrupts(intr);
+    return state.events;
+}
+
+void StopTaskCounters(std::array<uint64_t, kPerfNumEvents>& counts) {
+    const bool intr = DisableInterrupts();
+    auto& state = task_manager->CurrentTask().PMU();
+    AccumulateCounters(state.events, state.counts, true);
+    state.events = 0;
+    counts = state.counts;
+    RestoreInterrupts(intr);
+}
+
+void ReadTaskCounters(std::array<uint64_t, kPerfNumEvents>& counts) {
+    const bool intr = DisableInterrupts();
+    const auto& state = task_manager->CurrentTask().PMU();
+    counts = state.counts;
+    AccumulateCounters(state.events, counts, false);
+    RestoreInterrupts(intr);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file pmu.hpp
+ *
+ * CPU の性能モニタリングカウンタ（PMU）をタスクごとに使うためのプログラムを集めたファイル。
+ *
+ * CPUID リーフ 0xA で報告されるアーキテクチャ定義のイベントを汎用カウンタで数える。
+ * PerfEvent i は汎用カウンタ i に固定で割り当てる。
+ * カウンタは CPU に 1 組しかないので，タスク切り替えのたびに
+ * 前のタスクの値を読み出して足し込み，次のタスクのために 0 から数え直す。
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "perf_event.hpp"
+
+/** @brief タスクごとの計測状態 */
+struct PMUState {
+    uint32_t events{0}; // 計測中のイベントの集合（ビット i = PerfEvent i）
+    std::array<uint64_t, kPerfNumEvents> counts{};
+};
+
+/** @brief 呼び出した CPU の PMU を使えるようにする。BSP と各 AP で 1 回ずつ呼ぶ。 */
+void InitializePMU();
+
+/** @brief この CPU で計測できるイベントの集合 */
+uint32_t PMUSupportedEvents();
+
+/** @brief タスク切り替え時に呼ぶ。割り込み禁止状態で呼ぶこと。 */
+void PMUSwitch(PMUState& prev, PMUState& next);
+
+/** @brief 実行中のタスクで events の計測を始め，実際に計測を始めたイベントの集合を返す。 */
+uint32_t StartTaskCounters(uint32_t events);
+/** @brief 実行中のタスクの計測を止め，計数値を counts に書く。 */
+void StopTaskCounters(std::array<uint64_t, kPerfNumEvents>& counts);
+/** @brief 実行中のタスクの現在の計数値を counts に書く。 */
+void ReadTaskCounters(std::array<uint64_t, kPerfNumEvents>& counts);
@@ -0,0 +1,240 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#include "elf.hpp"
+#include "fat.hpp"
+#include "kernel_stack.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+volatile bool profile_enabled = false;
+
+namespace {
+    const size_t kProfileSamples = 8192; // 全 CPU で共有するサンプル数
+    const int kMaxImages = 64;
+    const size_t kImageNameLen = 16;
+
+    // アプリのスタック（ExecuteFile が割り当てる 1 ページ）
+    const uint64_t kUserStackBegin = 0xffff'ffff'ffff'e000;
+    const uint64_t kUserStackEnd = 0xffff'ffff'ffff'f000;
+    // カーネルのフレームをたどるのは割り込まれた RSP からこの範囲まで
+    const uint64_t kKernelStackWalkLimit = 64 * 1024;
+    const uint64_t kKernelMappedEnd = kPageDirectoryCount * 1024 * 1024 * 1024;
+
+    std::array<ProfileSample, kProfileSamples> samples;
+    std::atomic<size_t> num_samples{0};
+
+    // イメージ 0 はカーネル。登録は追記のみで，割り込みハンドラは task_image だけを読む。
+    std::array<std::array<char, kImageNameLen>, kMaxImages> image_names{};
+    int num_images = 1;
+    std::array<std::atomic<uint16_t>, TaskManager::kMaxTasks> task_image{};
+    Spinlock image_lock;
+
+    bool ValidFrame(uint64_t fp, bool user, uint64_t rsp) {
+        if (fp & 7) {
+            return false;
+        }
+        if (user) {
+            return kUserStackBegin <= fp && fp + 16 <= kUserStackEnd;
+        }
+        if (fp < rsp || fp >= rsp + kKernelStackWalkLimit) {
+            return false;
+        }
+        // タスクのスタックなら RSP からスロットの終端まではすべてマップされている
+        if (const uint64_t stack_end = KernelStackEnd(rsp)) {
+            return fp + 16 <= stack_end;
+        }
+        return fp + 16 <= kKernelMappedEnd;
+    }
+}
+
+void RecordProfileSample(const TaskContext& ctx) {
+    const size_t i = num_samples.fetch_add(1, std::memory_order_relaxed);
+    if (i >= kProfileSamples) {
+        profile_enabled = false;
+        return;
+    }
+
+    const bool user = (ctx.cs & 3) == 3;
+    const uint64_t task = task_manager->CurrentTask().ID();
+    auto& s = samples[i];
+    s.task = task;
+    s.image = user ? task_image[task & 0xffffffffu].load(std::memory_order_relaxed) : 0;
+    s.pcs[0] = ctx.rip;
+    s.depth = 1;
+
+    // 各フレームは [fp] = 呼び出し元の fp, [fp + 8] = 戻り番地
+    uint64_t fp = ctx.rbp;
+    while (s.depth < kProfileMaxDepth && ValidFrame(fp, user, ctx.rsp)) {
+        const auto frame = reinterpret_cast<const uint64_t*>(fp);
+        if (frame[1] == 0) {
+            break;
+        }
+        s.pcs[s.depth++] = frame[1];
+        if (frame[0] <= fp) { // スタックを遡る方向にしか進まない
+            break;
+        }
+        fp = frame[0];
+    }
+}
+
+void StartProfile() {
+    profile_enabled = false;
+    num_samples.store(0);
+    profile_enabled = true;
+}
+
+void StopProfile() {
+    profile_enabled = false;
+}
+
+void SetProfileImage(uint64_t task_id, const char* name) {
+    const uint32_t slot = task_id & 0xffffffffu;
+    if (name == nullptr) {
+        task_image[slot].store(0);
+        return;
+    }
+
+    const bool intr = DisableInterrupts();
+    image_lock.Lock();
+    int image = 1;
+    while (image < num_images &&
+           strncmp(image_names[image].data(), name, kImageNameLen - 1) != 0) {
+        ++image;
+    }
+    if (image == num_images && num_images < kMaxImages) {
+        strncpy(image_names[image].data(), name, kImageNameLen - 1);
+        ++num_images;
+    }
+    image_lock.Unlock();
+    RestoreInterrupts(intr);
+
+    task_image[slot].store(image < kMaxImages ? image : 0);
+}
+
+namespace {
+    /** @brief ELF ファイルの .symtab から作る関数シンボル表 */
+    class SymbolTable {
+    public:
+        /** @brief パスで指定したファイルを読む。読めなければ空のまま false を返す。 */
+        bool Load(const char* file_name) {
+            auto entry = fat::FindFile(file_name);
+            if (!entry) {
+                return false;
+            }
+            std::vector<uint8_t> buf(entry->file_size);
+            fat::LoadFile(buf.data(), buf.size(), *entry);
+
+            auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(buf.data());
+            if (buf.size() < sizeof(Elf64_Ehdr) ||
+                memcmp(ehdr->e_ident, "\x7f" "ELF", 4) != 0 ||
+                ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > buf.size()) {
+                return false;
+            }
+            auto shdrs = reinterpret_cast<const Elf64_Shdr*>(buf.data() + ehdr->e_shoff);
+            for (int i = 0; i < ehdr->e_shnum; ++i) {
+                if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr->e_shnum) {
+                    continue;
+                }
+                const auto& strtab = shdrs[shdrs[i].sh_link];
+                if (strtab.sh_offset + strtab.sh_size > buf.size() ||
+                    shdrs[i].sh_offset + shdrs[i].sh_size > buf.size()) {
+                    continue;
+                }
+                names_.assign(buf.data() + strtab.sh_offset,
+                              buf.data() + strtab.sh_offset + strtab.sh_size);
+                names_.push_back('\0');
+
+                auto syms = reinterpret_cast<const Elf64_Sym*>(buf.data() + shdrs[i].sh_offset);
+                const size_t num_syms = shdrs[i].sh_size / sizeof(Elf64_Sym);
+                for (size_t j = 0; j < num_syms; ++j) {
+                    if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_value != 0 &&
+                        syms[j].st_name < strtab.sh_size) {
+                        symbols_.push_back({syms[j].st_value, syms[j].st_size, syms[j].st_name});
+                    }
+                }
+                break;
+            }
+            std::sort(symbols_.begin(), symbols_.end(),
+                      [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+            return true;
+        }
+
+        /** @brief addr を含む関数の名前を返す。見つからなければ nullptr。 */
+        const char* Lookup(uint64_t addr) const {
+            auto it = std::upper_bound(symbols_.begin(), symbols_.end(), addr,
+                [](uint64_t a, const Symbol& s) { return a < s.addr; });
+            if (it == symbols_.begin()) {
+                return nullptr;
+            }
+            --it;
+            if (it->size != 0 && addr >= it->addr + it->size) {
+                return nullptr;
+            }
+            return &names_[it->name];
+        }
+
+    private:
+        struct Symbol {
+            uint64_t addr, size;
+            uint32_t name;
+        };
+        std::vector<Symbol> symbols_;
+        std::vector<char> names_;
+    };
+
+    void AppendFrame(std::string& line, const SymbolTable& table, uint64_t pc) {
+        line += ';';
+        if (auto name = table.Lookup(pc)) {
+            line += name;
+        } else {
+            char s[24];
+            sprintf(s, "0x%lx", pc);
+            line += s;
+        }
+    }
+}
+
+std::vector<std::string> FoldProfile() {
+    StopProfile();
+    const size_t n = std::min(num_samples.load(), kProfileSamples);
+
+    std::vector<SymbolTable> tables(num_images);
+    std::vector<bool> loaded(num_images);
+    std::map<std::string, unsigned int> folded;
+
+    for (size_t i = 0; i < n; ++i) {
+        const auto& s = samples[i];
+        const int image = s.image < num_images ? s.image : 0;
+        if (!loaded[image]) {
+            tables[image].Load(image == 0 ? "kernel.elf" : image_names[image].data());
+            loaded[image] = true;
+        }
+
+        char head[48];
+        sprintf(head, "task%lu:%lu;%s", s.task >> 32, s.task & 0xffffffffu,
+                image == 0 ? "[kernel]" : image_names[image].data());
+        std::string line{head};
+        // 戻り番地は call の次の命令を指すので 1 引いてから引く
+        for (int d = s.depth - 1; d > 0; --d) {
+            AppendFrame(line, tables[image], s.pcs[d] - 1);
+        }
+        AppendFrame(line, tables[image], s.pcs[0]);
+        ++folded[line];
+    }
+
+    std::vector<std::string> lines;
+    lines.reserve(folded.size());
+    for (auto& [ stack, count ] : folded) {
+        char s[16];
+        sprintf(s, " %u", count);
+        lines.push_back(stack + s);
+    }
+    return lines;
+}
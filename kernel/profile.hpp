@@ -0,0 +1,61 @@
+/**
+ * @file profile.hpp
+ *
+ * LAPIC タイマ割り込みを契機に実行位置を記録するサンプリングプロファイラ。
+ *
+ * 割り込みハンドラでは RIP とフレームポインタをたどった呼び出し履歴を
+ * 事前に確保したバッファへ書き込むだけにして，シンボル解決は
+ * 表示するときに kernel.elf とアプリの ELF ファイルを読んで行う。
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "task.hpp"
+
+/** @brief 1 サンプルに記録する呼び出し履歴の最大の深さ */
+const int kProfileMaxDepth = 16;
+
+struct ProfileSample {
+    uint64_t task;
+    uint16_t depth;
+    uint16_t image; // 0 ならカーネル，それ以外は SetProfileImage で登録したアプリ
+    uint32_t reserved;
+    uint64_t pcs[kProfileMaxDepth]; // pcs[0] が割り込まれた位置，以降は戻り番地
+};
+
+/** @brief サンプリング中なら true */
+extern volatile bool profile_enabled;
+
+void RecordProfileSample(const TaskContext& ctx);
+
+/** @brief タイマ割り込みから呼ぶ。サンプリング中でなければ何もしない。 */
+inline void ProfileTick(const TaskContext& ctx) {
+    if (profile_enabled) {
+        RecordProfileSample(ctx);
+    }
+}
+
+/** @brief 記録を空にしてサンプリングを始める。 */
+void StartProfile();
+
+/** @brief サンプリングを止める。記録は FoldProfile で取り出せる。 */
+void StopProfile();
+
+/** @brief 以降 task_id のタスクがユーザモードで動くときは name のアプリとして記録する。
+ *
+ * name はアプリのファイル名で，シンボル解決の際にそのファイルを読む。
+ * nullptr を渡すと登録を解除する。
+ */
+void SetProfileImage(uint64_t task_id, const char* name);
+
+/** @brief 記録をシンボル解決し，折り畳みスタック形式の行の並びにする。
+ *
+ * 各行は「タスク;イメージ;外側の関数;...;内側の関数 サンプル数」の形で，
+ * flamegraph.pl などのツールにそのまま渡せる。
+ * 関数名は C++ のマングルされたままなので，必要なら c++filt を通すこと。
+ */
+std::vector<std::string> FoldProfile();
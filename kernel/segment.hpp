@@ -41,6 +41,7 @@ const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
-void SetupSegments();
-void InitializeSegmentation();
-void InitializeTSS();
+// cpu は CPU 番号（0 が BSP）。CPU ごとに専用の GDT と TSS を使う。
+void SetupSegments(int cpu = 0);
+void InitializeSegmentation(int cpu = 0);
+void InitializeTSS(int cpu = 0);
@@ -0,0 +1,146 @@
+#include "smp.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "pmu.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern "C" {
+    // ap_boot.asm
+    extern uint8_t ApBootStart[], ApBootParams[], ApBootEnd[];
+}
+
+std::array<uint8_t, 256> cpu_index_by_apic_id{};
+int num_cpus = 1;
+
+namespace {
+    /** @brief トランポリンが 64 ビットモードに入った後に参照する引数（ap_boot.asm と同じ並び） */
+    struct APBootParams {
+        uint64_t cr3;
+        uint64_t stack_end;
+        uint64_t entry;
+        uint32_t cpu;
+        uint32_t reserved;
+    } __attribute__((packed));
+
+    const int kAPStackFrames = 8;
+
+    volatile uint32_t& lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+    volatile uint32_t& lapic_svr = *reinterpret_cast<uint32_t*>(0xfee000f0);
+    volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+    volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+    FrameID ap_boot_frame{kNullFrame};
+    std::atomic<bool> ap_started{false};
+
+    void SendIPI(uint8_t apic_id, uint32_t command) {
+        icr_high = static_cast<uint32_t>(apic_id) << 24;
+        icr_low = command;
+        while (icr_low & (1u << 12)); // 送信完了（Delivery Status = Idle）を待つ
+    }
+
+    bool WaitAPStarted(unsigned long msec) {
+        for (unsigned long i = 0; i < msec; ++i) {
+            if (ap_started.load()) {
+                return true;
+            }
+            acpi::WaitMilliseconds(1);
+        }
+        return ap_started.load();
+    }
+
+    /** @brief INIT-SIPI-SIPI シーケンスで 1 つの AP を起動し，起動を確認できたら true を返す。 */
+    bool StartAP(uint8_t apic_id, int cpu, APBootParams& params) {
+        auto [ stack, err ] = memory_manager->Allocate(kAPStackFrames);
+        if (err) {
+            Log(kError, "failed to allocate AP stack: %s\n", err.Name());
+            return false;
+        }
+
+        params.stack_end = reinterpret_cast<uint64_t>(stack.Frame()) +
+                           kAPStackFrames * kBytesPerFrame;
+        params.cpu = cpu;
+        cpu_index_by_apic_id[apic_id] = cpu;
+        ap_started.store(false);
+
+        const uint32_t vector = ap_boot_frame.ID(); // 4 KiB 単位の物理ページ番号
+        SendIPI(apic_id, 0x0000'4500); // INIT, assert
+        acpi::WaitMilliseconds(10);
+        SendIPI(apic_id, 0x0000'4600 | vector); // Start-up
+        if (WaitAPStarted(1)) {
+            return true;
+        }
+        SendIPI(apic_id, 0x0000'4600 | vector);
+        return WaitAPStarted(100);
+    }
+}
+
+extern "C" void ApMain(int cpu) {
+    InitializeSegmentation(cpu);
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeTSS(cpu);
+    InitializeSyscall();
+    InitializePMU();
+    lapic_svr = lapic_svr | 0x100; // APIC Software Enable
+
+    task_manager->RegisterCPU(cpu);
+    ap_started.store(true);
+
+    InitializeLAPICTimerForAP();
+    // 以降はこの CPU のアイドルタスクとして動く
+    while (true) task_manager->Idle();
+}
+
+void ReserveAPBootPage() {
+    auto [ frame, err ] = memory_manager->Allocate(1);
+    if (err) {
+        Log(kWarn, "failed to reserve AP boot page: %s\n", err.Name());
+        return;
+    }
+    if (reinterpret_cast<uintptr_t>(frame.Frame()) >= 0x100000) {
+        Log(kWarn, "no free page below 1 MiB for AP boot\n");
+        memory_manager->Free(frame, 1);
+        return;
+    }
+    ap_boot_frame = frame;
+}
+
+void InitializeSMP() {
+    if (acpi::madt == nullptr || ap_boot_frame.ID() == kNullFrame.ID()) {
+        Log(kWarn, "SMP is not available, running on BSP only\n");
+        return;
+    }
+
+    std::array<uint8_t, kMaxCPUs> apic_ids;
+    const size_t num_ids = acpi::madt->EnabledLocalAPICIDs(apic_ids.data(), apic_ids.size());
+    const uint8_t bsp_apic_id = lapic_id >> 24;
+
+    auto trampoline = reinterpret_cast<uint8_t*>(ap_boot_frame.Frame());
+    memcpy(trampoline, ApBootStart, ApBootEnd - ApBootStart);
+    auto& params = *reinterpret_cast<APBootParams*>(
+        trampoline + (ApBootParams - ApBootStart));
+    params.cr3 = GetCR3();
+    params.entry = reinterpret_cast<uint64_t>(ApMain);
+
+    for (size_t i = 0; i < num_ids; ++i) {
+        if (apic_ids[i] == bsp_apic_id) {
+            continue;
+        }
+        if (!StartAP(apic_ids[i], num_cpus, params)) {
+            Log(kWarn, "AP (APIC ID %u) did not respond\n", apic_ids[i]);
+            cpu_index_by_apic_id[apic_ids[i]] = 0;
+            continue;
+        }
+        ++num_cpus;
+    }
+    Log(kInfo, "%d CPUs online\n", num_cpus);
+}
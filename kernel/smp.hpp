@@ -0,0 +1,38 @@
+/**
+ * @file smp.hpp
+ *
+ * アプリケーションプロセッサ（AP）の起動と CPU 番号の管理を行うプログラムを集めたファイル。
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/** @brief 扱える CPU の最大数。CPU 番号は 0（BSP）から kMaxCPUs - 1 まで。 */
+const int kMaxCPUs = 16;
+
+/** @brief Local APIC ID から CPU 番号を引く表。未登録の ID は 0（BSP）になる。 */
+extern std::array<uint8_t, 256> cpu_index_by_apic_id;
+
+/** @brief 起動済みの CPU 数（BSP を含む） */
+extern int num_cpus;
+
+/** @brief このコードを実行している CPU の番号を返す。 */
+inline int CurrentCPU() {
+    const uint32_t apic_id =
+        *reinterpret_cast<volatile uint32_t*>(0xfee00020) >> 24;
+    return cpu_index_by_apic_id[apic_id];
+}
+
+/** @brief AP 起動用のトランポリンを置く 1 MiB 未満のページを予約する。
+ *
+ * 低位のフレームが他の用途で使われてしまう前，InitializeMemoryManager の直後に呼び出すこと。
+ */
+void ReserveAPBootPage();
+
+/** @brief MADT に載っている AP を INIT/SIPI で起動する。
+ *
+ * acpi::Initialize, InitializeLAPICTimer, InitializeTask の後に呼び出すこと。
+ */
+void InitializeSMP();
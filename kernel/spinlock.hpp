@@ -0,0 +1,91 @@
+/**
+ * @file spinlock.hpp
+ *
+ * CPU 間の排他制御に使うスピンロックを集めたファイル。
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "interrupt.hpp"
+#include "smp.hpp"
+
+/** @brief 再帰しない単純なスピンロック
+ *
+ * 割り込みの許可状態は変更しないので，割り込みハンドラと共有するなら
+ * 呼び出し側で割り込みを禁止しておくこと。
+ * SwitchContext がアセンブリから flag_ に 0 を書いて解放するため，
+ * flag_ は先頭に置いた int でなければならない。
+ */
+class Spinlock {
+public:
+    void Lock() {
+        while (flag_.exchange(1, std::memory_order_acquire)) {
+            while (flag_.load(std::memory_order_relaxed)) {
+                __builtin_ia32_pause();
+            }
+        }
+    }
+
+    bool TryLock() {
+        return !flag_.exchange(1, std::memory_order_acquire);
+    }
+
+    void Unlock() {
+        flag_.store(0, std::memory_order_release);
+    }
+
+private:
+    std::atomic<int> flag_{0};
+};
+
+/** @brief 同じ CPU からなら何度でも取得できるスピンロック
+ *
+ * 最初の Lock で割り込みを禁止し，最後の Unlock で元の状態に戻す。
+ * ロックを持ったままタスクを切り替えてはならない。
+ */
+class RecursiveSpinlock {
+public:
+    void Lock() {
+        const bool intr = DisableInterrupts();
+        const int cpu = CurrentCPU();
+        if (owner_.load(std::memory_order_relaxed) == cpu) {
+            ++depth_;
+            return;
+        }
+        lock_.Lock();
+        owner_.store(cpu, std::memory_order_relaxed);
+        depth_ = 1;
+        intr_ = intr;
+    }
+
+    void Unlock() {
+        if (--depth_ > 0) {
+            return;
+        }
+        const bool intr = intr_;
+        owner_.store(-1, std::memory_order_relaxed);
+        lock_.Unlock();
+        RestoreInterrupts(intr);
+    }
+
+private:
+    Spinlock lock_;
+    std::atomic<int> owner_{-1};
+    int depth_{0};
+    bool intr_{false};
+};
+
+/** @brief スコープを抜けるときにロックを解放する */
+template <class L>
+class LockGuard {
+public:
+    explicit LockGuard(L& lock) : lock_{lock} { lock_.Lock(); }
+    ~LockGuard() { lock_.Unlock(); }
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+
+private:
+    L& lock_;
+};
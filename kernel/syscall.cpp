@@ -1,9 +1,12 @@
 #include "syscall.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cerrno>
+#include <fcntl.h>
 #include <cmath>
+#include <cstring>
 
 #include "asmfunc.h"
 #include "msr.hpp"
@@ -14,6 +17,8 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "pmu.hpp"
+#include "fat.hpp"
 
 namespace syscall {
 
@@ -22,6 +27,46 @@ namespace syscall {
         int error;
     };
 
+namespace {
+    /** @brief アプリが指定できるアドレスの範囲（両端を含む） */
+    struct UserRange {
+        uint64_t first, last;
+        bool writable;
+    };
+
+    const std::array<UserRange, 3> kUserRanges{{
+        {0xffff'8000'0000'0000, 0xffff'807f'ffff'ffff, true},  // アプリ本体（PML4 のエントリ 256）
+        {0xffff'8080'0000'0000, 0xffff'80ff'ffff'ffff, false}, // MapFile の領域（読み込み専用）
+        {0xffff'ffff'ffff'e000, 0xffff'ffff'ffff'ffff, true},  // スタックと引数
+    }};
+
+    /** @brief [addr, addr + len) が丸ごとアプリの範囲に収まっていれば true
+     *
+     * 上位半分にはカーネルスタックやボリュームの窓もあるので，符号だけでは判定しない。
+     */
+    bool IsUserRange(uint64_t addr, uint64_t len, bool write) {
+        for (const auto& r : kUserRanges) {
+            if (addr < r.first || addr > r.last || (write && !r.writable)) {
+                continue;
+            }
+            return len == 0 || len - 1 <= r.last - addr;
+        }
+        return false;
+    }
+
+    /** @brief addr からの NUL 終端文字列がアプリの範囲に収まっていれば true */
+    bool IsUserString(uint64_t addr, size_t max_len) {
+        for (const auto& r : kUserRanges) {
+            if (addr < r.first || addr > r.last) {
+                continue;
+            }
+            const uint64_t limit = std::min<uint64_t>(max_len, r.last - addr + 1);
+            return strnlen(reinterpret_cast<const char*>(addr), limit) < limit;
+        }
+        return false;
+    }
+}
+
 #define SYSCALL(name) \
     Result name( \
         uint64_t arg1, uint64_t arg2, uint64_t arg3, \
@@ -51,7 +96,10 @@ SYSCALL(PutString) {
 
     if (fd == 1) {
         const auto task_id = task_manager->CurrentTask().ID();
-        (*terminals)[task_id]->Print(s, len);
+        layer_lock.Lock();
+        Terminal* terminal = (*terminals)[task_id];
+        layer_lock.Unlock();
+        terminal->Print(s, len);
         return { len, 0 };
     }
     return {0, EBADF};
@@ -70,17 +118,17 @@ SYSCALL(OpenWindow) {
     const auto win = std::make_shared<ToplevelWindow>(
         w, h, screen_config.pixel_format, title);
 
-    __asm__("cli");
+    const auto task_id = task_manager->CurrentTask().ID();
+
+    layer_lock.Lock();
     const auto layer_id = layer_manager->NewLayer()
         .SetWindow(win)
         .SetDraggable(true)
         .Move({x, y})
         .ID();
-    active_layer->Activate(layer_id);
-
-    const auto task_id = task_manager->CurrentTask().ID();
     layer_task_map->insert(std::make_pair(layer_id, task_id));
-    __asm__("sti");
+    layer_lock.Unlock();
+    active_layer->Activate(layer_id);
 
     return {layer_id, 0};
 }
@@ -91,9 +139,7 @@ namespace {
         const uint32_t layer_flags = layer_id_flags >> 32;
         const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-        __asm__("cli");
         auto layer = layer_manager->FindLayer(layer_id);
-        __asm__("sti");
         if (layer == nullptr) {
             return {0, EBADF};
         }
@@ -104,9 +150,7 @@ namespace {
         }
 
         if ((layer_flags & 1)  == 0) {
-            __asm__("cli");
             layer_manager->Draw(layer_id);
-            __asm__("sti");
         }
 
         return res;
@@ -189,27 +233,29 @@ SYSCALL(WinDrawLine) {
 
 SYSCALL(CloseWindow) {
     const unsigned int layer_id = arg1 & 0xffffffff;
-    const auto layer = layer_manager->FindLayer(layer_id);
 
-    if (layer == nullptr) {
-        return { EBADF, 0 };
-    }
+    Rectangle<int> area;
+    {
+        LockGuard guard{layer_lock};
+        const auto layer = layer_manager->FindLayer(layer_id);
+
+        if (layer == nullptr) {
+            return { EBADF, 0 };
+        }
 
-    const auto layer_pos = layer->GetPosition();
-    const auto win_size = layer->GetWindow()->Size();
+        area = {layer->GetPosition(), layer->GetWindow()->Size()};
+        layer_task_map->erase(layer_id);
+    }
 
-    __asm__("cli");
     active_layer->Activate(0);
     layer_manager->RemoveLayer(layer_id);
-    layer_manager->Draw({layer_pos, win_size});
-    layer_task_map->erase(layer_id);
-    __asm__("sti");
+    layer_manager->Draw(area);
 
     return {0, 0};
 }
 
 SYSCALL(ReadEvent) {
-    if (arg1 < 0x8000'0000'0000'0000) {
+    if (arg2 > (1ul << 32) || !IsUserRange(arg1, arg2 * sizeof(AppEvent), true)) {
         return { 0, EFAULT};
     }
     const auto app_events = reinterpret_cast<AppEvent*>(arg1);
@@ -250,6 +296,8 @@ SYSCALL(ReadEvent) {
             app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
             ++i;
             break;
+        case Message::kBlockIOCompleted:
+            break; // ファイルの先読みの完了。待つ側は BlockIOWaiter を見るので捨ててよい
         default:
             Log(kInfo, "uncaught event type: %u\n", msg->type);
         }
@@ -258,12 +306,173 @@ SYSCALL(ReadEvent) {
     return {i, 0};
 }
 
+SYSCALL(PerfCounters) {
+    const auto op = static_cast<PerfOp>(arg1);
+    const uint32_t events = arg2;
+    if (arg3 != 0 && !IsUserRange(arg3, sizeof(uint64_t) * kPerfNumEvents, true)) {
+        return { 0, EFAULT };
+    }
+    const auto counts = reinterpret_cast<uint64_t*>(arg3);
+
+    std::array<uint64_t, kPerfNumEvents> values{};
+    switch (op) {
+    case kPerfStart:
+        if (const uint32_t started = StartTaskCounters(events); started != 0 || events == 0) {
+            return { started, 0 };
+        }
+        return { 0, ENOTSUP };
+    case kPerfStop:
+        StopTaskCounters(values);
+        break;
+    case kPerfRead:
+        ReadTaskCounters(values);
+        break;
+    default:
+        return { 0, EINVAL };
+    }
+
+    if (counts) {
+        std::copy(values.begin(), values.end(), counts);
+    }
+    return { PMUSupportedEvents(), 0 };
+}
+
+namespace {
+    /** @brief 実行中のタスクのファイル記述子 fd を返す。無効なら nullptr。 */
+    ::FileDescriptor* FindFileDescriptor(uint64_t fd) {
+        auto& files = task_manager->CurrentTask().Files();
+        if (fd >= files.size()) {
+            return nullptr;
+        }
+        return files[fd].get();
+    }
+}
+
+SYSCALL(OpenFile) {
+    const char* path = reinterpret_cast<const char*>(arg1);
+    const int flags = arg2;
+    if (!IsUserString(arg1, 1024)) {
+        return { 0, EFAULT };
+    }
+    const bool writable = (flags & O_ACCMODE) != O_RDONLY;
+
+    auto entry = fat::FindFile(path);
+    if (entry == nullptr) {
+        if ((flags & O_CREAT) == 0) {
+            return { 0, ENOENT };
+        }
+        // 探してから作るまでの間に他のタスクが作っていれば，そのエントリが返る
+        auto [ new_entry, err ] = fat::CreateFile(path);
+        if (err.Cause() == Error::kAlreadyAllocated && (flags & O_EXCL) == 0) {
+            err = MAKE_ERROR(Error::kSuccess);
+        }
+        if (err) {
+            return { 0, err.Cause() == Error::kFull ? ENOSPC :
+                        err.Cause() == Error::kAlreadyAllocated ? EEXIST :
+                        err.Cause() == Error::kInvalidFormat ? EINVAL : ENOENT };
+        }
+        entry = new_entry;
+    } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+        return { 0, EEXIST };
+    }
+    if (static_cast<uint8_t>(entry->attr) & static_cast<uint8_t>(fat::Attribute::kDirectory)) {
+        return { 0, EISDIR };
+    }
+    if (writable && (static_cast<uint8_t>(entry->attr) &
+                     static_cast<uint8_t>(fat::Attribute::kReadOnly))) {
+        return { 0, EACCES };
+    }
+    if (writable && (flags & O_TRUNC)) {
+        if (auto err = fat::ResizeFile(*entry, 0)) {
+            return { 0, err.Cause() == Error::kBusy ? EBUSY : EIO };
+        }
+    }
+
+    auto& files = task_manager->CurrentTask().Files();
+    if (files.size() < 3) {
+        files.resize(3); // 0〜2 は端末用
+    }
+    size_t fd = 3;
+    while (fd < files.size() && files[fd]) {
+        ++fd;
+    }
+    if (fd == files.size()) {
+        files.emplace_back();
+    }
+    files[fd] = std::make_shared<fat::FileDescriptor>(*entry, writable, flags & O_APPEND);
+    return { fd, 0 };
+}
+
+SYSCALL(ReadFile) {
+    auto file = FindFileDescriptor(arg1);
+    if (file == nullptr) {
+        return { 0, EBADF };
+    }
+    if (!IsUserRange(arg2, arg3, true)) {
+        return { 0, EFAULT };
+    }
+    return { file->Read(reinterpret_cast<void*>(arg2), arg3), 0 };
+}
+
+SYSCALL(WriteFile) {
+    auto file = FindFileDescriptor(arg1);
+    if (file == nullptr) {
+        return { 0, EBADF };
+    }
+    if (!IsUserRange(arg2, arg3, false)) {
+        return { 0, EFAULT };
+    }
+    auto [ n, err ] = file->Write(reinterpret_cast<const void*>(arg2), arg3);
+    if (err) {
+        return { 0, err.Cause() == Error::kIsReadOnly ? EBADF : ENOSPC };
+    }
+    return { n, 0 };
+}
+
+SYSCALL(SeekFile) {
+    auto file = FindFileDescriptor(arg1);
+    if (file == nullptr) {
+        return { 0, EBADF };
+    }
+    auto [ pos, err ] = file->Seek(static_cast<int64_t>(arg2), arg3);
+    if (err) {
+        return { 0, EINVAL };
+    }
+    return { pos, 0 };
+}
+
+SYSCALL(CloseFile) {
+    auto& files = task_manager->CurrentTask().Files();
+    if (arg1 >= files.size() || !files[arg1]) {
+        return { 0, EBADF };
+    }
+    files[arg1].reset();
+    return { 0, 0 };
+}
+
+SYSCALL(MapFile) {
+    auto& task = task_manager->CurrentTask();
+    if (arg1 >= task.Files().size() || !task.Files()[arg1]) {
+        return { 0, EBADF };
+    }
+    const auto file = task.Files()[arg1];
+    if (!IsUserRange(arg2, sizeof(size_t), true)) {
+        return { 0, EFAULT };
+    }
+    auto [ addr, err ] = ::MapFile(task, file);
+    if (err) {
+        return { 0, ENOMEM };
+    }
+    *reinterpret_cast<size_t*>(arg2) = file->Size();
+    return { addr, 0 };
+}
+
 #undef SYSCALL
 }
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
                                 uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 0xb> syscall_table {
+extern "C" std::array<SyscallFuncType*, 0x12> syscall_table {
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -275,6 +484,13 @@ extern "C" std::array<SyscallFuncType*, 0xb> syscall_table {
     /* 0x08 */ syscall::WinDrawLine,
     /* 0x09 */ syscall::CloseWindow,
     /* 0x0a */ syscall::ReadEvent,
+    /* 0x0b */ syscall::PerfCounters,
+    /* 0x0c */ syscall::OpenFile,
+    /* 0x0d */ syscall::ReadFile,
+    /* 0x0e */ syscall::SeekFile,
+    /* 0x0f */ syscall::CloseFile,
+    /* 0x10 */ syscall::MapFile,
+    /* 0x11 */ syscall::WriteFile,
 };
 
 
@@ -1,8 +1,15 @@
 #include "task.hpp"
 
+#include <limits>
+
 #include "asmfunc.h"
+#include "idle.hpp"
+#include "interrupt.hpp"
+#include "kernel_stack.hpp"
+#include "logger.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 
 namespace {
     template <class T, class U>
@@ -12,17 +19,59 @@ namespace {
     }
 
     void TaskIdle(uint64_t task_id, int64_t data) {
-        while (true) __asm__("hlt");
+        while (true) task_manager->Idle();
+    }
+
+    void TaskReaper(uint64_t task_id, int64_t data) {
+        Task& task = task_manager->CurrentTask();
+        while (true) {
+            __asm__("cli");
+            auto msg = task.ReceiveMessage();
+            if (!msg) {
+                task.Sleep();
+                __asm__("sti");
+                continue;
+            }
+            __asm__("sti");
+
+            if (msg->type == Message::kTaskExited) {
+                task_manager->ReapExitedTasks();
+            }
+        }
     }
+
+    // CPU を明け渡してからこの時間（1/kCacheHotDivisor 秒）以内のタスクは
+    // まだキャッシュが温かいとみなし，なるべく移動させない
+    const unsigned long kCacheHotDivisor = 2000;
+
+    const uint64_t kCR0TaskSwitched = 1u << 3;
+}
+
+Task::Task(uint64_t id) : id_{id} {
 }
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {
+Task::~Task() {
+    if (stack_end_ != 0) {
+        FreeKernelStack(stack_end_, stack_bytes_);
+    }
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]); 
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+    // 再利用されたオブジェクトが同じ大きさのスタックを持っていればそのまま使う
+    if (stack_end_ != 0 && stack_bytes_ != stack_bytes) {
+        FreeKernelStack(stack_end_, stack_bytes_);
+        stack_end_ = 0;
+    }
+    if (stack_end_ == 0) {
+        auto [ stack_end, err ] = AllocateKernelStack(stack_bytes);
+        if (err) {
+            Log(kError, "failed to allocate kernel stack: %s\n", err.Name());
+            exit(1);
+        }
+        stack_end_ = stack_end;
+        stack_bytes_ = stack_bytes;
+    }
+    const uint64_t stack_end = stack_end_;
 
     memset(&context_, 0, sizeof(context_));
     context_.cr3 = GetCR3();
@@ -35,7 +84,8 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
     context_.rdi = id_;
     context_.rsi = data;
 
-    // MXCSR のすべての例外をマスクする
+    // x87 FPU と MXCSR のすべての例外をマスクする（FNINIT 直後と同じ状態）
+    *reinterpret_cast<uint16_t*>(&context_.fxsave_area[0]) = 0x037f;
     *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
 
     return *this;
@@ -64,74 +114,212 @@ Task& Task::Wakeup() {
 }
 
 void Task::SendMessage(const Message& msg) {
-    msgs_.push_back(msg);
+    Trace(TraceEvent::kSendMessage, id_, msg.type);
+    msgs_.Push(msg);
     Wakeup();
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-    if (msgs_.empty()) {
-        return std::nullopt;
+    if (!deferred_.empty()) {
+        const Message msg = deferred_.front();
+        deferred_.pop_front();
+        return msg;
     }
-    auto m = msgs_.front();
-    msgs_.pop_front();
-    return m;
+    return msgs_.Pop();
+}
+
+Message Task::WaitMessage(bool (*match)(const Message& msg, const void* arg), const void* arg) {
+    for (auto it = deferred_.begin(); it != deferred_.end(); ++it) {
+        if (match(*it, arg)) {
+            const Message msg = *it;
+            deferred_.erase(it);
+            return msg;
+        }
+    }
+
+    while (true) {
+        __asm__("cli");
+        auto msg = msgs_.Pop();
+        if (!msg) {
+            Sleep();
+            __asm__("sti");
+            continue;
+        }
+        __asm__("sti");
+
+        if (match(*msg, arg)) {
+            return *msg;
+        }
+        deferred_.push_back(*msg);
+    }
+}
+
+void Task::Reset(uint64_t id) {
+    id_ = id;
+    while (msgs_.Pop());
+    deferred_.clear();
+    level_ = kDefaultLevel;
+    running_ = false;
+    cpu_ = -1;
+    last_run_tsc_ = 0;
+    migrations_ = 0;
+    pmu_ = {};
+    exited_ = false;
+    files_.clear();
+    file_maps_.clear();
 }
 
 TaskManager::TaskManager() {
+    auto& q = cpus_[0];
     Task& task = NewTask()
-        .SetLevel(current_level_)
+        .SetLevel(q.current_level)
         .SetRunning(true);
-    running_[current_level_].push_back(&task);
+    task.cpu_ = 0;
+    q.running[q.current_level].push_back(&task);
+    q.current = &task;
+    q.fpu_owner = &task; // 起動時の処理の流れの FPU 状態がそのまま載っている
 
     Task& idle = NewTask()
         .InitContext(TaskIdle, 0)
         .SetLevel(0)
         .SetRunning(true);
-    running_[0].push_back(&idle);
+    idle.cpu_ = 0;
+    q.running[0].push_back(&idle);
+
+    online_[0] = true;
+
+    reaper_ = &NewTask().InitContext(TaskReaper, 0);
+    Wakeup(reaper_);
 }
 
 Task& TaskManager::NewTask() {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+
+    uint32_t index;
+    if (!free_slots_.empty()) {
+        index = free_slots_.back();
+        free_slots_.pop_back();
+    } else if (num_slots_used_ < slots_.size()) {
+        index = num_slots_used_;
+        ++num_slots_used_;
+    } else {
+        lock_.Unlock();
+        RestoreInterrupts(intr);
+        Log(kError, "task table is full\n");
+        exit(1);
+    }
+
+    auto& slot = slots_[index];
+    const uint64_t id = static_cast<uint64_t>(slot.generation) << 32 | index;
+    if (slot.task) {
+        slot.task->Reset(id);
+    } else {
+        slot.task.reset(new Task{id});
+    }
+    Task& task = *slot.task;
+
+    lock_.Unlock();
+    RestoreInterrupts(intr);
+    return task;
 }
 
 void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-    TaskContext& task_ctx = task_manager->CurrentTask().Context();
-    memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-    Task* current_task = RotateCurrentRunQueue(false);
-    if (&CurrentTask() != current_task) {
-        RestoreContext(&CurrentTask().Context());
+    // 割り込みハンドラから呼ばれるので割り込みは禁止されている
+    lock_.Lock();
+    const int cpu = CurrentCPU();
+    auto& q = cpus_[cpu];
+    TaskContext& task_ctx = q.current->Context();
+    // FPU/SSE の状態は遅延して保存するので fxsave_area はコピーしない
+    memcpy(&task_ctx, &current_ctx, offsetof(TaskContext, fxsave_area));
+    Task* current_task = RotateCurrentRunQueue(cpu, false);
+    Task* next_task = q.current;
+    // コンテキストは保存済みで，今は IST のスタック上にいるので，ここで解放してよい
+    lock_.Unlock();
+
+    if (next_task != current_task) {
+        Trace(TraceEvent::kPreempt, next_task->ID(), current_task->ID());
+        PMUSwitch(current_task->pmu_, next_task->pmu_);
+    }
+
+    q.in_interrupt = false;
+    SetFPUTrap(q, q.fpu_owner != next_task);
+
+    if (next_task != current_task) {
+        RestoreContext(&next_task->Context());
     }
 }
 
 void TaskManager::Sleep(Task* task) {
-    if (!task->Running()) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    SleepLocked(task, intr);
+}
+
+void TaskManager::SleepLocked(Task* task, bool intr) {
+    const int cpu = CurrentCPU();
+    auto& q = cpus_[cpu];
+    // 受信待ちのタスクが空のキューを見てからここに来るまでに，
+    // 他の CPU がメッセージを積んで Wakeup を済ませていることがある
+    if (!task->Running() || (task == q.current && !task->msgs_.Empty())) {
+        lock_.Unlock();
+        RestoreInterrupts(intr);
         return;
     }
 
     task->SetRunning(false);
-
-    if (task == running_[current_level_].front()) {
-        Task* current_task = RotateCurrentRunQueue(true);
-        SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    Trace(TraceEvent::kSleep, task->ID());
+
+    if (task == q.current) {
+        Task* current_task = RotateCurrentRunQueue(cpu, true);
+        Trace(TraceEvent::kSwitch, q.current->ID(), current_task->ID());
+        PMUSwitch(current_task->pmu_, q.current->pmu_);
+        SetFPUTrap(q, q.fpu_owner != q.current);
+        // lock_ はコンテキストを保存し終えた後に SwitchContext が解放する
+        SwitchContext(&q.current->Context(), &current_task->Context(),
+                      &lock_, q.switch_stack.end());
+        RestoreInterrupts(intr);
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    // 他の CPU で実行中なら，その CPU が次に切り替えるときにキューから外す
+    if (task != cpus_[task->cpu_].current) {
+        Erase(cpus_[task->cpu_].running[task->Level()], task);
+    }
+
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-                        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    // 探してから眠らせるまでの間にタスクが終了してスロットが再利用されないよう，
+    // lock_ を取ったまま行う
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    Task* task = FindTaskLocked(id);
+    if (task == nullptr) {
+        lock_.Unlock();
+        RestoreInterrupts(intr);
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    SleepLocked(task, intr);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    WakeupLocked(task, level);
+    lock_.Unlock();
+    RestoreInterrupts(intr);
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
+    if (task->exited_) {
+        return;
+    }
+
     //タスク動作中
     if (task->Running()) {
         ChangeLevelRunning(task, level);
@@ -139,47 +327,209 @@ void TaskManager::Wakeup(Task* task, int level) {
     }
 
     //タスクSleep中
+    if (task->cpu_ < 0) {
+        task->cpu_ = LeastLoadedCPU();
+    }
+    auto& q = cpus_[task->cpu_];
+
+    if (task == q.current) {
+        // 他の CPU から Sleep されたがまだキューの先頭に残っている
+        task->SetRunning(true);
+        Trace(TraceEvent::kWakeup, task->ID(), task->Level());
+        ChangeLevelRunning(task, level);
+        return;
+    }
+
     if (level < 0) {
         level = task->Level();
     }
 
     task->SetLevel(level);
     task->SetRunning(true);
+    Trace(TraceEvent::kWakeup, task->ID(), level);
 
-    running_[level].push_back(task);
+    q.running[level].push_back(task);
     // 現在実行中のタスクより高いレベルのタスクを追加したため
     // 次回のSwitchTask()時にレベルを見直すようにする
-    if (level > current_level_) {
-        level_changed_ = true;
+    if (level > q.current_level) {
+        q.level_changed = true;
     }
-    return;
+    // アイドル中の CPU は MWAIT でこの書き込みを待っている
+    q.wake_seq.fetch_add(1, std::memory_order_release);
 }
 
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-                        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    Task* task = FindTaskLocked(id);
+    if (task) {
+        WakeupLocked(task, level);
     }
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 
-    Wakeup(it->get(), level);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-                        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    Task* task = FindTaskLocked(id);
+    if (task) {
+        // Reset も lock_ の中で行われるので，積んだメッセージが次の持ち主に渡ることはない
+        Trace(TraceEvent::kSendMessage, id, msg.type);
+        task->msgs_.Push(msg);
+        WakeupLocked(task, -1);
     }
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 
-    (*it)->SendMessage(msg);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Task& TaskManager::CurrentTask() {
-    return *running_[current_level_].front();
+    // CPU 番号を読んでから current を読むまでに別のタスクに切り替わらないようにする
+    const bool intr = DisableInterrupts();
+    Task* task = cpus_[CurrentCPU()].current;
+    RestoreInterrupts(intr);
+    return *task;
+}
+
+void TaskManager::RegisterCPU(int cpu) {
+    Task& idle = NewTask()
+        .SetLevel(0)
+        .SetRunning(true);
+
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    auto& q = cpus_[cpu];
+    idle.cpu_ = cpu;
+    q.running[0].push_back(&idle);
+    q.current_level = 0;
+    q.current = &idle;
+    q.fpu_owner = &idle;
+    online_[cpu] = true;
+    lock_.Unlock();
+    RestoreInterrupts(intr);
+}
+
+void TaskManager::Idle() {
+    DisableInterrupts();
+    lock_.Lock();
+    const int cpu = CurrentCPU();
+    auto& q = cpus_[cpu];
+    if (RunnableTasks(cpu) > 0 || StealTask(cpu)) {
+        Task* current_task = RotateCurrentRunQueue(cpu, false);
+        Trace(TraceEvent::kSwitch, q.current->ID(), current_task->ID());
+        PMUSwitch(current_task->pmu_, q.current->pmu_);
+        SetFPUTrap(q, q.fpu_owner != q.current);
+        SwitchContext(&q.current->Context(), &current_task->Context(),
+                      &lock_, q.switch_stack.end());
+        return;
+    }
+    // lock_ の解放後に積まれたタスクは wake_seq の変化で検出する
+    const uint32_t wake = q.wake_seq.load(std::memory_order_acquire);
+    lock_.Unlock();
+    CPUIdle(q.wake_seq, wake);
+}
+
+TaskManager::CPUStats TaskManager::Stats(int cpu) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    const auto& q = cpus_[cpu];
+    CPUStats stats{online_[cpu], q.current_level, RunnableTasks(cpu), q.steals};
+    lock_.Unlock();
+    RestoreInterrupts(intr);
+    return stats;
+}
+
+void TaskManager::EnterInterrupt() {
+    auto& q = cpus_[CurrentCPU()];
+    q.in_interrupt = true;
+    SetFPUTrap(q, true);
+}
+
+void TaskManager::LeaveInterrupt() {
+    auto& q = cpus_[CurrentCPU()];
+    q.in_interrupt = false;
+    SetFPUTrap(q, q.fpu_owner != q.current);
+}
+
+void* TaskManager::SwitchFPU(const void* live_state) {
+    auto& q = cpus_[CurrentCPU()];
+    q.fpu_trap = false; // IntHandlerNM が clts 済み
+
+    if (q.fpu_owner != nullptr) {
+        memcpy(q.fpu_owner->context_.fxsave_area.data(), live_state,
+               sizeof(TaskContext::fxsave_area));
+    }
+
+    // 割り込みハンドラ内で使われた場合は，レジスタを誰のものでもない状態にしておく
+    if (q.in_interrupt) {
+        q.fpu_owner = nullptr;
+        return nullptr;
+    }
+
+    q.fpu_owner = q.current;
+    return q.current->context_.fxsave_area.data();
+}
+
+void TaskManager::SetFPUTrap(CPURunQueue& q, bool trap) {
+    // CR0 への書き込みは重いので，状態が変わるときだけ書く
+    if (q.fpu_trap == trap) {
+        return;
+    }
+    q.fpu_trap = trap;
+    const uint64_t cr0 = GetCR0();
+    SetCR0(trap ? (cr0 | kCR0TaskSwitched) : (cr0 & ~kCR0TaskSwitched));
+}
+
+void TaskManager::Exit() {
+    // ファイル記述子は閉じるときに先読みの完了を待つことがあるので，自分のタスクのうちに閉じる
+    CurrentTask().files_.clear();
+
+    DisableInterrupts();
+    lock_.Lock();
+    const int cpu = CurrentCPU();
+    auto& q = cpus_[cpu];
+    Task* task = q.current;
+    task->exited_ = true;
+    task->SetRunning(false);
+    Trace(TraceEvent::kSleep, task->ID());
+    // 保存されていない FPU 状態は捨てる。タスクは移動されていないので，この CPU 以外の持ち主にはなっていない。
+    if (q.fpu_owner == task) {
+        q.fpu_owner = nullptr;
+    }
+    exited_.push_back(task);
+    reaper_->msgs_.Push(Message{Message::kTaskExited});
+    WakeupLocked(reaper_, -1);
+
+    Task* current_task = RotateCurrentRunQueue(cpu, true);
+    Trace(TraceEvent::kSwitch, q.current->ID(), current_task->ID());
+    PMUSwitch(current_task->pmu_, q.current->pmu_);
+    SetFPUTrap(q, q.fpu_owner != q.current);
+    // コンテキストの保存が終わって lock_ が解放されるまで，回収タスクはこのスタックを再利用しない
+    SwitchContext(&q.current->Context(), &current_task->Context(),
+                  &lock_, q.switch_stack.end());
+    while (true) __asm__("hlt");
+}
+
+void TaskManager::ReapExitedTasks() {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
+    for (Task* task : exited_) {
+        ReleaseSlot(task);
+    }
+    exited_.clear();
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 }
 
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
@@ -187,53 +537,166 @@ void TaskManager::ChangeLevelRunning(Task* task, int level) {
         return;
     }
 
-    if (task != running_[current_level_].front()) {
+    auto& q = cpus_[task->cpu_];
+    if (task != q.current) {
         // change level of other task
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
+        Erase(q.running[task->Level()], task);
+        q.running[level].push_back(task);
         task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
+        if (level > q.current_level) {
+            q.level_changed = true;
         }
         return;
     }
 
     // change level myself
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
+    q.running[q.current_level].pop_front();
+    q.running[level].push_front(task);
     task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
+    if (level >= q.current_level) {
+        q.current_level = level;
     } else {
-        current_level_ = level;
-        level_changed_ = true;
+        q.current_level = level;
+        q.level_changed = true;
     }
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-    auto& level_queue = running_[current_level_];
+Task* TaskManager::RotateCurrentRunQueue(int cpu, bool current_sleep) {
+    auto& q = cpus_[cpu];
+    auto& level_queue = q.running[q.current_level];
     Task* current_task = level_queue.front();
     level_queue.pop_front();
-    if (!current_sleep) {
+    current_task->last_run_tsc_ = ReadTSC();
+    // 他の CPU から Sleep されたタスクはここでキューから外れる
+    if (!current_sleep && current_task->Running()) {
         level_queue.push_back(current_task);
     }
     if (level_queue.empty()) {
-        level_changed_ = true;
+        q.level_changed = true;
+    }
+
+    // アイドルタスクしか残っていなければ，他の CPU で待っているタスクをもらう
+    if (RunnableTasks(cpu) == 0) {
+        StealTask(cpu);
     }
 
-    if (level_changed_) {
-        level_changed_ = false;
+    if (q.level_changed) {
+        q.level_changed = false;
         for (int lv = kMaxLevel; lv >= 0; --lv) {
-        if (!running_[lv].empty()) {
-            current_level_ = lv;
+        if (!q.running[lv].empty()) {
+            q.current_level = lv;
             break;
         }
         }
     }
 
+    q.current = q.running[q.current_level].front();
     return current_task;
 }
 
+int TaskManager::LeastLoadedCPU() const {
+    int best_cpu = 0;
+    size_t best_load = std::numeric_limits<size_t>::max();
+    for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+        if (!online_[cpu]) {
+            continue;
+        }
+        const size_t load = RunnableTasks(cpu);
+        if (load < best_load) {
+            best_cpu = cpu;
+            best_load = load;
+        }
+    }
+    return best_cpu;
+}
+
+size_t TaskManager::RunnableTasks(int cpu) const {
+    // レベル 0 はアイドルタスクしかいないので数えない
+    size_t n = 0;
+    for (int lv = 1; lv <= kMaxLevel; ++lv) {
+        n += cpus_[cpu].running[lv].size();
+    }
+    return n;
+}
+
+bool TaskManager::StealTask(int thief) {
+    // 実行を待っている（実行中でない）タスクが最も多い CPU から奪う
+    int victim = -1;
+    size_t max_waiting = 0;
+    for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+        if (cpu == thief || !online_[cpu]) {
+            continue;
+        }
+        size_t waiting = RunnableTasks(cpu);
+        if (cpus_[cpu].current->Level() > 0) {
+            --waiting;
+        }
+        if (waiting > max_waiting) {
+            victim = cpu;
+            max_waiting = waiting;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+
+    // 高いレベルから順に，各キューの末尾（次に実行されるまで最も長く待つもの）を選ぶ。
+    // 待ちが 1 つしかないときは，キャッシュが温かいタスクは元の CPU に残す。
+    auto& vq = cpus_[victim];
+    const uint64_t now = ReadTSC();
+    const uint64_t hot_tsc = tsc_freq / kCacheHotDivisor;
+    Task* task = nullptr;
+    for (int lv = kMaxLevel; lv >= 1 && task == nullptr; --lv) {
+        const auto& queue = vq.running[lv];
+        for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+            // 実行中のタスクと，FPU の状態がまだ victim のレジスタにしかないタスクは奪えない
+            if (*it == vq.current || *it == vq.fpu_owner) {
+                continue;
+            }
+            if (max_waiting < 2 && now - (*it)->last_run_tsc_ < hot_tsc) {
+                continue;
+            }
+            task = *it;
+            break;
+        }
+    }
+    if (task == nullptr) {
+        return false;
+    }
+
+    Erase(vq.running[task->Level()], task);
+    task->cpu_ = thief;
+    ++task->migrations_;
+
+    auto& q = cpus_[thief];
+    q.running[task->Level()].push_back(task);
+    q.level_changed = true;
+    ++q.steals;
+    return true;
+}
+
+Task* TaskManager::FindTaskLocked(uint64_t id) {
+    const uint32_t index = id & 0xffffffffu;
+    if (index == 0 || index >= num_slots_used_) {
+        return nullptr;
+    }
+    Task* task = slots_[index].task.get();
+    if (task != nullptr && task->ID() != id) {
+        return nullptr;
+    }
+    return task;
+}
+
+void TaskManager::ReleaseSlot(Task* task) {
+    const uint32_t index = task->ID() & 0xffffffffu;
+    auto& slot = slots_[index];
+    // オブジェクトはスタックやメッセージキューごと次の NewTask で再利用する。
+    // ID を無効値にしておけば，古い ID での FindTaskLocked は失敗する。
+    task->id_ = 0;
+    ++slot.generation;
+    free_slots_.push_back(index);
+}
+
 TaskManager* task_manager;
 
 void InitializeTask() {
@@ -248,4 +711,8 @@ void InitializeTask() {
 __attribute__((no_caller_saved_registers))
 extern "C" uint64_t GetCurrentTaskOSStackPointer() {
     return task_manager->CurrentTask().OSStackPointer();
-}
\ No newline at end of file
+}
+
+extern "C" void* DeviceNotAvailable(const void* live_state) {
+    return task_manager->SwitchFPU(live_state);
+}
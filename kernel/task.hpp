@@ -7,15 +7,22 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <deque> 
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include "error.hpp"
+#include "file.hpp"
 #include "message.hpp"
+#include "message_queue.hpp"
+#include "pmu.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -32,10 +39,12 @@ class TaskManager;
 class Task {
 public:
   static const int kDefaultLevel = 1;
-  static const size_t kDefaultStackBytes = 4096;
+  static const size_t kDefaultStackBytes = 16 * 1024;
 
   Task(uint64_t id);
-  Task& InitContext(TaskFunc* f, int64_t data);
+  ~Task();
+  /** @brief stack_bytes のカーネルスタックを割り当て，f(id, data) から実行を始めるよう設定する。 */
+  Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
   TaskContext& Context();
   uint64_t& OSStackPointer();
   uint64_t ID() const;
@@ -43,20 +52,51 @@ public:
   Task& Wakeup();
   void SendMessage(const Message& msg);
   std::optional<Message> ReceiveMessage();
+  /** @brief match(msg, arg) が真になるメッセージが届くまで眠って待ち，それを返す。
+   *
+   * 待つ間に届いた他のメッセージは届いた順に取っておき，以降の ReceiveMessage で先に返す。
+   */
+  Message WaitMessage(bool (*match)(const Message& msg, const void* arg), const void* arg);
+  /// @brief キューが満杯で捨てられたメッセージの累計
+  uint64_t DroppedMessages() const { return msgs_.Overflows(); }
 
   int Level() const { return level_; }
   bool Running() const { return running_; }
+  /// @brief 所属する実行キューの CPU 番号。まだ一度も起床していなければ -1
+  int CPU() const { return cpu_; }
+  /// @brief 負荷分散で他の CPU へ移された回数
+  uint64_t Migrations() const { return migrations_; }
+  /// @brief 性能モニタリングカウンタの計測状態
+  PMUState& PMU() { return pmu_; }
+  /// @brief アプリが開いたファイル。添字がファイル記述子で，0〜2 は端末用に空けておく
+  std::vector<std::shared_ptr<::FileDescriptor>>& Files() { return files_; }
+  /// @brief MapFile で割り当てた仮想アドレスの範囲
+  std::vector<FileMapping>& FileMaps() { return file_maps_; }
 private:
   uint64_t id_;
-  std::vector<uint64_t> stack_;
+  uint64_t stack_end_{0}; // kernel_stack.hpp のスタック。0 なら未割り当て
+  size_t stack_bytes_{0};
   alignas(16) TaskContext context_;
   uint64_t os_stack_ptr_;
-  std::deque<Message> msgs_;
+  MessageQueue msgs_;
+  std::deque<Message> deferred_{}; // WaitMessage が取っておいたメッセージ。このタスクだけが触る
   unsigned int level_{kDefaultLevel};
   bool running_{false};
+  int cpu_{-1};
+  uint64_t last_run_tsc_{0}; // 最後に CPU を明け渡した時刻。キャッシュがまだ温かいかの目安
+  uint64_t migrations_{0};
+  PMUState pmu_{};
+  bool exited_{false};
+  std::vector<std::shared_ptr<::FileDescriptor>> files_{};
+  std::vector<FileMapping> file_maps_{};
 
   Task& SetLevel(const int level) { level_ = level; return *this;}
   Task& SetRunning(const bool running) { running_ = running; return *this;}
+  /** @brief 終了したタスクのオブジェクトを新しい ID のタスクとして再利用できる状態に戻す。
+   *
+   * スタックは解放せずに残し，同じ大きさで InitContext されたらそのまま使う。
+   */
+  void Reset(uint64_t id);
 
   friend TaskManager;
 };
@@ -65,6 +105,8 @@ class TaskManager {
 public:
   // level: 0 = lowest, kMaxLevel = highest
   static const int kMaxLevel = 3;
+  // タスク表のスロット数。タスク ID の下位 32 ビットがスロット番号になる。
+  static const size_t kMaxTasks = 1024;
   TaskManager();
   Task& NewTask();
   void SwitchTask(const TaskContext& current_ctx);
@@ -76,15 +118,107 @@ public:
   Error SendMessage(uint64_t id, const Message& msg);
   Task& CurrentTask();
 
-private:
-  std::vector<std::unique_ptr<Task>> tasks_{};
-  uint64_t latest_id_{0};
-  std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  /** @brief 呼び出した CPU を実行キューに加える。
+   *
+   * AP の起動処理から呼ぶ。呼び出し元の処理の流れがその CPU のアイドルタスク（レベル 0）になる。
+   */
+  void RegisterCPU(int cpu);
+
+  /** @brief アイドルタスクの本体
+   *
+   * 自分か他の CPU に実行待ちのタスクがあれば切り替え，なければ CPUIdle で止まる。
+   */
+  void Idle();
+
+  struct CPUStats {
+    bool online;
+    int current_level;
+    size_t runnable; // レベル 1 以上の実行可能タスク数（実行中のものを含む）
+    uint64_t steals; // この CPU が他の CPU から奪ったタスク数
+  };
+  CPUStats Stats(int cpu);
+
+  /** @brief 割り込みハンドラの先頭で呼ぶ。
+   *
+   * ハンドラ内の FPU/SSE 命令が実行中タスクのレジスタを壊さないよう CR0.TS を立てる。
+   */
+  void EnterInterrupt();
+  /** @brief タスクを切り替えずに割り込みから戻る直前に呼ぶ。これ以降 FPU/SSE 命令を使ってはならない。 */
+  void LeaveInterrupt();
+  /** @brief #NM 例外の処理本体
+   *
+   * @param live_state  例外発生時の FPU レジスタを fxsave した領域
+   * @return  FPU レジスタへ fxrstor すべき領域。復帰が不要なら nullptr
+   */
+  void* SwitchFPU(const void* live_state);
+
+  /** @brief 呼び出したタスクを終了する。この関数からは戻らない。
+   *
+   * タスクは実行キューから外され，スロットとスタックの回収は回収タスクが後で行う。
+   * 終了したタスクのスタック上にあるオブジェクトのデストラクタは呼ばれないので，
+   * 解放すべき資源は呼び出す前に解放しておくこと。
+   */
+  [[noreturn]] void Exit();
+  /** @brief 終了したタスクのスロットを回収する。回収タスクから呼ぶ。 */
+  void ReapExitedTasks();
 
+private:
+  /** @brief タスク表の 1 要素
+   *
+   * generation はスロットが再利用されるたびに増え，タスク ID の上位 32 ビットになる。
+   * 終了したタスクの古い ID を使ってもスロットの新しい持ち主には届かない。
+   */
+  struct TaskSlot {
+    std::unique_ptr<Task> task;
+    uint32_t generation;
+  };
+
+  std::array<TaskSlot, kMaxTasks> slots_{};
+  size_t num_slots_used_{1}; // スロット 0 は ID 0 を無効値とするため使わない
+  std::vector<uint32_t> free_slots_{};
+
+  /** @brief CPU ごとの実行キュー
+   *
+   * running[current_level] の先頭がその CPU で実行中のタスクで，current にも同じものを保持する。
+   * 他の CPU からも操作されるので，current 以外は lock_ を取ってから読み書きする。
+   */
+  struct CPURunQueue {
+    std::array<std::deque<Task*>, kMaxLevel + 1> running{};
+    int current_level{kMaxLevel};
+    bool level_changed{false};
+    Task* current{nullptr};
+    uint64_t steals{0};
+    // FPU/SSE レジスタに状態が載っているタスク。他のタスクが使おうとした時点（#NM）で保存する。
+    Task* fpu_owner{nullptr};
+    bool fpu_trap{false}; // CR0.TS を立てているか
+    bool in_interrupt{false};
+    // タスクを積むたびに増やす。アイドル中の CPU はこれを MONITOR して待つ。
+    std::atomic<uint32_t> wake_seq{0};
+    // SwitchContext が切り替え途中に使うスタック。
+    // 元のタスクのスタックは lock_ 解放後に他の CPU で使われ得るため使えない。
+    alignas(16) std::array<uint64_t, 32> switch_stack{};
+  };
+
+  std::array<CPURunQueue, kMaxCPUs> cpus_{};
+  std::array<bool, kMaxCPUs> online_{};
+  // スロット表とすべての実行キューを保護する。割り込み禁止状態で取得すること。
+  Spinlock lock_;
+  // 終了して回収を待っているタスク
+  std::vector<Task*> exited_{};
+  Task* reaper_{nullptr};
+
+  /** @brief lock_ を取った状態で呼ぶ。lock_ を解放し，割り込みを intr に戻してから戻る。 */
+  void SleepLocked(Task* task, bool intr);
+  void WakeupLocked(Task* task, int level);
   void ChangeLevelRunning(Task* task, int level);
-  Task* RotateCurrentRunQueue(bool current_sleep);
+  Task* RotateCurrentRunQueue(int cpu, bool current_sleep);
+  int LeastLoadedCPU() const;
+  size_t RunnableTasks(int cpu) const;
+  bool StealTask(int thief);
+  void SetFPUTrap(CPURunQueue& q, bool trap);
+  /** @brief ID が id のタスクを探す。lock_ を取った状態で呼び，使い終えるまで lock_ を保つこと。 */
+  Task* FindTaskLocked(uint64_t id);
+  void ReleaseSlot(Task* task);
 };
 
 extern TaskManager* task_manager;
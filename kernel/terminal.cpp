@@ -10,8 +10,25 @@
 #include "elf.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
+#include "clock.hpp"
+#include "trace.hpp"
+#include "profile.hpp"
+#include "idle.hpp"
+#include "volume_cache.hpp"
+#include "boot_profile.hpp"
 
 namespace {
+    /** @brief 0 でないビンだけを「下限(us):件数」の形で並べる */
+    void FormatHistogram(char* s, const char* label, const uint32_t* hist) {
+        s += sprintf(s, "  %s", label);
+        for (int i = 0; i < kTraceHistBuckets; ++i) {
+            if (hist[i] != 0) {
+                s += sprintf(s, " %lu:%u", i == 0 ? 0ul : 1ul << i, hist[i]);
+            }
+        }
+        strcpy(s, "\n");
+    }
+
     WithError<int> MakeArgVector(char* command, char* first_arg,
         char** argv, int argv_len, char* argbuf, int argbuf_len) {
         int argc = 0;
@@ -77,77 +94,6 @@ namespace {
         return 0;
     }
 
-    static_assert(kBytesPerFrame >= 4096);
-
-    WithError<PageMapEntry*> NewPageMap() {
-        auto frame = memory_manager->Allocate(1);
-        if (frame.error) {
-            return {nullptr, frame.error};
-        }
-
-        auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-        memset(e, 0, sizeof(uint64_t) * 512);
-        return {e, MAKE_ERROR(Error::kSuccess)};
-    }
-
-    WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
-        if (entry.bits.present) {
-            return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
-        }
-
-        auto [child_map, err] = NewPageMap();
-        if (err) {
-            return {nullptr, err};
-        }
-
-        entry.SetPointer(child_map);
-        entry.bits.present = 1;
-
-        return {child_map, MAKE_ERROR(Error::kSuccess)};
-    }
-
-    WithError<size_t> SetupPageMap(
-        PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages
-    ) {
-        while (num_4kpages > 0) {
-            const auto entry_index = addr.Part(page_map_level);
-
-            auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-            if (err) {
-                return {num_4kpages, err};
-            }
-            page_map[entry_index].bits.writable = 1;
-            page_map[entry_index].bits.user = 1;
-
-            if (page_map_level == 1) {
-                --num_4kpages;
-            } else {
-                auto [ num_remain_pages, err ] = 
-                    SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages);
-                if (err) {
-                    return {num_4kpages, err};
-                }
-                num_4kpages = num_remain_pages;
-            }
-
-            if (entry_index == 511) {
-                break;
-            }
-
-            addr.SetPart(page_map_level, entry_index + 1);
-            for (int level = page_map_level - 1; level >= 1; --level) {
-                addr.SetPart(level, 0);
-            }
-        }
-
-        return { num_4kpages, MAKE_ERROR(Error::kSuccess)};
-    }
-
-    Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages) {
-        auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-        return SetupPageMap(pml4_table, 4, addr, num_4kpages).error;
-    }
-
     Error CopyLoadSegments(Elf64_Ehdr* ehdr) {
         auto phdr = GetProgramHeader(ehdr);
         for (int i = 0; i < ehdr->e_phnum; ++i) {
@@ -186,42 +132,6 @@ namespace {
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    Error CleanPageMap(PageMapEntry* page_map, int page_map_level) {
-        for (int i = 0; i < 512; ++i) {
-            auto entry = page_map[i];
-            if (!entry.bits.present) {
-                continue;
-            }
-            if (page_map_level > 1) {
-                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1)) {
-                    return err;
-                }
-            }
-
-            const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-            const FrameID map_frame{entry_addr / kBytesPerFrame};
-            if (auto err = memory_manager->Free(map_frame, 1)) {
-                return err;
-            }
-            page_map[i].data = 0;
-        }
-
-        return MAKE_ERROR(Error::kSuccess);
-    }
-
-    Error CleanPageMaps(LinearAddress4Level addr) {
-        auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-        auto pdp_table = pml4_table[addr.parts.pml4].Pointer();
-        pml4_table[addr.parts.pml4].data = 0;
-        if (auto err = CleanPageMap(pdp_table, 3)) {
-            return err;
-        }
-
-        const auto pdp_addr = reinterpret_cast<uintptr_t>(pdp_table);
-        const FrameID pdp_frame{pdp_addr / kBytesPerFrame};
-        return memory_manager->Free(pdp_frame, 1);
-    }
-
 } // namespace
 
 Terminal::Terminal(uint64_t task_id) : task_id_{task_id}{
@@ -335,43 +245,131 @@ void Terminal::ExecuteLine() {
             Print(first_arg);
         }
         Print("\n");
+    } else if (strcmp(command, "exit") == 0) {
+        exit_requested_ = true;
+    } else if (strcmp(command, "term") == 0) {
+        task_manager->NewTask()
+            .InitContext(TaskTerminal, 0)
+            .Wakeup();
     } else if (strcmp(command, "clear") == 0) {
         FillRectangle(*window_->InnerWriter(),
                 {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
         cursor_.y = 0;
     } else if (strcmp(command, "lspci") == 0) {
         char s[64];
-        for (int i = 0; i < pci::num_device; ++i) {
-            const auto& dev = pci::devices[i];
-            auto vendor_id = pci::ReadVendorId(dev.bus, dev.device, dev.function);
+        for (const auto& dev : pci::devices) {
             sprintf(s, "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x\n",
-                dev.bus, dev.device, dev.function, vendor_id, dev.header_type,
+                dev.bus, dev.device, dev.function, dev.vendor_id, dev.header_type,
                 dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
             Print(s);
         }
-    } else if (strcmp(command, "ls") == 0) {
-        auto root_dir_entries = fat::GetSectorByCluster<fat::DirectoryEntry>(
-            fat::boot_volume_image->root_cluster);
-        auto entries_per_cluster = 
-            fat::bytes_per_cluster / sizeof(fat::DirectoryEntry);
-        char base[9], ext[4];
+    } else if (strcmp(command, "sched") == 0) {
         char s[64];
-        for (int i = 0; i < entries_per_cluster; ++i) {
-            ReadName(root_dir_entries[i], base, ext);
-            if (base[0] == 0x00) {
-                break;
-            } else if (static_cast<uint8_t>(base[0]) == 0xe5) {
-                continue;
-            } else if (root_dir_entries[i].attr == fat::Attribute::kLongName) {
+        for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+            const auto stats = task_manager->Stats(cpu);
+            if (!stats.online) {
                 continue;
             }
-
-            if (ext[0]) {
-                sprintf(s, "%s.%s\n", base, ext);
-            } else {
-                sprintf(s, "%s\n", base);
+            sprintf(s, "cpu%d level=%d runnable=%lu steals=%lu\n",
+                cpu, stats.current_level, stats.runnable, stats.steals);
+            Print(s);
+        }
+        sprintf(s, "this task migrated %lu times\n",
+            task_manager->CurrentTask().Migrations());
+        Print(s);
+    } else if (strcmp(command, "idle") == 0) {
+        if (first_arg && strcmp(first_arg, "reset") == 0) {
+            ResetIdleStats();
+        } else {
+            char s[80];
+            sprintf(s, "idle with %s\n", MWaitAvailable() ? "mwait" : "hlt");
+            Print(s);
+            for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+                if (!task_manager->Stats(cpu).online) {
+                    continue;
+                }
+                const auto stats = GetIdleStats(cpu);
+                const uint64_t permille = stats.total_tsc ?
+                    stats.idle_tsc * 1000 / stats.total_tsc : 0;
+                sprintf(s, "cpu%d idle=%lu.%lu%% entries=%lu deep=%lu\n",
+                    cpu, permille / 10, permille % 10, stats.entries, stats.deep_entries);
+                Print(s);
             }
+        }
+    } else if (strcmp(command, "bootprof") == 0) {
+        for (const auto& line : FormatBootProfile()) {
+            Print(line.c_str());
+            Print("\n");
+        }
+    } else if (strcmp(command, "sync") == 0) {
+        char s[128];
+        if (auto err = FlushVolume()) {
+            sprintf(s, "sync failed: %s\n", err.Name());
+            Print(s);
+        }
+        const auto stats = GetVolumeCacheStats();
+        sprintf(s, "resident=%lu faults=%lu prefetched=%lu (refaulted %lu) evictions=%lu flushed=%lu\n",
+                stats.resident_pages, stats.faults, stats.prefetched_pages,
+                stats.faults_on_prefetching, stats.evictions, stats.flushed_sectors);
+        Print(s);
+    } else if (strcmp(command, "trace") == 0) {
+        if (first_arg && strcmp(first_arg, "on") == 0) {
+            ClearTrace();
+            trace_enabled = true;
+        } else if (first_arg && strcmp(first_arg, "off") == 0) {
+            trace_enabled = false;
+        } else {
+            const auto summary = SummarizeTrace(CollectTrace());
+            char s[320]; // 全 16 ビンが埋まっても収まる大きさ
+            sprintf(s, "preempt=%lu switch=%lu wakeup=%lu msg=%lu syscall=%lu\n",
+                summary.preempts, summary.switches, summary.wakeups,
+                summary.messages, summary.syscalls);
             Print(s);
+            for (const auto& t : summary.tasks) {
+                sprintf(s, "task %lu:%lu\n", t.task >> 32, t.task & 0xffffffffu);
+                Print(s);
+                FormatHistogram(s, "wakeup(us)", t.wakeup_latency);
+                Print(s);
+                FormatHistogram(s, "run(us)", t.run_time);
+                Print(s);
+            }
+        }
+    } else if (strcmp(command, "prof") == 0) {
+        if (first_arg && strcmp(first_arg, "on") == 0) {
+            StartProfile();
+        } else if (first_arg && strcmp(first_arg, "off") == 0) {
+            StopProfile();
+        } else {
+            for (const auto& line : FoldProfile()) {
+                Print(line.c_str());
+                Print('\n');
+            }
+        }
+    } else if (strcmp(command, "ls") == 0) {
+        unsigned long dir_cluster = 0;
+        if (first_arg && first_arg[0]) {
+            auto dir_entry = fat::FindFile(first_arg);
+            if (dir_entry == nullptr) {
+                Print("no such file or directory: ");
+                Print(first_arg);
+                Print("\n");
+                return;
+            } else if ((static_cast<uint8_t>(dir_entry->attr) &
+                        static_cast<uint8_t>(fat::Attribute::kDirectory)) == 0) {
+                Print(first_arg);
+                Print("\n");
+                return;
+            }
+            dir_cluster = dir_entry->FirstCluster();
+        }
+
+        for (const auto& [ entry, name ] : fat::ListDirectory(dir_cluster)) {
+            Print(name.c_str());
+            if (static_cast<uint8_t>(entry->attr) &
+                static_cast<uint8_t>(fat::Attribute::kDirectory)) {
+                Print('/');
+            }
+            Print('\n');
         }
     } else if (strcmp(command, "cat") == 0) {
         char s[64];
@@ -380,19 +378,15 @@ void Terminal::ExecuteLine() {
             sprintf(s, "no such file: %s\n", first_arg);
             Print(s);
         } else {
-            auto cluster = file_entry->FirstCluster();
-            auto remain_bytes = file_entry->file_size;
+            const fat::ExtentMap extents{*file_entry};
+            size_t offset = 0, len;
 
             DrawCursor(false);
-            while (cluster != 0 && cluster != fat::kEndOfClusterchain) {
-                char* p = fat::GetSectorByCluster<char>(cluster);
-                int i = 0;
-                for (; i < fat::bytes_per_cluster && i < remain_bytes; ++i) {
-                    Print(*p);
-                    ++p;
+            while (auto p = extents.Locate(offset, len)) {
+                for (size_t i = 0; i < len; ++i) {
+                    Print(static_cast<char>(p[i]));
                 }
-                remain_bytes -= i;
-                cluster = fat::NextCluster(cluster);
+                offset += len;
             }
             DrawCursor(true);
         }
@@ -445,14 +439,29 @@ Error Terminal::ExecuteFile(const fat::DirectoryEntry& file_entry, char* command
         return err;
     }
 
+    if (auto err = MapClockPage()) {
+        return err;
+    }
+
     __asm__("cli");
     auto& task = task_manager->CurrentTask();
     __asm__("sti");
 
     auto entry_addr = elf_header->e_entry;
+    SetProfileImage(task.ID(), command);
     int ret = CallApp(argc.value, argv, 3 << 3 | 3, entry_addr, 
             stack_frame_addr.value + 4096 - 8,
             &task.OSStackPointer());
+    SetProfileImage(task.ID(), nullptr);
+
+    task.Files().clear();
+    if (auto err = UnmapFiles(task)) {
+        return err;
+    }
+    // アプリが書いたファイルをデバイスへ反映する
+    if (auto err = FlushVolume()) {
+        return err;
+    }
     
     char s[64];
     sprintf(s, "app exited, ret = %d\n", ret);
@@ -516,9 +525,7 @@ void Terminal::Print(const char* s, std::optional<size_t> len) {
 
     Message msg = MakeLayerMessage(
         task_id_, LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
     task_manager->SendMessage(1, msg);
-    __asm__("sti");
 }
 
 
@@ -551,14 +558,15 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
 std::map<uint64_t, Terminal*>* terminals;
  
 void TaskTerminal(uint64_t task_id, int64_t data) {
-    __asm__("cli");
     Task& task = task_manager->CurrentTask();
     Terminal* terminal = new Terminal{task_id};
+    layer_lock.Lock();
     layer_manager->Move(terminal->LayerID(), {100, 200});
     active_layer->Activate(terminal->LayerID());
     layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
     (*terminals)[task_id] = terminal;
-    __asm__("sti");
+    layer_lock.Unlock();
+    FinishBootProfile("terminal prompt"); // 最初のターミナルだけが記録する
 
     while (true) {
         __asm__("cli");
@@ -576,9 +584,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
                 const auto area = terminal->BlinkCursor();
                 Message msg = MakeLayerMessage(
                     task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                __asm__("cli");
                 task_manager->SendMessage(1, msg);
-                __asm__("sti");
             }
             break;
         case Message::kKeyPush:
@@ -588,13 +594,29 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
                                                      msg->arg.keyboard.ascii);
                 Message msg = MakeLayerMessage(
                     task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                __asm__("cli");
                 task_manager->SendMessage(1, msg);
-                __asm__("sti");
             }
             break;
         default:
             break;
         }
+
+        if (terminal->ExitRequested()) {
+            break;
+        }
     }
+
+    layer_lock.Lock();
+    terminals->erase(task_id);
+    layer_task_map->erase(terminal->LayerID());
+    const auto layer = layer_manager->FindLayer(terminal->LayerID());
+    const Rectangle<int> area{layer->GetPosition(), layer->GetWindow()->Size()};
+    layer_lock.Unlock();
+
+    active_layer->Activate(0);
+    layer_manager->RemoveLayer(terminal->LayerID());
+    layer_manager->Draw(area);
+
+    delete terminal;
+    task_manager->Exit();
 }
\ No newline at end of file
@@ -23,10 +23,13 @@ public:
     Rectangle<int> BlinkCursor();
     Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
     void Print(const char* s, std::optional<size_t> len = std::nullopt);
+    /** @brief exit コマンドが実行されたら true */
+    bool ExitRequested() const { return exit_requested_; }
 private:
     std::shared_ptr<ToplevelWindow> window_;
     unsigned int layer_id_;
     uint64_t task_id_;
+    bool exit_requested_{false};
 
     Vector2D<int> cursor_{0, 0};
     bool cursor_visible_{false};
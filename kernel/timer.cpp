@@ -1,7 +1,14 @@
 #include "timer.hpp"
 
+#include <array>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "profile.hpp"
+#include "volume_cache.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
@@ -10,6 +17,46 @@ namespace {
     volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
     volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
     volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+    // AP はタイマ管理を BSP に任せ，タスク切り替えの周期だけを自分で数える
+    std::array<unsigned long, kMaxCPUs> ap_ticks{};
+
+    // 1 回の Tick で通知するタイムアウトの数の上限。残りは次の Tick で通知する。
+    const size_t kMaxTimeoutsPerTick = 16;
+}
+
+namespace {
+    /** @brief CPUID から TSC と LAPIC タイマの周波数を求める。分からなければどちらも 0 のまま。 */
+    void FrequenciesFromCPUID(unsigned long& tsc, unsigned long& lapic) {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx & (1u << 31)) {
+            // ハイパーバイザの情報リーフ 0x40000010 は EAX に TSC，EBX に LAPIC の周波数（kHz）を返す
+            CPUID(0x40000000, 0, &eax, &ebx, &ecx, &edx);
+            if (eax >= 0x40000010) {
+                CPUID(0x40000010, 0, &eax, &ebx, &ecx, &edx);
+                if (eax != 0 && ebx != 0) {
+                    tsc = static_cast<unsigned long>(eax) * 1000;
+                    lapic = static_cast<unsigned long>(ebx) * 1000;
+                    return;
+                }
+            }
+        }
+
+        // LAPIC タイマが水晶発振子のクロックで動くと言えるのは Intel の CPU だけ
+        CPUID(0, 0, &eax, &ebx, &ecx, &edx);
+        const bool intel = ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; // "GenuineIntel"
+        if (!intel || eax < 0x15) {
+            return;
+        }
+        // リーフ 0x15: TSC = 水晶発振子の周波数（ECX）* EBX / EAX。ECX が 0 なら分からない。
+        CPUID(0x15, 0, &eax, &ebx, &ecx, &edx);
+        if (eax == 0 || ebx == 0 || ecx == 0) {
+            return;
+        }
+        tsc = static_cast<unsigned long>(ecx) * ebx / eax;
+        lapic = ecx;
+    }
 }
 
 void InitializeLAPICTimer() {
@@ -18,13 +65,31 @@ void InitializeLAPICTimer() {
     divide_config = 0b1011; // divide 1:1
     lvt_timer = 0b001 << 16; // masked, one-shot
 
-    StartLAPICTimer();
-    acpi::WaitMilliseconds(100);
-    const auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
+    unsigned long tsc = 0, lapic = 0;
+    FrequenciesFromCPUID(tsc, lapic);
+    if (tsc != 0 && lapic != 0) {
+        tsc_freq = tsc;
+        lapic_timer_freq = lapic;
+    } else {
+        // LAPIC タイマと同じ 100 ミリ秒の区間で TSC の周波数も測定する
+        const auto tsc_start = ReadTSC();
+        StartLAPICTimer();
+        acpi::WaitMilliseconds(100);
+        const auto elapsed = LAPICTimerElapsed();
+        StopLAPICTimer();
+        const auto tsc_end = ReadTSC();
+
+        lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+        tsc_freq = (tsc_end - tsc_start) * 10;
+    }
+    Log(kInfo, "TSC %lu Hz, LAPIC timer %lu Hz\n", tsc_freq, lapic_timer_freq);
 
-    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    divide_config = 0b1011; // divide 1:1
+    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
+    initial_count = lapic_timer_freq / kTimerFreq;
+}
 
+void InitializeLAPICTimerForAP() {
     divide_config = 0b1011; // divide 1:1
     lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
     initial_count = lapic_timer_freq / kTimerFreq;
@@ -52,10 +117,19 @@ TimerManager::TimerManager() {
 }
 
 void TimerManager::AddTimer(const Timer& timer) {
+    const bool intr = DisableInterrupts();
+    lock_.Lock();
     timers_.push(timer);
+    lock_.Unlock();
+    RestoreInterrupts(intr);
 }
 
 bool TimerManager::Tick() {
+    // 送信はタスク管理のロックを取るので，タイマのロックを放してから行う
+    std::array<Message, kMaxTimeoutsPerTick> timeouts;
+    size_t num_timeouts = 0;
+
+    lock_.Lock();
     ++tick_;
 
     bool task_timer_timeout = false;
@@ -75,25 +149,46 @@ bool TimerManager::Tick() {
             continue;
         }
 
-        Message m{Message::kTimerTimeout};
+        if (num_timeouts == timeouts.size()) {
+            break;
+        }
+        Message& m = timeouts[num_timeouts++];
+        m = Message{Message::kTimerTimeout};
         m.arg.timer.timeout = t.Timeout();
         m.arg.timer.value = t.Value();
-        task_manager->SendMessage(1, m);
 
         timers_.pop();
     }
 
+    lock_.Unlock();
+
+    for (size_t i = 0; i < num_timeouts; ++i) {
+        task_manager->SendMessage(1, timeouts[i]);
+    }
     return task_timer_timeout;
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-    const bool task_timer_timeout = timer_manager->Tick();
+    task_manager->EnterInterrupt();
+    ProfileTick(ctx_stack);
+    VolumeTLBTick();
+    const int cpu = CurrentCPU();
+    bool task_timer_timeout;
+    if (cpu == 0) {
+        task_timer_timeout = timer_manager->Tick();
+    } else {
+        task_timer_timeout = ++ap_ticks[cpu] % kTaskTimerPeriod == 0;
+    }
     NotifyEndOfInterrupt();
 
+    // どちらも FPU の扱いを割り込み前の状態に戻してから返る
     if (task_timer_timeout) {
         task_manager->SwitchTask(ctx_stack);
+    } else {
+        task_manager->LeaveInterrupt();
     }
 }
\ No newline at end of file
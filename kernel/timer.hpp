@@ -5,8 +5,11 @@
 #include <vector>
 #include <limits>
 #include "message.hpp"
+#include "spinlock.hpp"
 
 void InitializeLAPICTimer();
+/** @brief AP の LAPIC タイマを BSP で測定した周波数を使って周期モードで起動する。 */
+void InitializeLAPICTimerForAP();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
@@ -36,10 +39,12 @@ public:
 private:
     volatile unsigned long tick_{0};
     std::priority_queue<Timer> timers_{};
+    Spinlock lock_; // AddTimer を呼ぶタスクが BSP 以外で動いていてもよいように
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+extern unsigned long tsc_freq;
 const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
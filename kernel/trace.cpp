@@ -0,0 +1,129 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <map>
+
+#include "asmfunc.h"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+volatile bool trace_enabled = false;
+
+namespace {
+    const size_t kTraceRecords = 2048; // CPU ごとの記録数（2 のべき乗）
+
+    /** @brief 1 つの CPU 専用のリングバッファ
+     *
+     * 書き込むのはその CPU だけだが，割り込みで入れ子になり得るので
+     * 書き込み位置は fetch_add で確保する。
+     */
+    struct TraceRing {
+        std::atomic<uint64_t> head{0};
+        std::array<TraceRecord, kTraceRecords> records;
+    };
+
+    std::array<TraceRing, kMaxCPUs> rings;
+}
+
+void TraceSlow(TraceEvent event, uint64_t task, uint64_t arg) {
+    const int cpu = CurrentCPU();
+    auto& ring = rings[cpu];
+    const uint64_t pos = ring.head.fetch_add(1, std::memory_order_relaxed);
+    auto& rec = ring.records[pos & (kTraceRecords - 1)];
+    rec.tsc = ReadTSC();
+    rec.task = task;
+    rec.arg = arg;
+    rec.event = event;
+    rec.cpu = cpu;
+}
+
+void ClearTrace() {
+    for (auto& ring : rings) {
+        ring.head.store(0);
+    }
+}
+
+std::vector<TraceRecord> CollectTrace() {
+    const bool enabled = trace_enabled;
+    trace_enabled = false;
+
+    std::vector<TraceRecord> result;
+    result.reserve(kMaxCPUs * kTraceRecords);
+    for (auto& ring : rings) {
+        const uint64_t head = ring.head.load();
+        const uint64_t n = std::min<uint64_t>(head, kTraceRecords);
+        for (uint64_t i = head - n; i < head; ++i) {
+            result.push_back(ring.records[i & (kTraceRecords - 1)]);
+        }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const TraceRecord& a, const TraceRecord& b) { return a.tsc < b.tsc; });
+
+    trace_enabled = enabled;
+    return result;
+}
+
+namespace {
+    int HistBucket(uint64_t tsc_delta) {
+        const uint64_t usec = tsc_freq ? tsc_delta * 1000'000 / tsc_freq : 0;
+        int bucket = usec < 2 ? 0 : 63 - __builtin_clzll(usec);
+        return std::min(bucket, kTraceHistBuckets - 1);
+    }
+
+    TaskTraceStats& StatsFor(std::vector<TaskTraceStats>& tasks, uint64_t task) {
+        for (auto& t : tasks) {
+            if (t.task == task) {
+                return t;
+            }
+        }
+        return tasks.emplace_back(TaskTraceStats{task, {}, {}});
+    }
+}
+
+TraceSummary SummarizeTrace(const std::vector<TraceRecord>& records) {
+    TraceSummary summary{};
+    // タスク ID ごとの，起床した時刻と実行を始めた時刻
+    std::map<uint64_t, uint64_t> woken_at, started_at;
+
+    for (const auto& rec : records) {
+        switch (rec.event) {
+        case TraceEvent::kPreempt:
+        case TraceEvent::kSwitch:
+            if (rec.event == TraceEvent::kPreempt) {
+                ++summary.preempts;
+            } else {
+                ++summary.switches;
+            }
+            if (auto it = woken_at.find(rec.task); it != woken_at.end()) {
+                ++StatsFor(summary.tasks, rec.task).wakeup_latency[HistBucket(rec.tsc - it->second)];
+                woken_at.erase(it);
+            }
+            if (auto it = started_at.find(rec.arg); it != started_at.end()) {
+                ++StatsFor(summary.tasks, rec.arg).run_time[HistBucket(rec.tsc - it->second)];
+                started_at.erase(it);
+            }
+            started_at[rec.task] = rec.tsc;
+            break;
+        case TraceEvent::kWakeup:
+            ++summary.wakeups;
+            woken_at.emplace(rec.task, rec.tsc);
+            break;
+        case TraceEvent::kSendMessage:
+            ++summary.messages;
+            break;
+        case TraceEvent::kSyscall:
+            ++summary.syscalls;
+            break;
+        case TraceEvent::kSleep:
+            break;
+        }
+    }
+    return summary;
+}
+
+extern "C" void TraceSyscall(uint32_t number) {
+    Trace(TraceEvent::kSyscall, task_manager->CurrentTask().ID(), number);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file trace.hpp
+ *
+ * スケジューラの動作を記録するトレース機能を集めたファイル。
+ *
+ * 記録は CPU ごとのリングバッファに固定長のバイナリで書き込む。
+ * バッファが一杯になると古い記録から上書きする。
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+enum class TraceEvent : uint16_t {
+    kPreempt,     // タイマ割り込みによる切り替え。task = 次のタスク, arg = 前のタスク
+    kSwitch,      // Sleep 等による自発的な切り替え。task, arg は kPreempt と同じ
+    kSleep,       // task = 眠ったタスク
+    kWakeup,      // task = 起こされたタスク, arg = レベル
+    kSendMessage, // task = 宛先, arg = メッセージ種別
+    kSyscall,     // task = 呼び出したタスク, arg = システムコール番号
+};
+
+struct TraceRecord {
+    uint64_t tsc;
+    uint64_t task;
+    uint64_t arg;
+    TraceEvent event;
+    uint16_t cpu;
+    uint32_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 32);
+
+/** @brief トレースが有効なら true。SyscallEntry からも参照する。 */
+extern volatile bool trace_enabled;
+
+void TraceSlow(TraceEvent event, uint64_t task, uint64_t arg);
+
+/** @brief 記録を 1 つ追加する。トレースが無効なら何もしない。 */
+inline void Trace(TraceEvent event, uint64_t task, uint64_t arg = 0) {
+    if (trace_enabled) {
+        TraceSlow(event, task, arg);
+    }
+}
+
+/** @brief 全 CPU のバッファを空にする。 */
+void ClearTrace();
+
+/** @brief 全 CPU の記録を時刻順に並べて返す。呼び出し中は記録を止める。 */
+std::vector<TraceRecord> CollectTrace();
+
+/** @brief ヒストグラムのビン数。ビン k は [2^k, 2^(k+1)) マイクロ秒（ビン 0 は 2 未満すべて）。 */
+const int kTraceHistBuckets = 16;
+
+struct TaskTraceStats {
+    uint64_t task;
+    uint32_t wakeup_latency[kTraceHistBuckets]; // Wakeup されてから実行されるまで
+    uint32_t run_time[kTraceHistBuckets];       // 切り替えで実行を始めてから明け渡すまで
+};
+
+struct TraceSummary {
+    uint64_t preempts, switches, wakeups, messages, syscalls;
+    std::vector<TaskTraceStats> tasks;
+};
+
+/** @brief 時刻順の記録からタスクごとの待ち時間と実行時間のヒストグラムを作る。 */
+TraceSummary SummarizeTrace(const std::vector<TraceRecord>& records);
+
@@ -314,9 +314,8 @@ namespace {
 
   void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
     bool intel_ehc_exist = false;
-    for (int i = 0; i < pci::num_device; ++i) {
-      if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x20u) /* EHCI */ &&
-          0x8086 == pci::ReadVendorId(pci::devices[i])) {
+    for (auto ehc : pci::FindDevicesByClass(0x0cu, 0x03u, 0x20u) /* EHCI */) {
+      if (0x8086 == ehc->vendor_id) {
         intel_ehc_exist = true;
         break;
       }
@@ -533,13 +532,10 @@ namespace usb::xhci {
   void Initialize() {
     // Intel 製を優先して xHC を探す
     pci::Device* xhc_dev = nullptr;
-    for (int i = 0; i < pci::num_device; ++i) {
-      if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x30u)) {
-        xhc_dev = &pci::devices[i];
-
-        if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
-          break;
-        }
+    for (auto dev : pci::FindDevicesByClass(0x0cu, 0x03u, 0x30u)) {
+      xhc_dev = dev;
+      if (0x8086 == dev->vendor_id) {
+        break;
       }
     }
 
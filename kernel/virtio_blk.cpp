@@ -0,0 +1,284 @@
+#include "virtio_blk.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    // レガシーインターフェースのレジスタ（BAR0 の I/O 空間からのオフセット）
+    const uint16_t kRegDeviceFeatures = 0x00;
+    const uint16_t kRegGuestFeatures  = 0x04;
+    const uint16_t kRegQueueAddress   = 0x08;
+    const uint16_t kRegQueueSize      = 0x0c;
+    const uint16_t kRegQueueSelect    = 0x0e;
+    const uint16_t kRegQueueNotify    = 0x10;
+    const uint16_t kRegDeviceStatus   = 0x12;
+    const uint16_t kRegConfigVector   = 0x14; // MSI-X を有効にしたときだけ存在する
+    const uint16_t kRegQueueVector    = 0x16;
+    const uint16_t kNoVector = 0xffff;
+
+    const uint8_t kStatusAcknowledge = 1;
+    const uint8_t kStatusDriver      = 2;
+    const uint8_t kStatusDriverOK    = 4;
+    const uint8_t kStatusFailed      = 128;
+
+    const uint16_t kDescNext  = 1;
+    const uint16_t kDescWrite = 2; // デバイスが書き込む
+
+    const uint32_t kRequestIn  = 0;
+    const uint32_t kRequestOut = 1;
+
+    const size_t kPageBytes = 4096;
+
+    size_t AlignPage(size_t bytes) {
+        return (bytes + kPageBytes - 1) & ~(kPageBytes - 1);
+    }
+
+    WithError<uint8_t*> AllocateFrames(size_t bytes) {
+        auto [ frame, err ] = memory_manager->Allocate(AlignPage(bytes) / kBytesPerFrame);
+        if (err) {
+            return { nullptr, err };
+        }
+        auto p = reinterpret_cast<uint8_t*>(frame.Frame());
+        memset(p, 0, AlignPage(bytes));
+        return { p, MAKE_ERROR(Error::kSuccess) };
+    }
+
+    struct UsedElement {
+        uint32_t id;
+        uint32_t len;
+    } __attribute__((packed));
+}
+
+namespace virtio {
+    bool IsLegacyBlockDevice(const pci::Device& dev) {
+        // 0x1001 はレガシー（トランジショナル）版の virtio-blk
+        return dev.vendor_id == 0x1af4 && dev.device_id == 0x1001;
+    }
+
+    BlockDevice::BlockDevice(const pci::Device& dev) : dev_{dev} {
+    }
+
+    Error BlockDevice::Initialize() {
+        auto [ bar, bar_err ] = pci::ReadBar(dev_, 0);
+        if (bar_err) {
+            return bar_err;
+        }
+        if ((bar & 1) == 0) { // レガシーインターフェースは I/O 空間にある
+            return MAKE_ERROR(Error::kUnknownDevice);
+        }
+        io_base_ = bar & ~0x3u;
+
+        // I/O 空間とバスマスタを有効にする
+        pci::WriteConfReg(dev_, 0x04, pci::ReadConfReg(dev_, 0x04) | 0x5);
+
+        IoOut8(io_base_ + kRegDeviceStatus, 0); // リセット
+        IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge);
+        IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver);
+        IoIn32(io_base_ + kRegDeviceFeatures);
+        IoOut32(io_base_ + kRegGuestFeatures, 0); // 追加機能は使わない
+
+        IoOut16(io_base_ + kRegQueueSelect, 0);
+        queue_size_ = IoIn16(io_base_ + kRegQueueSize);
+        num_slots_ = std::min<int>(kMaxSlots, queue_size_ / kDescPerSlot);
+        if (num_slots_ < 1) {
+            IoOut8(io_base_ + kRegDeviceStatus, kStatusFailed);
+            return MAKE_ERROR(Error::kInvalidDescriptor);
+        }
+
+        // レガシーの仮想キューは記述子表と avail リング，ページ境界から used リングを置く
+        const size_t avail_offset = sizeof(Descriptor) * queue_size_;
+        const size_t used_offset = AlignPage(avail_offset + 2 * (3 + queue_size_));
+        const size_t queue_bytes = used_offset + AlignPage(2 * 3 + 8 * queue_size_);
+        auto [ queue, queue_err ] = AllocateFrames(queue_bytes);
+        if (queue_err) {
+            return queue_err;
+        }
+        desc_ = reinterpret_cast<Descriptor*>(queue);
+        avail_ = reinterpret_cast<volatile uint16_t*>(queue + avail_offset);
+        used_ = reinterpret_cast<volatile uint16_t*>(queue + used_offset);
+
+        // 各スロットの要求ヘッダ（16 バイト）と状態バイトを 1 ページにまとめて置く
+        auto [ req, req_err ] = AllocateFrames(kPageBytes);
+        if (req_err) {
+            return req_err;
+        }
+        for (int i = 0; i < num_slots_; ++i) {
+            slots_[i].header = reinterpret_cast<RequestHeader*>(req + 32 * i);
+            slots_[i].status = req + 32 * i + sizeof(RequestHeader);
+        }
+
+        auto [ bounce, bounce_err ] = AllocateFrames(kBounceBytes);
+        if (bounce_err) {
+            return bounce_err;
+        }
+        bounce_ = bounce;
+
+        IoOut32(io_base_ + kRegQueueAddress, reinterpret_cast<uintptr_t>(queue) / kPageBytes);
+
+        // 完了は MSI-X で知らせてもらう。使えなければ同期要求だけを扱う。
+        const uint8_t bsp_local_apic_id =
+            *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+        config_offset_ = 0x14;
+        if (!pci::ConfigureMSIFixedDestination(
+                dev_, bsp_local_apic_id,
+                pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed,
+                InterruptVector::kBlockIO, 0)) {
+            config_offset_ = 0x18;
+            IoOut16(io_base_ + kRegConfigVector, kNoVector);
+            IoOut16(io_base_ + kRegQueueVector, 0);
+            interrupt_ = IoIn16(io_base_ + kRegQueueVector) == 0;
+        }
+
+        capacity_ = IoIn32(io_base_ + config_offset_) |
+                    static_cast<uint64_t>(IoIn32(io_base_ + config_offset_ + 4)) << 32;
+        IoOut8(io_base_ + kRegDeviceStatus,
+               kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error BlockDevice::Read(uint64_t lba, void* buf, size_t num_blocks) {
+        auto dst = reinterpret_cast<uint8_t*>(buf);
+        const size_t max_blocks = kBounceBytes / kSectorSize;
+        while (num_blocks > 0) {
+            const size_t n = std::min(num_blocks, max_blocks);
+            const bool intr = DisableInterrupts();
+            lock_.Lock();
+            auto err = SubmitSync(kRequestIn, lba, n * kSectorSize);
+            if (!err) {
+                memcpy(dst, bounce_, n * kSectorSize);
+            }
+            lock_.Unlock();
+            RestoreInterrupts(intr);
+            if (err) {
+                return err;
+            }
+            dst += n * kSectorSize;
+            lba += n;
+            num_blocks -= n;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error BlockDevice::Write(uint64_t lba, const void* buf, size_t num_blocks) {
+        auto src = reinterpret_cast<const uint8_t*>(buf);
+        const size_t max_blocks = kBounceBytes / kSectorSize;
+        while (num_blocks > 0) {
+            const size_t n = std::min(num_blocks, max_blocks);
+            const bool intr = DisableInterrupts();
+            lock_.Lock();
+            memcpy(bounce_, src, n * kSectorSize);
+            auto err = SubmitSync(kRequestOut, lba, n * kSectorSize);
+            lock_.Unlock();
+            RestoreInterrupts(intr);
+            if (err) {
+                return err;
+            }
+            src += n * kSectorSize;
+            lba += n;
+            num_blocks -= n;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    bool BlockDevice::StartCommand(BlockCommand& cmd) {
+        uint64_t blocks = 0;
+        for (const auto& seg : cmd.segments) {
+            blocks += seg.bytes / kSectorSize;
+        }
+        if (cmd.segments.size() > kMaxSegments || cmd.lba + blocks > capacity_) {
+            return false;
+        }
+
+        const bool intr = DisableInterrupts();
+        lock_.Lock();
+        int slot = 1;
+        while (slot < num_slots_ && slots_[slot].cmd) {
+            ++slot;
+        }
+        if (slot < num_slots_) {
+            slots_[slot].cmd = &cmd;
+            PostLocked(slot, cmd.op == BlockRequest::kRead ? kRequestIn : kRequestOut,
+                       cmd.lba, cmd.segments.data(), cmd.segments.size());
+        }
+        lock_.Unlock();
+        RestoreInterrupts(intr);
+        return slot < num_slots_;
+    }
+
+    void BlockDevice::ReapCommands(std::vector<BlockCommand*>& done) {
+        const bool intr = DisableInterrupts();
+        lock_.Lock();
+        ReapLocked();
+        for (int slot = 1; slot < num_slots_; ++slot) {
+            auto& s = slots_[slot];
+            if (s.cmd && s.done) {
+                s.cmd->result = *s.status == 0 ? Error::kSuccess : Error::kTransferFailed;
+                done.push_back(s.cmd);
+                s.cmd = nullptr;
+                s.done = false;
+            }
+        }
+        lock_.Unlock();
+        RestoreInterrupts(intr);
+    }
+
+    void BlockDevice::PostLocked(int slot, uint32_t type, uint64_t sector,
+                                 const IOSegment* segments, size_t num_segments) {
+        auto& s = slots_[slot];
+        *s.header = {type, 0, sector};
+        *s.status = 0xff;
+        s.done = false;
+
+        const uint16_t head = slot * kDescPerSlot;
+        const uint16_t data_flags = kDescNext | (type == kRequestIn ? kDescWrite : 0);
+        desc_[head] = {reinterpret_cast<uintptr_t>(s.header), sizeof(RequestHeader),
+                       kDescNext, static_cast<uint16_t>(head + 1)};
+        for (size_t i = 0; i < num_segments; ++i) {
+            const uint16_t d = head + 1 + i;
+            desc_[d] = {reinterpret_cast<uintptr_t>(segments[i].buf),
+                        static_cast<uint32_t>(segments[i].bytes),
+                        data_flags, static_cast<uint16_t>(d + 1)};
+        }
+        desc_[head + 1 + num_segments] = {reinterpret_cast<uintptr_t>(s.status), 1,
+                                          kDescWrite, 0};
+
+        const uint16_t avail_idx = avail_[1];
+        avail_[2 + avail_idx % queue_size_] = head;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        avail_[1] = avail_idx + 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        IoOut16(io_base_ + kRegQueueNotify, 0);
+    }
+
+    void BlockDevice::ReapLocked() {
+        auto elems = reinterpret_cast<volatile UsedElement*>(used_ + 2);
+        while (used_[1] != last_used_idx_) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            const uint32_t head = elems[last_used_idx_ % queue_size_].id;
+            slots_[head / kDescPerSlot].done = true;
+            ++last_used_idx_;
+        }
+    }
+
+    Error BlockDevice::SubmitSync(uint32_t type, uint64_t sector, size_t bytes) {
+        if (sector + bytes / kSectorSize > capacity_) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+        const IOSegment seg{bounce_, bytes};
+        PostLocked(0, type, sector, &seg, 1);
+        while (true) {
+            ReapLocked();
+            if (slots_[0].done) {
+                break;
+            }
+            __asm__("pause");
+        }
+        slots_[0].done = false;
+        return *slots_[0].status == 0 ? MAKE_ERROR(Error::kSuccess)
+                                      : MAKE_ERROR(Error::kTransferFailed);
+    }
+}
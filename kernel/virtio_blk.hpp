@@ -0,0 +1,93 @@
+/**
+ * @file virtio_blk.hpp
+ *
+ * virtio-blk（レガシーインターフェース）のドライバ。
+ *
+ * 仮想キューを記述子 kDescPerSlot 個ずつのスロットに分け，スロット 0 は同期的な
+ * Read/Write 専用にする。同期要求は完了をポーリングで待つので，割り込み禁止中
+ * （ページフォルトの処理中など）からも呼べる。残りのスロットは非同期コマンド用で，
+ * 完了は MSI-X 割り込みで I/O タスクへ知らせる。
+ */
+
+#pragma once
+
+#include <array>
+
+#include "block_device.hpp"
+#include "pci.hpp"
+#include "spinlock.hpp"
+
+namespace virtio {
+    /** @brief dev がレガシーインターフェースを持つ virtio-blk なら true */
+    bool IsLegacyBlockDevice(const pci::Device& dev);
+
+    class BlockDevice : public ::BlockDevice {
+    public:
+        explicit BlockDevice(const pci::Device& dev);
+        Error Initialize();
+
+        Error Read(uint64_t lba, void* buf, size_t num_blocks) override;
+        Error Write(uint64_t lba, const void* buf, size_t num_blocks) override;
+        uint64_t NumBlocks() const override { return capacity_; }
+        size_t BlockSize() const override { return kSectorSize; }
+
+        int QueueDepth() const override { return interrupt_ ? num_slots_ - 1 : 0; }
+        size_t MaxSegments() const override { return kMaxSegments; }
+        bool StartCommand(BlockCommand& cmd) override;
+        void ReapCommands(std::vector<BlockCommand*>& done) override;
+
+    private:
+        static const size_t kSectorSize = 512; // virtio-blk のセクタは常に 512 バイト
+        static const size_t kBounceBytes = 64 * 1024;
+        static const size_t kMaxSegments = 16;
+        static const size_t kDescPerSlot = kMaxSegments + 2; // ヘッダ，データ，状態
+        static const int kMaxSlots = 8;
+
+        struct Descriptor {
+            uint64_t addr;
+            uint32_t len;
+            uint16_t flags;
+            uint16_t next;
+        } __attribute__((packed));
+
+        struct RequestHeader {
+            uint32_t type;
+            uint32_t reserved;
+            uint64_t sector;
+        } __attribute__((packed));
+
+        struct Slot {
+            RequestHeader* header;
+            volatile uint8_t* status;
+            BlockCommand* cmd; // 非同期コマンド。nullptr なら空き
+            bool done;
+        };
+
+        pci::Device dev_;
+        uint16_t io_base_{0};
+        uint16_t config_offset_{0}; // デバイス固有の設定領域の位置（MSI-X の有無で変わる）
+        bool interrupt_{false};
+        uint64_t capacity_{0};
+        uint16_t queue_size_{0};
+
+        // 仮想キュー（物理アドレス＝仮想アドレスのフレーム上に置く）
+        Descriptor* desc_{nullptr};
+        volatile uint16_t* avail_{nullptr}; // flags, idx, ring[queue_size_]
+        volatile uint16_t* used_{nullptr};  // flags, idx, (id, len)[queue_size_]
+        uint16_t last_used_idx_{0};
+
+        std::array<Slot, kMaxSlots> slots_{};
+        int num_slots_{0};
+        uint8_t* bounce_{nullptr}; // 同期要求のデータの受け渡し用
+
+        Spinlock lock_;
+
+        /** @brief スロットの記述子をつないでデバイスへ渡す */
+        void PostLocked(int slot, uint32_t type, uint64_t sector,
+                        const IOSegment* segments, size_t num_segments);
+        /** @brief used リングを読み，完了したスロットに印を付ける */
+        void ReapLocked();
+        /** @brief スロット 0 で 1 つの要求（kBounceBytes 以下）を出して完了を待つ */
+        Error SubmitSync(uint32_t type, uint64_t sector, size_t bytes);
+    };
+}
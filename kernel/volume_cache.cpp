@@ -0,0 +1,433 @@
+#include "volume_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "asmfunc.h"
+#include "fat.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+    const uint64_t kVolumeWindowBase = 0xffff'a000'0000'0000; // PML4 のエントリ 320
+    const uint64_t kVolumeWindowMaxBytes = 512ul * 1024 * 1024 * 1024;
+    const size_t kPageBytes = 4096;
+    const size_t kMaxResidentPages = 4096; // 16 MiB
+    const size_t kFlushChunkBytes = 64 * 1024;
+    const size_t kMaxPrefetchPages = 256; // 先読みで同時に読み込み中にするページ数の上限
+
+    BlockDevice* volume_device;
+    uint64_t volume_bytes;
+
+    // 常駐ページの管理。すべて cache_lock で守る。
+    Spinlock cache_lock;
+    std::vector<uint64_t> resident; // 常駐しているページの窓内の番号（CLOCK の環）
+    size_t clock_hand;
+    VolumeCacheStats stats;
+    std::map<uint64_t, uintptr_t> prefetching; // 先読み中のページ → 読み込み先のフレーム
+    std::map<uint64_t, int> flushing; // 書き戻し中のページ → 書き戻している FlushVolume の数
+    // 各 CPU がページフォルトで読み込み中のページの番号 + 1（0 なら無し）。書き換えは cache_lock の
+    // 中で行う。同じページでフォルトした CPU は cache_lock を放し，これが変わるのを待つ。
+    std::array<std::atomic<uint64_t>, kMaxCPUs> loading_page{};
+
+    const uint64_t kAccessed = 1u << 5, kDirty = 1u << 6;
+
+    /** @brief 追い出したが，他の CPU の TLB に残っているかもしれないフレーム */
+    struct QuarantinedFrame {
+        uintptr_t frame;
+        uint64_t epoch; // すべての CPU がこの世代以降に TLB を捨てれば再利用できる
+    };
+    std::deque<QuarantinedFrame> quarantine;
+
+    std::atomic<uint64_t> tlb_epoch{0};
+    std::array<std::atomic<uint64_t>, kMaxCPUs> flushed_epoch{};
+
+    uint64_t MinFlushedEpoch() {
+        uint64_t epoch = UINT64_MAX;
+        for (int cpu = 0; cpu < num_cpus; ++cpu) {
+            epoch = std::min(epoch, flushed_epoch[cpu].load());
+        }
+        return epoch;
+    }
+
+    void FlushLocalTLB() {
+        const uint64_t epoch = tlb_epoch.load(); // 捨てる前に読む
+        SetCR3(GetCR3());
+        flushed_epoch[CurrentCPU()].store(epoch);
+    }
+
+    uint64_t PageAddress(uint64_t page) {
+        return kVolumeWindowBase + page * kPageBytes;
+    }
+
+    /** @brief page をページフォルトで読み込み中の CPU の番号を返す。無ければ -1。 */
+    int LoadingCPULocked(uint64_t page) {
+        for (int cpu = 0; cpu < num_cpus; ++cpu) {
+            if (loading_page[cpu].load() == page + 1) {
+                return cpu;
+            }
+        }
+        return -1;
+    }
+
+    /** @brief CLOCK 法で 1 ページ追い出す。
+     *
+     * 書き換えられたページと書き戻し中のページは追い出さない。
+     * ダーティビットは書き戻しのたびに FlushVolume が落とすので，書き戻した後は追い出せる。
+     */
+    void EvictOneLocked() {
+        for (size_t n = 0; n < 2 * resident.size(); ++n, ++clock_hand) {
+            if (clock_hand >= resident.size()) {
+                clock_hand = 0;
+            }
+            const uint64_t addr = PageAddress(resident[clock_hand]);
+            auto pte = FindPageMapEntry(LinearAddress4Level{addr});
+            if ((pte->data & kDirty) || flushing.count(resident[clock_hand])) {
+                continue;
+            }
+            // CPU はアクセスビットとダーティビットを不可分に立てるので，こちらも不可分に操作する
+            if (__atomic_fetch_and(&pte->data, ~kAccessed, __ATOMIC_SEQ_CST) & kAccessed) {
+                continue;
+            }
+            const uint64_t old = __atomic_exchange_n(&pte->data, 0, __ATOMIC_SEQ_CST);
+            if (old & kDirty) { // 直前に書き込まれた
+                __atomic_store_n(&pte->data, old, __ATOMIC_SEQ_CST);
+                continue;
+            }
+            __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+
+            PageMapEntry entry{old};
+            quarantine.push_back({reinterpret_cast<uintptr_t>(entry.Pointer()),
+                                  tlb_epoch.fetch_add(1) + 1});
+            resident[clock_hand] = resident.back();
+            resident.pop_back();
+            ++stats.evictions;
+            return;
+        }
+    }
+
+    /** @brief ページを読み込むフレームを得る。得られなければ 0。 */
+    uintptr_t AcquireFrameLocked() {
+        if (resident.size() >= kMaxResidentPages) {
+            EvictOneLocked();
+        }
+        if (!quarantine.empty()) {
+            if (quarantine.front().epoch > MinFlushedEpoch()) {
+                FlushLocalTLB(); // 1 CPU ならこれで再利用できる
+            }
+            if (quarantine.front().epoch <= MinFlushedEpoch()) {
+                const uintptr_t frame = quarantine.front().frame;
+                quarantine.pop_front();
+                return frame;
+            }
+        }
+        // 他の CPU がまだ TLB を捨てていなければ，一時的に上限を超えて割り当てる
+        auto [ frame, err ] = memory_manager->Allocate(1);
+        if (err) {
+            return 0;
+        }
+        return reinterpret_cast<uintptr_t>(frame.Frame());
+    }
+
+    /** @brief 先読み要求の完了処理。読み込んだフレームを窓にマップする。I/O タスク上で呼ばれる。 */
+    void OnPrefetchCompleted(BlockRequest* req, Error::Code result) {
+        const uint64_t first_page = req->lba * volume_device->BlockSize() / kPageBytes;
+
+        const bool intr = DisableInterrupts();
+        cache_lock.Lock();
+        for (size_t i = 0; i < req->segments.size(); ++i) {
+            const uint64_t page = first_page + i;
+            const uintptr_t frame = reinterpret_cast<uintptr_t>(req->segments[i].buf);
+            prefetching.erase(page);
+
+            const LinearAddress4Level page_addr{PageAddress(page)};
+            auto pte = FindPageMapEntry(page_addr);
+            // 待たずに触れられてページフォルトで読み込まれていたら，このフレームは使わない
+            if (result != Error::kSuccess || (pte && pte->bits.present) ||
+                MapKernelPages(page_addr, frame, 1)) {
+                quarantine.push_front({frame, 0});
+                continue;
+            }
+            resident.push_back(page);
+            ++stats.prefetched_pages;
+        }
+        cache_lock.Unlock();
+        RestoreInterrupts(intr);
+        delete req;
+    }
+
+    /** @brief ページを書き戻し中にし，ダーティビットを落とす。
+     *
+     * 他の CPU の TLB には「書き換え済み」のエントリが残っていて，それを通した書き込みは
+     * ダーティビットを立て直さない。戻り値の世代まですべての CPU が TLB を捨ててから
+     * 内容をコピーすれば，その間の書き込みもコピーに含まれる。
+     */
+    uint64_t BeginFlushLocked(const std::vector<uint64_t>& pages) {
+        for (auto page : pages) {
+            ++flushing[page];
+            const uint64_t addr = PageAddress(page);
+            auto pte = FindPageMapEntry(LinearAddress4Level{addr});
+            if (pte && pte->bits.present) {
+                __atomic_fetch_and(&pte->data, ~kDirty, __ATOMIC_SEQ_CST);
+                __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+            }
+        }
+        return tlb_epoch.fetch_add(1) + 1;
+    }
+
+    /** @brief 書き戻し中を解除する。書き戻しに失敗したページはダーティビットを立て直して残す。 */
+    void EndFlushLocked(const std::vector<uint64_t>& pages, bool failed) {
+        for (auto page : pages) {
+            if (--flushing[page] == 0) {
+                flushing.erase(page);
+            }
+            if (!failed) {
+                continue;
+            }
+            auto pte = FindPageMapEntry(LinearAddress4Level{PageAddress(page)});
+            if (pte && pte->bits.present) {
+                __atomic_fetch_or(&pte->data, kDirty, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    /** @brief 窓の dirty な範囲を書き戻す要求。バッファは要求と一緒に解放する。 */
+    struct FlushRequest {
+        BlockRequest req;
+        std::vector<uint8_t> buf;
+    };
+}
+
+void* MapVolume(BlockDevice& dev) {
+    volume_device = &dev;
+    volume_bytes = std::min(dev.NumBlocks() * dev.BlockSize(), kVolumeWindowMaxBytes);
+    resident.reserve(kMaxResidentPages);
+    return reinterpret_cast<void*>(kVolumeWindowBase);
+}
+
+bool IsVolumePaged() {
+    return volume_device != nullptr;
+}
+
+bool HandleVolumePageFault(uint64_t addr) {
+    if (volume_device == nullptr ||
+        addr < kVolumeWindowBase || addr >= kVolumeWindowBase + volume_bytes) {
+        return false;
+    }
+    const uint64_t page = (addr - kVolumeWindowBase) / kPageBytes;
+    const LinearAddress4Level page_addr{PageAddress(page)};
+
+    // #PF は割り込みゲートなので割り込みは禁止されている
+    while (true) {
+        cache_lock.Lock();
+        if (auto pte = FindPageMapEntry(page_addr); pte && pte->bits.present) {
+            cache_lock.Unlock(); // 他の CPU が先に読み込んだ
+            return true;
+        }
+        const int cpu = LoadingCPULocked(page);
+        if (cpu < 0) {
+            break;
+        }
+        cache_lock.Unlock();
+        // 他の CPU がこのページを同期的に読んでいる。I/O タスクを待たずに終わるので，ここで待ってよい。
+        while (loading_page[cpu].load() == page + 1) {
+            __asm__("pause");
+        }
+    }
+    // 先読みの完了は I/O タスクが処理するので，割り込み禁止のここでは待てない。
+    // 読み直すしかないが，先読みした側が完了を待ってから触れていれば起こらない。
+    if (prefetching.count(page)) {
+        ++stats.faults_on_prefetching;
+    }
+
+    const uintptr_t frame = AcquireFrameLocked();
+    if (frame == 0) {
+        cache_lock.Unlock();
+        return false;
+    }
+    // デバイスとの往復の間 cache_lock を持っていると，他の CPU のページフォルトや
+    // 書き戻しまで待たせるので，読み込み中の印を付けてから放す
+    auto& loading = loading_page[CurrentCPU()];
+    loading.store(page + 1);
+    cache_lock.Unlock();
+
+    const size_t block_size = volume_device->BlockSize();
+    const uint64_t lba = page * kPageBytes / block_size;
+    const size_t num_blocks = std::min<uint64_t>(kPageBytes / block_size,
+                                                 volume_device->NumBlocks() - lba);
+    auto buf = reinterpret_cast<uint8_t*>(frame);
+    memset(buf + num_blocks * block_size, 0, kPageBytes - num_blocks * block_size);
+    Error err = volume_device->Read(lba, buf, num_blocks);
+
+    cache_lock.Lock();
+    loading.store(0);
+    if (!err) {
+        if (auto pte = FindPageMapEntry(page_addr); pte && pte->bits.present) {
+            // 読んでいる間に先読みの完了がマップした
+            quarantine.push_front({frame, 0});
+            cache_lock.Unlock();
+            return true;
+        }
+        err = MapKernelPages(page_addr, frame, 1);
+    }
+    if (err) {
+        quarantine.push_front({frame, 0}); // どこにもマップしていないのですぐ使える
+        cache_lock.Unlock();
+        return false;
+    }
+    resident.push_back(page);
+    ++stats.faults;
+    cache_lock.Unlock();
+    return true;
+}
+
+size_t PrefetchVolume(const void* addr, size_t bytes, BlockIOWaiter& waiter) {
+    const auto begin = reinterpret_cast<uint64_t>(addr);
+    if (volume_device == nullptr || volume_device->QueueDepth() == 0 ||
+        begin < kVolumeWindowBase || begin >= kVolumeWindowBase + volume_bytes) {
+        return 0;
+    }
+    const size_t block_size = volume_device->BlockSize();
+    const uint64_t first_page = (begin - kVolumeWindowBase) / kPageBytes;
+    // 末尾の端数ページはブロックの途中で切れるので，ページフォルトに任せる
+    const uint64_t end_page = std::min((begin - kVolumeWindowBase + bytes + kPageBytes - 1) / kPageBytes,
+                                       volume_bytes / kPageBytes);
+
+    std::vector<BlockRequest*> reqs;
+    BlockRequest* req = nullptr;
+    const bool intr = DisableInterrupts();
+    cache_lock.Lock();
+    for (uint64_t page = first_page; page < end_page; ++page) {
+        auto pte = FindPageMapEntry(LinearAddress4Level{PageAddress(page)});
+        if ((pte && pte->bits.present) || prefetching.count(page) ||
+            LoadingCPULocked(page) >= 0 || prefetching.size() >= kMaxPrefetchPages) {
+            req = nullptr; // 連続が途切れた
+            continue;
+        }
+        const uintptr_t frame = AcquireFrameLocked();
+        if (frame == 0) {
+            break;
+        }
+        prefetching[page] = frame;
+
+        // ページが続いている間は 1 つの要求にまとめる（1 ページ 1 区間）
+        if (req == nullptr || req->segments.size() >= volume_device->MaxSegments()) {
+            req = new BlockRequest{BlockRequest::kRead, page * kPageBytes / block_size};
+            req->waiter = &waiter;
+            req->on_complete = OnPrefetchCompleted;
+            reqs.push_back(req);
+        }
+        req->segments.push_back({reinterpret_cast<void*>(frame), kPageBytes});
+    }
+    cache_lock.Unlock();
+    RestoreInterrupts(intr);
+
+    waiter.remaining += reqs.size();
+    for (auto r : reqs) {
+        volume_device->Submit(r);
+    }
+    return reqs.size();
+}
+
+void VolumeTLBTick() {
+    if (volume_device && flushed_epoch[CurrentCPU()].load() != tlb_epoch.load()) {
+        FlushLocalTLB();
+    }
+}
+
+Error FlushVolume() {
+    if (volume_device == nullptr) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const size_t block_size = volume_device->BlockSize();
+    const size_t sector_bytes = fat::boot_volume_image->bytes_per_sector;
+    const auto window = reinterpret_cast<const uint8_t*>(kVolumeWindowBase);
+
+    auto ranges = fat::TakeDirtySectors();
+    std::vector<uint64_t> pages;
+    for (const auto& [ first, count ] : ranges) {
+        const uint64_t last_page = ((first + count) * sector_bytes - 1) / kPageBytes;
+        for (uint64_t page = first * sector_bytes / kPageBytes; page <= last_page; ++page) {
+            if (pages.empty() || pages.back() != page) {
+                pages.push_back(page);
+            }
+        }
+    }
+
+    bool intr = DisableInterrupts();
+    cache_lock.Lock();
+    const uint64_t epoch = BeginFlushLocked(pages);
+    cache_lock.Unlock();
+    FlushLocalTLB();
+    RestoreInterrupts(intr);
+    // 古い TLB エントリを通した書き込みが終わるまで待つ（長くてもタイマ割り込み 1 周期）
+    while (MinFlushedEpoch() < epoch) {
+        __asm__("pause");
+    }
+
+    // すべての範囲を非同期要求として一度に出し，デバイスに併合と並行処理を任せる。
+    // 窓から直接渡すとデバイスの読み出し中にページが書き換えられうるので，一度コピーする。
+    std::vector<FlushRequest*> reqs;
+    for (const auto& [ first, count ] : ranges) {
+        const uint64_t begin = first * sector_bytes;
+        const uint64_t end = begin + count * sector_bytes;
+        for (uint64_t offset = begin; offset < end; offset += kFlushChunkBytes) {
+            const size_t bytes = std::min<uint64_t>(kFlushChunkBytes, end - offset);
+            auto r = new FlushRequest{{BlockRequest::kWrite, offset / block_size}};
+            r->buf.assign(window + offset, window + offset + bytes);
+            r->req.segments.push_back({r->buf.data(), bytes});
+            reqs.push_back(r);
+        }
+    }
+    BlockIOWaiter waiter{reqs.size()};
+    waiter.task_id = task_manager->CurrentTask().ID();
+    waiter.tag = reinterpret_cast<uint64_t>(&waiter);
+    for (auto r : reqs) {
+        r->req.waiter = &waiter;
+        volume_device->Submit(&r->req);
+    }
+
+    const size_t errors = WaitBlockIOCompletions(waiter);
+
+    uint64_t flushed = 0;
+    for (auto r : reqs) {
+        flushed += r->buf.size() / sector_bytes;
+        delete r;
+    }
+
+    intr = DisableInterrupts();
+    cache_lock.Lock();
+    EndFlushLocked(pages, errors > 0);
+    if (errors > 0) {
+        cache_lock.Unlock();
+        RestoreInterrupts(intr);
+        // どの範囲が失敗したかは区別せず，すべて次回に回す
+        for (const auto& [ first, count ] : ranges) {
+            fat::MarkDirty(window + first * sector_bytes, count * sector_bytes);
+        }
+        return MAKE_ERROR(Error::kTransferFailed);
+    }
+    stats.flushed_sectors += flushed;
+    cache_lock.Unlock();
+    RestoreInterrupts(intr);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+VolumeCacheStats GetVolumeCacheStats() {
+    const bool intr = DisableInterrupts();
+    cache_lock.Lock();
+    VolumeCacheStats s = stats;
+    s.resident_pages = resident.size();
+    cache_lock.Unlock();
+    RestoreInterrupts(intr);
+    return s;
+}
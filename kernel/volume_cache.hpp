@@ -0,0 +1,64 @@
+/**
+ * @file volume_cache.hpp
+ *
+ * ブロックデバイス上のボリュームを仮想アドレスの窓として見せるプログラムを集めたファイル。
+ *
+ * 窓のページは初めて触れたときにページフォルトでデバイスから読み込む（デマンドページング）。
+ * 常駐ページ数が上限に達したら，アクセスビットを使う CLOCK 法（LRU の近似）で
+ * 書き換えられていないページを追い出す（書き戻したページは再び追い出せる）。
+ * FAT のコードはボリューム全体がメモリ上にあるものとしてそのまま動く。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block_device.hpp"
+#include "error.hpp"
+
+/** @brief dev の全体を窓に割り当て，窓の先頭アドレスを返す。ページはまだ読み込まない。 */
+void* MapVolume(BlockDevice& dev);
+
+/** @brief ボリュームが窓を通して見えている（ブロックデバイス上にある）なら true */
+bool IsVolumePaged();
+
+/** @brief addr が窓の中なら該当ページを読み込んでマップし true を返す。
+ *
+ * カーネルからの，存在しないページへのアクセスによる #PF から呼ぶ。
+ */
+bool HandleVolumePageFault(uint64_t addr);
+
+/** @brief 追い出したページの TLB エントリがこの CPU に残っていれば捨てる。
+ *
+ * 各 CPU のタイマ割り込みから呼ぶ。追い出したフレームは，すべての CPU が
+ * これを通過するまで再利用しないので，TLB シュートダウンの IPI は要らない。
+ */
+void VolumeTLBTick();
+
+/** @brief addr から bytes バイトのうち常駐していないページの読み込みを非同期に始める。
+ *
+ * 発行した要求は waiter に結びつけ，その数だけ waiter.remaining を増やしてから，
+ * 完了を待たずに戻る。読み込み中のページにはその完了を待ってから触れること。
+ * 待たずに触れると，ページフォルトで同じページを改めて同期的に読み込んでしまう。
+ *
+ * @return  発行した要求の数
+ */
+size_t PrefetchVolume(const void* addr, size_t bytes, BlockIOWaiter& waiter);
+
+/** @brief fat::MarkDirty で記録された範囲をデバイスへ書き戻す。
+ *
+ * 書き込み要求をまとめて発行し，すべて完了するまで待つ。タスクから呼ぶこと。
+ */
+Error FlushVolume();
+
+struct VolumeCacheStats {
+    uint64_t resident_pages;  // 常駐しているページ数
+    uint64_t faults;          // デバイスから読み込んだ回数
+    uint64_t evictions;       // 追い出した回数
+    uint64_t flushed_sectors; // 書き戻したセクタ数
+    uint64_t prefetched_pages; // 先読みで読み込んだページ数
+    uint64_t faults_on_prefetching; // 先読み中のページに触れて読み直した回数
+};
+
+VolumeCacheStats GetVolumeCacheStats();